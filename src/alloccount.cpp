@@ -0,0 +1,60 @@
+// ==============================================================
+//                  ORBITER MODULE: Rcontrol
+//
+// alloccount.cpp
+//
+// Replaces the global operator new so that every heap
+// allocation made through it is counted per thread.
+// ==============================================================
+
+#include "alloccount.h"
+#include <new>
+#include <stdlib.h>
+
+// Plain data so it needs no initialisation before the first
+// allocation of a thread
+static thread_local uint64_t allocations = 0;
+
+/**
+ * @brief Heap allocations made by the calling thread so far
+ * @return Number of calls to operator new
+ */
+uint64_t heap_allocations()
+{
+  return allocations;
+}
+
+void *operator new(size_t size)
+{
+  allocations++;
+  void *p = malloc(size ? size : 1);
+  if (p == NULL)
+    throw std::bad_alloc();
+  return p;
+}
+
+void *operator new[](size_t size)
+{
+  return operator new(size);
+}
+
+void *operator new(size_t size, const std::nothrow_t &) noexcept
+{
+  allocations++;
+  return malloc(size ? size : 1);
+}
+
+void *operator new[](size_t size, const std::nothrow_t &) noexcept
+{
+  return operator new(size, std::nothrow);
+}
+
+void operator delete(void *p) noexcept
+{
+  free(p);
+}
+
+void operator delete[](void *p) noexcept
+{
+  free(p);
+}
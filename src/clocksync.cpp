@@ -0,0 +1,97 @@
+// ==============================================================
+//                  ORBITER MODULE: Rcontrol
+//
+// clocksync.cpp
+//
+// Local clock to simulation time estimator.
+// ==============================================================
+
+#include "clocksync.h"
+
+/**
+ * @brief Constructor for an estimator with no exchanges yet
+ */
+ClockSync::ClockSync()
+  : count(0), next(0), best(0), srtt(0), rttvar(0)
+{
+}
+
+/**
+ * Record one SYNC_CLOCK exchange. Exchanges whose request was
+ * retransmitted must not be added, the reply may answer any of
+ * the copies. A change of time acceleration invalidates the
+ * exchanges made before it.
+ * @brief Add a clock exchange
+ * @param sentUs Local time the request was sent
+ * @param repliedUs Local time the reply was received
+ * @param received Simulation time the client received the request
+ * @param sent Simulation time the client sent the reply
+ * @param warp Time acceleration of the simulation, 1 for real time
+ */
+void ClockSync::add(int64_t sentUs, int64_t repliedUs, double received, double sent, double warp)
+{
+  if (warp <= 0)
+    warp = 1;
+  int64_t held = (int64_t)((sent - received) / warp * 1e6);
+  int64_t rtt = repliedUs - sentUs - held;
+  if (rtt < 0)
+    rtt = 0;
+  if (count > 0 && samples[best].warp != warp)
+    count = next = 0;
+
+  // Smoothed like TCP's round trip estimate, gains of 1/8 and 1/4
+  if (count == 0) {
+    srtt = rtt;
+    rttvar = rtt / 2;
+  }
+  else {
+    int64_t error = rtt - srtt;
+    srtt += error / 8;
+    rttvar += ((error < 0 ? -error : error) - rttvar) / 4;
+  }
+
+  Sample &sample = samples[next];
+  sample.localUs = sentUs + rtt / 2;
+  sample.simTime = received;
+  sample.warp = warp;
+  sample.rttUs = rtt;
+  next = (next + 1) % CLOCK_SYNC_SAMPLES;
+  if (count < CLOCK_SYNC_SAMPLES)
+    count++;
+  best = 0;
+  for (int i = 1; i < count; i++) {
+    if (samples[i].rttUs < samples[best].rttUs)
+      best = i;
+  }
+}
+
+/**
+ * @brief Estimate the simulation time at a local instant
+ * @param localUs Local steady clock, microseconds
+ * @return Simulation time in seconds, only meaningful once synced()
+ */
+double ClockSync::sim_time(int64_t localUs) const
+{
+  const Sample &anchor = samples[best];
+  return anchor.simTime + anchor.warp * (double)(localUs - anchor.localUs) / 1e6;
+}
+
+/**
+ * @brief Estimate the local instant of a simulation time
+ * @param simTime Simulation time in seconds
+ * @return Local steady clock, microseconds, only meaningful once synced()
+ */
+int64_t ClockSync::local_us(double simTime) const
+{
+  const Sample &anchor = samples[best];
+  return anchor.localUs + (int64_t)((simTime - anchor.simTime) / anchor.warp * 1e6);
+}
+
+/**
+ * @brief Shortest round trip of the exchanges held
+ * @return Microseconds, 0 before the first exchange
+ */
+int64_t ClockSync::min_rtt_us() const
+{
+  return count > 0 ? samples[best].rttUs : 0;
+}
@@ -0,0 +1,17 @@
+// ==============================================================
+//                  ORBITER MODULE: Rcontrol
+//
+// alloccount.h
+//
+// Count of the heap allocations made by each thread, used to
+// check that the control loop's request path never allocates.
+// ==============================================================
+
+#ifndef ALLOCCOUNT_H
+#define ALLOCCOUNT_H
+
+#include <stdint.h>
+
+uint64_t heap_allocations();
+
+#endif //ALLOCCOUNT_H
@@ -0,0 +1,57 @@
+// ==============================================================
+//                  ORBITER MODULE: Rcontrol
+//
+// clocksync.h
+//
+// Maps the local steady clock onto the simulation time of the
+// client from SYNC_CLOCK exchanges, the way NTP maps a client
+// clock onto its server's, and keeps a running estimate of the
+// round trip time.
+// ==============================================================
+
+#ifndef CLOCKSYNC_H
+#define CLOCKSYNC_H
+
+#include <stdint.h>
+
+#define CLOCK_SYNC_SAMPLES 8	// exchanges kept, the one with the shortest round trip is trusted
+
+/**
+ * Each exchange gives the local send and receive times of a
+ * request and the simulation times at which the client received
+ * it and sent its reply. Of the recent exchanges, the one with
+ * the shortest round trip was delayed least on the way out, so
+ * it anchors the mapping. The simulation may run faster than
+ * real time, the client reports the time acceleration with each
+ * exchange.
+ * @brief Local clock to simulation time estimator
+ */
+class ClockSync
+{
+public:
+  ClockSync();
+  void add(int64_t sentUs, int64_t repliedUs, double received, double sent, double warp);
+  bool synced() const { return count > 0; }
+  double sim_time(int64_t localUs) const;
+  int64_t local_us(double simTime) const;
+  int64_t rtt_us() const { return srtt; }
+  int64_t rtt_var_us() const { return rttvar; }
+  int64_t min_rtt_us() const;
+private:
+  /**
+   * @brief One exchange, reduced to a point on both clocks
+   */
+  struct Sample {
+    int64_t localUs;	///< local time the client received the request
+    double simTime;	///< simulation time the client received it
+    double warp;	///< simulation seconds per real second
+    int64_t rttUs;	///< round trip less the time the client held the request
+  };
+  Sample samples[CLOCK_SYNC_SAMPLES];
+  int count;	// samples held
+  int next;	// slot the next sample replaces
+  int best;	// sample anchoring the mapping
+  int64_t srtt, rttvar;	// smoothed round trip and its mean deviation
+};
+
+#endif //CLOCKSYNC_H
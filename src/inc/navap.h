@@ -9,10 +9,123 @@
 
 #include "udpserver.h"
 #include "raybox.h"
+#include "scheduler.h"
+#include "spscqueue.h"
+#include "tasks.h"
 #include "types.h"
+#include <atomic>
 #include <thread>
 #include <string>
+#include <vector>
 
+#define PIPELINE_DEPTH 8 // Records each queue between the I/O and planning threads holds, a power of two
+#define PLAN_WAIT_MS 100 // Longest sleep of the planning thread before it checks whether to stop
+#define CRUISE_STEP_US 100000 // Time between two minor adjustments while on course
+#define ESCAPE_HOLD_US 200000 // Time an escape turn is held before its progress is judged
+
+/**
+ * Everything the decisions of a control tick read about the
+ * vessel, fetched once at the start of the tick so they all see
+ * the same instant
+ * @brief Snapshot of the vessel state
+ */
+struct VesselState {
+  double simTime;	///< simulation time of the snapshot, seconds
+  v3 position;	///< global position
+  v3 velocity;	///< metres per second since the previous snapshot
+  v3 angularVelocity;	///< pitch, yaw and bank rates
+  double pitch;
+  double bank;
+  double yaw;
+  v3 airspeed;	///< airspeed vector
+};
+
+/**
+ * @brief Vessel state sensed by the I/O thread, queued to the planning thread
+ */
+struct StateRecord {
+  uint32_t tick;	///< control tick the state was sensed in
+  int64_t sensedUs;	///< steady clock, microseconds
+  uint32_t answeredTick;	///< newest tick whose commands had been sent and answered, see TaskContext
+  VesselState state;
+  const std::vector<SceneObject> *scene;	///< objects sensed with the state, NULL if the snapshot failed
+};
+
+/**
+ * @brief Commands planned from one StateRecord, queued back to the I/O thread
+ */
+struct CommandRecord {
+  uint32_t tick;	///< tick of the state the commands were planned from
+  int64_t sensedUs;	///< when that state was sensed, steady clock
+  int64_t planUs;	///< time the planning took
+  unsigned long superseded;	///< newer states arrived while planning, the older ones were skipped
+  int lane;	///< Lane to send the commands in
+  int phase;	///< NavPhase the navigation is in after planning
+  ActuatorFrame frame;
+};
+
+/**
+ * The autopilot takes one step of its current phase per control
+ * tick. Every tick checks all the objects of the scene first and
+ * switches to NAV_AVOID while one of them is on the path.
+ * @brief Phases of the navigation
+ */
+enum NavPhase {
+  NAV_ALIGN_X = 0,	///< yawing until the x component angle matches the destination's
+  NAV_ALIGN_Y = 1,	///< pitching until the y component angle matches
+  NAV_CRUISE = 2,	///< on course, minor adjustments
+  NAV_AVOID = 3,	///< turning away from an object on the path
+  NAV_ARRIVED = 4,	///< within 5 m of the destination
+  NUM_NAV_PHASES = 5
+};
+
+class NavAP;
+
+/**
+ * Turns the vessel until the angle of one component of its
+ * position matches the destination's, reversing the turn when it
+ * overshoots
+ * @brief Alignment manoeuvre, about x with yaw or y with pitch
+ */
+class AlignTask : public ManoeuvreTask
+{
+public:
+  AlignTask(NavAP *nav, int phase) : nav(nav), phase(phase), turn(0), error(0) {}
+  int resume(const TaskContext &ctx);
+private:
+  NavAP *nav;
+  int phase;	// NAV_ALIGN_X or NAV_ALIGN_Y
+  int turn;	// direction of the last command, 1 negative, 2 positive, 0 none
+  double error;	// angle still to turn through
+};
+
+/**
+ * @brief Minor adjustments while on course, until the vessel drifts off it
+ */
+class CruiseTask : public ManoeuvreTask
+{
+public:
+  explicit CruiseTask(NavAP *nav) : nav(nav) {}
+  int resume(const TaskContext &ctx);
+private:
+  NavAP *nav;
+};
+
+/**
+ * Turns away from the object on the path and keeps going until
+ * the path is clear, reversing the turn once if the vessel gets
+ * closer to it
+ * @brief Collision escape manoeuvre
+ */
+class EscapeTask : public ManoeuvreTask
+{
+public:
+  explicit EscapeTask(NavAP *nav) : nav(nav), lastDistance(0) {}
+  int resume(const TaskContext &ctx);
+private:
+  NavAP *nav;
+  double lastDistance;	// distance to the object at the last state
+};
 
 /**
  * The NavAP class controls the navigation autopilot for remote navigation
@@ -20,10 +133,17 @@
  */
 class NavAP
 {
+  friend class AlignTask;
+  friend class CruiseTask;
+  friend class EscapeTask;
 public:
-  NavAP(std::string ip, int debug, std::string file);
+  NavAP(std::string ip, int debug, std::string file, const ServerOptions &options);
+  NavAP(UDPserver *session, int debug, std::string file, const ServerOptions &options);
   void init();
   void NavAPMain();
+  void startNavigation();
+  bool pollNavigation();
+  void stopNavigation();
   void getActiveIndex(int vesselIndex);
   bool isCollision;
   double currentThrust;
@@ -31,28 +151,38 @@ public:
   bool check_ping();
 private:
   void setNavDestination(v3 targetDest);
-  void getCurrentRotVel(v3 *currentRotVel);
-  void setBankSpeed(double value);
-  void setPitchSpeed(double value);
-  void setYawSpeed(double value);
-  void setPitch(double pitch);
-  double getPitch();
-  void setRoll(double roll);
-  double getBank();
-  void setYaw(double yaw);
-  double getYaw();
-  void setDir(v3 *dir, bool normal);
+  void setSceneQuery(const ServerOptions &options);
+  bool latestTelemetry(TelemetrySample *sample);
+  bool fetchVesselState(VesselState *state);
+  void setBankSpeed(const VesselState &state, double value);
+  void setPitchSpeed(const VesselState &state, double value);
+  void setYawSpeed(const VesselState &state, double value);
+  void setPitch(const VesselState &state, double pitch);
+  void setRoll(const VesselState &state, double roll);
+  void setYaw(const VesselState &state, double yaw);
+  void setDir(const VesselState &state, v3 *dir, bool normal);
   double getDistance(v3 heading);
-  double getAirspeedAngle();
-  void getHeading(v3 *heading, bool normal);
+  double getAirspeedAngle(const VesselState &state);
+  void getHeading(const VesselState &state, v3 *heading, bool normal);
   double dot(v3 headingA, v3 headingB);
   double findAngleFromDot(double dot);
-  double getRelativeHeadingAngle();
+  double getRelativeHeadingAngle(const VesselState &state);
   double getComponentAngle(double adjacent, double hypotenuse);
   void normalise(v3* normalVector, double vectorLength);
-  void setupNewRay(RayBox *newRay, v3 *currentPosition);
+  void setupNewRay(RayBox *newRay, const VesselState &state);
+  bool hasArrived(const VesselState &state);
+  void enterPhase(int phase);
+  bool navigationTick();
+  int stepNavigation(const StateRecord &record);
+  double alignError(int phase);
   void stopThrust();
-  void collisionHandler(RayBox *collisionRay, v3 nearObjPos);
+  void flushActuators(int lane = LANE_BULK);
+  void sendActuators(const ActuatorFrame &frame, int lane);
+  void adjustCourse(const VesselState &state);
+  bool startPlanner();
+  void stopPlanner();
+  void planLoop();
+  void reportTicks(const TickScheduler &ticks);
   int activeIndex;
   /**
    * @brief Properties of target object
@@ -61,23 +191,72 @@ private:
     v3 direction;
     v3 currentPosition;
     v3 previousPosition;
+    double currentTime;	///< simulation time of currentPosition, seconds
+    double previousTime;	///< simulation time of previousPosition, seconds
+    v3 velocity;	///< metres per second between the two positions
     double length;
   };
+  /**
+   * @brief Object the vessel is on course to hit
+   */
+  struct Threat {
+    v3 centre;
+    double radius;
+    double distance;	///< from the vessel to the centre
+  };
+  bool findThreat(const VesselState &state, const std::vector<SceneObject> &objects, Threat *threat);
+  void startEscape();
+  void reverseEscape();
   objectProperties dest;
   objectProperties vessel;
+  // Each queued StateRecord's scene has its own array, reused in turn
+  std::vector<SceneObject> scenes[PIPELINE_DEPTH + 1];
   UDPserver *serverConnect;
   int completedRCSOperations;
   double valuesRCS[3];
+  ActuatorFrame pendingActuators = ActuatorFrame();	///< commands not yet sent this tick
   double valuesDelta[3];
-  std::string operation = "";
-  std::string detail = "";
   std::string cl_file = "";
   bool isYaw = false;
   bool isPitch = false;
-  bool onCourse = false;
   double countIterations = 0;
-  double objSize = 0;
   int debugID;
+  double telemetryRate;	///< requested telemetry rate, zero to poll
+  double tickRate;	///< control ticks per second
+  int navPhase = NAV_ALIGN_X;	///< NavPhase of the navigation
+  int loopPhase = NAV_ALIGN_X;	///< NavPhase the I/O thread last heard of, the loop ends at NAV_ARRIVED
+  TickScheduler ticks{DEFAULT_TICK_HZ};	///< paces the control ticks
+  VesselState tickState = VesselState();	///< snapshot of the last tick
+  bool pipelined = false;	///< the planning thread is running
+  unsigned long scenesFetched = 0;	///< scene arrays handed to the planner, picks the next one
+  uint32_t answeredTick = UINT32_MAX;	///< newest tick whose commands have been sent and answered, none yet
+  const VesselState *planState = NULL;	///< state the manoeuvres are acting on
+  Threat threat = Threat();	///< nearest object on the path, valid while threatened
+  bool threatened = false;	///< an object was on the path in the last scene
+  TaskLoop manoeuvres{4};	///< manoeuvres under way
+  AlignTask alignX{this, NAV_ALIGN_X};
+  AlignTask alignY{this, NAV_ALIGN_Y};
+  CruiseTask cruise{this};
+  EscapeTask escape{this};
+  int adjustStep = 0;	///< command of the on-course cycle planned next
+  // While the planner runs it alone touches the navigation state,
+  // the manoeuvres, pendingActuators and valuesDelta, the I/O thread everything
+  // else. The two threads only share the queues and the scenes
+  bool pipeline;	///< plan on a thread of its own
+  std::thread planner;	///< planning thread, see planLoop
+  std::atomic<bool> planning{false};	///< the planning thread should keep running
+  std::atomic<unsigned long> commandsDropped{0};	///< planned commands the full queue refused
+  SpscQueue<StateRecord, PIPELINE_DEPTH> sensed;	///< I/O thread to planner
+  SpscQueue<CommandRecord, PIPELINE_DEPTH> planned;	///< planner to I/O thread
+  unsigned long statesDropped = 0;	///< sensed states the full queue refused
+  unsigned long statesSuperseded = 0;	///< states the planner skipped for newer ones
+  LatencyStats planStats = LatencyStats();	///< time spent planning each command record
+  LatencyStats senseToAct = LatencyStats();	///< state sensed until its commands were sent
+  unsigned long reportedAllocations = 0;	///< request path allocations at the last report
+  int64_t telemetryMaxAge = 0;	///< oldest usable telemetry sample, microseconds
+  bool subscribed = false;	///< client is streaming telemetry
+  bool clockSynced = false;	///< positions are stamped in simulation time
+  SceneQuery sceneQuery = SceneQuery();	///< region whose objects are checked, flags zero for all
 };
 
 #endif //NAVAP_H
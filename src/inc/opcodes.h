@@ -16,5 +16,17 @@
 #define SET_PITCH 10
 #define SET_BANK 11
 #define SET_YAW 12
+#define SET_THRUST 13
+#define STOP_THRUST 14
+#define GET_SCENE 15
+#define SUBSCRIBE 16
+#define TELEMETRY 17
+#define SET_ACTUATORS 18
+#define SYNC_CLOCK 19
+#define GET_SCENE_NEAR 20
+#define GET_SCENE_DELTA 21
+#define GET_VESSEL_STATE 22
+
+#define NUM_OPCODES 23
 
 #endif //OPCODES_H
@@ -0,0 +1,244 @@
+// ==============================================================
+//                  ORBITER MODULE: Rcontrol
+//
+// protocol.h
+//
+// Encoding of the requests sent to the Orbiter client and
+// decoding of its replies. Requests are keyed on the numeric
+// codes in opcodes.h and can be sent either as a compact
+// little-endian binary frame or as the original JSON text.
+// ==============================================================
+
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "types.h"
+#include "opcodes.h"
+
+#define WIRE_MAGIC 0x5243	// "RC" in little-endian byte order
+#define WIRE_VERSION 1
+#define WIRE_HEADER_LEN 12	// bytes before the payload
+#define SCENE_FRAG_HEADER_LEN 16	// fragment header at the start of a scene payload
+#define SCENE_RECORD_LEN 40	// bytes per object in a scene payload
+#define SCENE_FRAG_MAX_OBJECTS ((0xffff - SCENE_FRAG_HEADER_LEN) / SCENE_RECORD_LEN)	// most objects one fragment can carry
+#define SCENE_MAX_OBJECTS 65536	// largest scene the server accepts, bigger totals are refused
+#define SCENE_FLAG_VESSEL 0x1
+#define TELEMETRY_LEN 104	// payload of a TELEMETRY frame or GET_VESSEL_STATE reply
+#define ACTUATOR_LEN 40	// payload of a SET_ACTUATORS request
+#define SCENE_QUERY_LEN 48	// payload of a GET_SCENE_NEAR request
+#define SCENE_DELTA_HEADER_LEN 20	// fragment header at the start of a GET_SCENE_DELTA payload
+#define SCENE_DELTA_FRAG_MAX_OBJECTS ((0xffff - SCENE_DELTA_HEADER_LEN) / (4 + SCENE_RECORD_LEN))	// most whole objects one delta fragment can carry
+#define SCENE_DELTA_QUANTUM (1.0 / 1024)	// metres per step of a quantized position delta
+#define SCENE_KEYFRAME_INTERVAL 64	// frames at most between two keyframes sent by the client
+#define DELTA_INDEX_MASK 0x3fffffffu	// object index in the first word of a delta record
+#define DELTA_KIND_SHIFT 30	// DeltaRecordKind in the top bits of that word
+#define WIRE_FLAG_TIMESTAMP 0x1	// reply payload ends with the simulation time, a double
+
+/**
+ * @brief Encoding used on the wire
+ */
+enum WireFormat {
+  WIRE_JSON = 0,	///< {"operation":"GET_POS","detail":0,"seq":1} text
+  WIRE_BINARY = 1	///< WireHeader followed by a typed payload
+};
+
+/**
+ * @brief How the client returns vector replies
+ */
+enum ReplyMode {
+  REPLY_PACKED = 0,	///< whole reply plus sequence number in one datagram
+  REPLY_SPLIT = 1	///< legacy JSON clients, one datagram per component
+};
+
+/**
+ * @brief Type tag of the payload following the header
+ */
+enum PayloadType {
+  PAYLOAD_NONE = 0,
+  PAYLOAD_INT = 1,	///< int32
+  PAYLOAD_DOUBLE = 2,	///< IEEE-754 double
+  PAYLOAD_V3 = 3,	///< three IEEE-754 doubles, x y z
+  PAYLOAD_SCENE = 4,	///< one fragment of a scene snapshot
+  PAYLOAD_TELEMETRY = 5,	///< vessel state, pushed or requested, see decode_telemetry_frame
+  PAYLOAD_ACTUATORS = 6,	///< ActuatorFrame
+  PAYLOAD_SCENE_QUERY = 7,	///< SceneQuery
+  PAYLOAD_SCENE_DELTA = 8	///< one fragment of a delta-encoded scene frame
+};
+
+/**
+ * @brief Outcome of decoding a reply
+ */
+enum DecodeStatus {
+  DECODE_OK = 0,
+  DECODE_SHORT = -1,	///< datagram shorter than its header or payload claims
+  DECODE_BAD_HEADER = -2,	///< wrong magic number or protocol version
+  DECODE_BAD_TYPE = -3,	///< field or payload of the wrong type
+  DECODE_BAD_LENGTH = -4,	///< payload length does not match its type
+  DECODE_SYNTAX = -5,	///< text that is not valid JSON
+  DECODE_MISSING_FIELD = -6,	///< seq or data absent or given twice
+  DECODE_BAD_NUMBER = -7	///< number out of range for its field
+};
+
+/**
+ * @brief Fields present in an ActuatorFrame
+ */
+enum ActuatorFlags {
+  ACT_BANK = 0x1,
+  ACT_PITCH = 0x2,
+  ACT_YAW = 0x4,
+  ACT_THRUST = 0x8,
+  ACT_STOP_THRUST = 0x10	///< stop the main thrusters before applying the rest
+};
+
+/**
+ * @brief Limits present in a SceneQuery
+ */
+enum SceneQueryFlags {
+  QUERY_RADIUS = 0x1,
+  QUERY_CONE = 0x2
+};
+
+/**
+ * @brief Encodings of an object in a delta-encoded scene frame
+ */
+enum DeltaRecordKind {
+  DELTA_FULL = 0,	///< the whole object, a scene record of SCENE_RECORD_LEN bytes
+  DELTA_SHORT = 1,	///< int16 x, y, z steps of SCENE_DELTA_QUANTUM from the base position
+  DELTA_LONG = 2	///< int32 x, y, z steps of SCENE_DELTA_QUANTUM from the base position
+};
+
+/**
+ * Fixed header of every binary frame. All fields are little-endian
+ * on the wire regardless of the host byte order.
+ * @brief Binary frame header
+ */
+struct WireHeader {
+  uint16_t magic;	///< WIRE_MAGIC
+  uint8_t version;	///< WIRE_VERSION
+  uint8_t opcode;	///< code from opcodes.h
+  uint8_t type;	///< PayloadType of the payload
+  uint8_t flags;	///< WIRE_FLAG_TIMESTAMP on a stamped reply, otherwise zero
+  uint16_t length;	///< payload length in bytes
+  uint32_t seq;	///< request sequence number, echoed in the reply
+};
+
+/**
+ * @brief Decoded reply in its widest form
+ */
+struct WireReply {
+  uint32_t seq;
+  int opcode;
+  int type;
+  int ivalue;	///< valid for PAYLOAD_INT
+  v3 vvalue;	///< valid for PAYLOAD_INT and PAYLOAD_DOUBLE (x only) and PAYLOAD_V3
+  bool stamped;	///< the client sent the simulation time of the value
+  double simTime;	///< valid if stamped, seconds
+};
+
+/**
+ * A GET_SCENE reply is split into fragments that each fit in one
+ * datagram. The payload of every fragment starts with
+ *   uint16 index, uint16 count, uint32 total objects,
+ *   uint32 first object, uint16 objects in fragment, uint16 reserved
+ * followed by SCENE_RECORD_LEN bytes per object:
+ *   int32 id, uint32 flags, double x, y, z, double radius
+ * @brief Decoded scene fragment header
+ */
+struct SceneFragment {
+  uint32_t seq;
+  int index;	///< fragment number, from zero
+  int count;	///< fragments making up the scene
+  int total;	///< objects in the whole scene
+  int first;	///< scene index of the first object in this fragment
+  int objects;	///< objects carried by this fragment
+  const char *records;	///< first record, inside the datagram
+};
+
+/**
+ * A GET_SCENE_DELTA request carries, as its integer argument, the
+ * number of the last scene frame the server decoded in full, or
+ * zero if it holds none. The client answers with the next frame
+ * of the whole scene, either a keyframe (base zero) holding every
+ * object, or the changes since that base frame. The client sends a
+ * keyframe when it no longer holds the base, and at least every
+ * SCENE_KEYFRAME_INTERVAL frames. The payload of every fragment
+ * starts with
+ *   uint16 index, uint16 count, uint32 total objects,
+ *   uint32 frame, uint32 base frame, uint16 records, uint16 reserved
+ * followed by the records, each of them
+ *   uint32 object index | DeltaRecordKind << DELTA_KIND_SHIFT
+ * and then a scene record for DELTA_FULL, or the position change
+ * in steps for DELTA_SHORT and DELTA_LONG. Objects that moved less
+ * than half a step are left out, and the steps are taken from the
+ * position the server decoded rather than the true one, so the
+ * rounding never adds up.
+ * @brief Decoded delta scene fragment header
+ */
+struct SceneDeltaFragment {
+  uint32_t seq;
+  int index;	///< fragment number, from zero
+  int count;	///< fragments making up the frame
+  int total;	///< objects in the whole scene
+  uint32_t frame;	///< number of this frame
+  uint32_t base;	///< frame the changes apply to, zero for a keyframe
+  int records;	///< records carried by this fragment
+  const char *data;	///< first record, inside the datagram
+  size_t length;	///< bytes of records
+};
+
+/**
+ * Every actuator command of one control tick, applied by the
+ * client as a unit and acknowledged with a single reply holding
+ * the resulting bank, pitch and yaw RCS levels. On the wire:
+ *   uint32 flags, uint32 reserved, double bank, pitch, yaw, thrust
+ * @brief Coalesced actuator commands
+ */
+struct ActuatorFrame {
+  uint32_t flags;	///< ActuatorFlags of the fields to apply
+  double bank;	///< bank rate delta
+  double pitch;	///< pitch rate delta
+  double yaw;	///< yaw rate delta
+  double thrust;	///< main thrust level
+};
+
+/**
+ * Region around the active vessel whose objects a GET_SCENE_NEAR
+ * request asks for, answered with the same fragments as GET_SCENE
+ * but holding only the objects inside it. An object is inside if
+ * any part of its sphere is. On the wire:
+ *   uint32 flags, uint32 reserved, double radius, double cone,
+ *   double axis x, y, z
+ * @brief Interest region of a scene snapshot
+ */
+struct SceneQuery {
+  uint32_t flags;	///< SceneQueryFlags of the limits to apply
+  double radius;	///< greatest distance from the vessel, metres
+  double cone;	///< half-angle of the cone around axis, radians
+  v3 axis;	///< direction of the cone, need not be normalised
+};
+
+const char *opcode_name(int opcode);
+int opcode_arg_type(int opcode);
+int opcode_reply_type(int opcode);
+int encode_request(int format, int opcode, double arg, uint32_t seq, char *buf, size_t len);
+int encode_actuator_frame(const ActuatorFrame &frame, uint32_t seq, char *buf, size_t len);
+int encode_scene_query(const SceneQuery &query, uint32_t seq, char *buf, size_t len);
+bool decode_scene_query(const char *buf, size_t len, SceneQuery *query);
+int encode_scene_delta_record(const SceneObject &object, int index, bool keyframe, SceneObject *base,
+                              char *buf, size_t len);
+bool scene_query_match(const SceneQuery &query, const v3 &origin, const SceneObject &object);
+const char *decode_status_name(int status);
+bool int_from_double(double d, int *value);
+int decode_binary_reply(const char *buf, size_t len, WireReply *reply);
+int decode_json_reply(char *buf, size_t len, WireReply *reply);
+int decode_json_number(char *buf, size_t len, double *value);
+bool decode_scene_fragment(const char *buf, size_t len, SceneFragment *frag);
+void decode_scene_object(const char *record, SceneObject *object);
+bool decode_scene_delta(const char *buf, size_t len, SceneDeltaFragment *frag);
+bool apply_scene_delta(const SceneDeltaFragment &frag, SceneObject *objects, int count);
+bool decode_telemetry_frame(const char *buf, size_t len, TelemetrySample *sample);
+bool decode_vessel_state(const char *buf, size_t len, uint32_t *seq, TelemetrySample *state);
+
+#endif //PROTOCOL_H
@@ -0,0 +1,257 @@
+// ==============================================================
+//                  ORBITER MODULE: Rcontrol
+//
+// requests.h
+//
+// Compile-time descriptions of the requests that carry one
+// argument and return one value. The opcode fixes the type of
+// both, and a binary codec is generated for it, so a request can
+// only be sent with the argument it takes and its reply decoded
+// into the type it returns. Scenes, telemetry and actuator
+// frames have interfaces of their own and no description.
+// ==============================================================
+
+#ifndef REQUESTS_H
+#define REQUESTS_H
+
+#include "protocol.h"
+#include "wire.h"
+
+/**
+ * @brief Payload type and length of a value on the wire
+ */
+template <typename T> struct PayloadOf;
+
+template <> struct PayloadOf<int> {
+  enum { type = PAYLOAD_INT, length = 4 };
+  static void put(char *p, int value) { put32(p, (uint32_t)value); }
+};
+
+template <> struct PayloadOf<double> {
+  enum { type = PAYLOAD_DOUBLE, length = 8 };
+  static void put(char *p, double value) { putDouble(p, value); }
+};
+
+template <> struct PayloadOf<v3> {
+  enum { type = PAYLOAD_V3, length = 24 };
+};
+
+/**
+ * Left undefined for opcodes without a single argument and
+ * value, so naming one of them fails to compile
+ * @brief Argument and reply types of a request
+ */
+template <int Opcode> struct RequestTraits;
+
+#define REQUEST_TRAITS(opcode, arg, reply)	\
+  template <> struct RequestTraits<opcode> {	\
+    typedef arg Arg;	\
+    typedef reply Reply;	\
+  }
+
+// Object queries take the object index, setters and SUBSCRIBE a
+// rate or level which the client echoes back
+REQUEST_TRAITS(GET_POS, int, v3);
+REQUEST_TRAITS(GET_OBJ_COUNT, int, int);
+REQUEST_TRAITS(GET_OBJ, int, double);
+REQUEST_TRAITS(IS_VESSEL, int, int);
+REQUEST_TRAITS(GET_SIZE, int, double);
+REQUEST_TRAITS(GET_AIRSPEED, int, v3);
+REQUEST_TRAITS(GET_ANG_VEL, int, v3);
+REQUEST_TRAITS(GET_BANK, int, double);
+REQUEST_TRAITS(GET_YAW, int, double);
+REQUEST_TRAITS(GET_PITCH, int, double);
+REQUEST_TRAITS(SET_PITCH, double, double);
+REQUEST_TRAITS(SET_BANK, double, double);
+REQUEST_TRAITS(SET_YAW, double, double);
+REQUEST_TRAITS(SET_THRUST, double, double);
+REQUEST_TRAITS(STOP_THRUST, int, double);
+REQUEST_TRAITS(SUBSCRIBE, double, double);
+REQUEST_TRAITS(SYNC_CLOCK, int, v3);
+
+/**
+ * Returned by UDPserver::submit<Opcode>(). The opcode is part of
+ * its type, so the reply can only be waited for into a variable
+ * of the type the request returns.
+ * @brief Id of a submitted typed request
+ */
+template <int Opcode>
+struct Ticket {
+  explicit Ticket(uint32_t id = 0) : id(id) {}
+  uint32_t id;	///< request id, see UDPserver::ready
+};
+
+/**
+ * @brief Store a double reply in a scalar, refusing one an int cannot hold
+ */
+static inline bool scalar_from_double(double d, double *value)
+{
+  *value = d;
+  return true;
+}
+
+static inline bool scalar_from_double(double d, int *value)
+{
+  return int_from_double(d, value);
+}
+
+/**
+ * A vector reply must hold a vector. A scalar may come as
+ * either scalar type, as decode_binary_reply allows, but a
+ * double must fit the type the request returns.
+ * @brief Decoding of a reply payload into its C++ type
+ */
+template <typename T> struct ReplyValue {
+  static bool accepts(int type, size_t payload)
+  {
+    return (type == PAYLOAD_INT && payload == 4) || (type == PAYLOAD_DOUBLE && payload == 8);
+  }
+  static bool get(int type, const char *p, T *value)
+  {
+    if (type == PAYLOAD_INT) {
+      *value = (T)(int32_t)get32(p);
+      return true;
+    }
+    return scalar_from_double(getDouble(p), value);
+  }
+  static void widen(const T &value, WireReply *reply)
+  {
+    reply->vvalue.x = value;
+    int_from_double(reply->vvalue.x, &reply->ivalue);
+  }
+};
+
+template <> struct ReplyValue<v3> {
+  static bool accepts(int type, size_t payload) { return type == PAYLOAD_V3 && payload == 24; }
+  static bool get(int, const char *p, v3 *value)
+  {
+    for (int i = 0; i < 3; i++)
+      value->data[i] = getDouble(p + 8 * i);
+    return true;
+  }
+  static void widen(const v3 &value, WireReply *reply) { reply->vvalue = value; }
+};
+
+/**
+ * Type-erased entry points of a RequestCodec, picked when the
+ * request is submitted and kept with it for retransmissions and
+ * the reply
+ * @brief Binary codec of a submitted request
+ */
+struct WireCodec {
+  int (*encode)(double arg, uint32_t seq, char *buf, size_t len);
+  int (*decode)(const char *buf, size_t len, WireReply *reply);
+};
+
+/**
+ * The header fields, payload types and lengths are constants of
+ * the instantiation, so neither direction looks up the opcode
+ * or switches on the payload type.
+ * @brief Binary codec generated for one opcode
+ */
+template <int Opcode>
+struct RequestCodec {
+  typedef typename RequestTraits<Opcode>::Arg Arg;
+  typedef typename RequestTraits<Opcode>::Reply Reply;
+
+  /**
+   * @brief Encode the request
+   * @param arg Argument of the request
+   * @param seq Sequence number the client echoes in its reply
+   * @param buf Destination buffer
+   * @param len Size of the destination buffer
+   * @return Number of bytes to send, or -1 if the request does not fit
+   */
+  static int encode(Arg arg, uint32_t seq, char *buf, size_t len)
+  {
+    if (len < WIRE_HEADER_LEN + PayloadOf<Arg>::length)
+      return -1;
+    put16(buf, WIRE_MAGIC);
+    buf[2] = (char)WIRE_VERSION;
+    buf[3] = (char)Opcode;
+    buf[4] = (char)PayloadOf<Arg>::type;
+    buf[5] = 0;
+    put16(buf + 6, PayloadOf<Arg>::length);
+    put32(buf + 8, seq);
+    PayloadOf<Arg>::put(buf + WIRE_HEADER_LEN, arg);
+    return WIRE_HEADER_LEN + PayloadOf<Arg>::length;
+  }
+
+  /**
+   * Decode a reply to this request, with the simulation time of
+   * the value if the client stamped it
+   * @brief Decode the reply
+   * @param buf Received datagram
+   * @param len Length of the received datagram
+   * @param seq Sequence number of the reply
+   * @param value Decoded value
+   * @param stamped Set if the client sent the simulation time of the value
+   * @param simTime Simulation time of the value, valid if stamped
+   * @return DECODE_OK, DECODE_BAD_TYPE for a reply to another
+   * opcode or of another type, DECODE_BAD_NUMBER for a double the
+   * reply type cannot hold, or the DecodeStatus of a malformed frame
+   */
+  static int decode(const char *buf, size_t len, uint32_t *seq, Reply *value, bool *stamped, double *simTime)
+  {
+    if (len < WIRE_HEADER_LEN)
+      return DECODE_SHORT;
+    if (get16(buf) != WIRE_MAGIC || (uint8_t)buf[2] != WIRE_VERSION)
+      return DECODE_BAD_HEADER;
+    size_t payload = get16(buf + 6);
+    if (len < WIRE_HEADER_LEN + payload)
+      return DECODE_SHORT;
+    *seq = get32(buf + 8);
+    *stamped = ((uint8_t)buf[5] & WIRE_FLAG_TIMESTAMP) != 0;
+    *simTime = 0;
+    if (*stamped) {
+      if (payload < 8)
+        return DECODE_BAD_LENGTH;
+      payload -= 8;
+      *simTime = getDouble(buf + WIRE_HEADER_LEN + payload);
+    }
+    int type = (uint8_t)buf[4];
+    if ((uint8_t)buf[3] != Opcode || !ReplyValue<Reply>::accepts(type, payload))
+      return DECODE_BAD_TYPE;
+    if (!ReplyValue<Reply>::get(type, buf + WIRE_HEADER_LEN, value))
+      return DECODE_BAD_NUMBER;
+    return DECODE_OK;
+  }
+
+  /**
+   * @brief WireCodec entry point for encode
+   */
+  static int encode_arg(double arg, uint32_t seq, char *buf, size_t len)
+  {
+    return encode((Arg)arg, seq, buf, len);
+  }
+
+  /**
+   * Decode into the widest form for the request slot. A reply of
+   * the wrong type or holding a number out of range still has its
+   * header fields filled in, so the caller can tell it apart from
+   * a reply to another request.
+   * @brief WireCodec entry point for decode
+   */
+  static int decode_reply(const char *buf, size_t len, WireReply *reply)
+  {
+    Reply value = Reply();
+    reply->ivalue = 0;
+    for (int i = 0; i < 3; i++)
+      reply->vvalue.data[i] = 0;
+    int status = decode(buf, len, &reply->seq, &value, &reply->stamped, &reply->simTime);
+    if (status != DECODE_OK && status != DECODE_BAD_TYPE && status != DECODE_BAD_NUMBER)
+      return status;
+    reply->opcode = (uint8_t)buf[3];
+    reply->type = (uint8_t)buf[4];
+    if (status == DECODE_OK)
+      ReplyValue<Reply>::widen(value, reply);
+    return status;
+  }
+
+  static const WireCodec wire;
+};
+
+template <int Opcode>
+const WireCodec RequestCodec<Opcode>::wire = { &RequestCodec<Opcode>::encode_arg, &RequestCodec<Opcode>::decode_reply };
+
+#endif //REQUESTS_H
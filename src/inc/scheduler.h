@@ -0,0 +1,65 @@
+// ==============================================================
+//                  ORBITER MODULE: Rcontrol
+//
+// scheduler.h
+//
+// Fixed-rate pacing of the control loop. Ticks start on absolute
+// deadlines of the steady clock, so the rate does not drift with
+// network latency or with the time the tick itself takes.
+// ==============================================================
+
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include "udpserver.h"
+
+/**
+ * @brief Parts of a control tick, timed separately by TickScheduler
+ */
+enum TickPhase {
+  PHASE_SENSE = 0,	///< reading the vessel state and telemetry
+  PHASE_DECIDE = 1,	///< working out the commands
+  PHASE_ACT = 2,	///< sending the commands
+  NUM_PHASES = 3
+};
+
+/**
+ * The n-th tick is due n periods after start(), whenever the
+ * ticks before it ended. A tick that runs past the next deadline
+ * is an overrun. The deadlines it covered are skipped rather
+ * than run back to back, so a slow tick never causes a burst.
+ * @brief Fixed-rate control loop scheduler
+ */
+class TickScheduler
+{
+public:
+  explicit TickScheduler(double rate_hz);
+  void start();
+  void wait_next();
+  bool advance();
+  bool due() const { return monotonic_us() >= deadlineUs; }
+  void woke();
+  void begin(int phase);
+  void end();
+  double rate_hz() const { return 1e6 / periodUs; }
+  double achieved_hz() const;
+  int64_t period_us() const { return periodUs; }
+  unsigned long ticks() const { return tickCount; }
+  unsigned long overruns() const { return overrunCount; }
+  unsigned long skipped() const { return skippedCount; }
+  // Lateness of each wake-up after its deadline
+  const LatencyStats &jitter() const { return lateness; }
+  const LatencyStats &phase_stats(int phase) const { return phases[phase]; }
+private:
+  void sleep_until(int64_t deadlineUs);
+  int64_t periodUs;
+  int64_t startUs;	// steady clock of start()
+  int64_t deadlineUs;	// start of the next tick
+  int64_t phaseUs;	// start of the phase being timed
+  int phase;	// TickPhase being timed, -1 for none
+  unsigned long tickCount, overrunCount, skippedCount;
+  LatencyStats lateness;
+  LatencyStats phases[NUM_PHASES];
+};
+
+#endif //SCHEDULER_H
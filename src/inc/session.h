@@ -0,0 +1,67 @@
+// ==============================================================
+//                  ORBITER MODULE: Rcontrol
+//
+// session.h
+//
+// Serves several Orbiter clients from one process. Each client
+// that pings the server gets a session, a UDPserver whose socket
+// is bound to PORT and connected to that client, so the kernel
+// routes every reply to the session that sent the request.
+// ==============================================================
+
+#ifndef SESSION_H
+#define SESSION_H
+
+#include "udpserver.h"
+#include <deque>
+#include <mutex>
+#include <vector>
+
+/**
+ * @brief First datagram of a client waiting to be given a session
+ */
+struct ClientPing {
+  struct sockaddr_in from;
+  int len;
+  char data[BUFLEN];
+};
+
+bool is_ping(const ClientPing &ping);
+
+/**
+ * Table of the clients being served, keyed by client address.
+ * accept() is called from one thread, the sessions it returns
+ * are driven from their own threads and handed back with
+ * close() when their client is done.
+ * @brief Client sessions sharing the server port
+ */
+class SessionTable
+{
+public:
+  SessionTable(int debug, const ServerOptions &options);
+  ~SessionTable();
+  UDPserver *accept();
+  void close(UDPserver *session);
+  size_t size();
+private:
+  SessionTable(const SessionTable &);
+  SessionTable &operator=(const SessionTable &);
+  /**
+   * @brief A client and the session serving it
+   */
+  struct Session {
+    struct sockaddr_in addr;
+    UDPserver *server;
+  };
+  int find(const struct sockaddr_in &addr);
+  bool next_ping(ClientPing *ping);
+  int connect_socket(const struct sockaddr_in &client);
+  std::vector<Session> sessions;
+  std::deque<ClientPing> strays;	// pings read by a session socket before it was connected
+  std::mutex lock;	// guards sessions and strays
+  int listenfd;	// receives the first ping of every new client
+  int debug;
+  ServerOptions options;
+};
+
+#endif //SESSION_H
@@ -0,0 +1,106 @@
+// ==============================================================
+//                  ORBITER MODULE: Rcontrol
+//
+// shard.h
+//
+// Spreads the clients over worker threads, one per core. Every
+// worker binds its own socket to PORT with SO_REUSEPORT and the
+// kernel hashes each client to one of them, so a worker reads
+// and answers only its own clients and the receive path takes
+// no locks.
+// ==============================================================
+
+#ifndef SHARD_H
+#define SHARD_H
+
+#include "udpserver.h"
+#include "session.h"
+#include <atomic>
+#include <deque>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#define SHARD_IDLE_MS 10	// longest a worker sleeps, bounds how late a retransmission is
+
+/**
+ * One SO_REUSEPORT socket and the sessions of the clients the
+ * kernel hashes to it. Datagrams are read in batches and handed
+ * to the session of their sender. Only the worker owning it may
+ * touch it.
+ * @brief Sessions sharing one socket
+ */
+class SocketShare
+{
+public:
+  SocketShare();
+  ~SocketShare();
+  bool open(bool rxTimestamps);
+  bool wait(int timeout_ms);
+  void drain(IOStats *stats);
+  void expire();
+  UDPserver *find(const struct sockaddr_in &addr);
+  void add(UDPserver *session, const struct sockaddr_in &addr);
+  int reap();
+  static SocketShare *of(const UDPserver *session) { return session->share; }
+  int fd;
+  std::vector<UDPserver *> sessions;
+  std::vector<UDPserver *> closing;	// sessions to delete once the worker is done with them
+  std::deque<ClientPing> pings;	// datagrams from clients without a session
+  IOStats stats;	// reads made by the worker itself
+private:
+  SocketShare(const SocketShare &);
+  SocketShare &operator=(const SocketShare &);
+  static uint64_t key(const struct sockaddr_in &addr);
+  std::unordered_map<uint64_t, UDPserver *> byAddress;	// client address to session, see key()
+  int epfd;
+  bool draining;	// a handler run by drain() must not start another
+  char inBufs[BATCH_SIZE][BUFLEN];
+#ifndef _WIN32
+  struct mmsghdr inMsgs[BATCH_SIZE];
+  struct iovec inIov[BATCH_SIZE];
+  struct sockaddr_in inAddrs[BATCH_SIZE];
+  char inControl[BATCH_SIZE][RX_CONTROL_LEN];
+#endif
+};
+
+/**
+ * Worker threads pinned to cores, each owning a SocketShare.
+ * New clients get a session on the worker the kernel hashed them
+ * to. Sessions are driven from their worker through the
+ * pipelined interface: requests are submitted with handlers,
+ * which may submit the next ones, and never waited on.
+ * @brief SO_REUSEPORT worker pool
+ */
+class ShardPool
+{
+public:
+  // Called on the worker thread of the session
+  typedef std::function<void(UDPserver *session)> SessionHandler;
+
+  ShardPool(int debug, const ServerOptions &options);
+  ~ShardPool();
+  bool start(SessionHandler accepted, SessionHandler tick = SessionHandler());
+  void stop();
+  int size() const { return (int)shares.size(); }
+  int sessions() const { return sessionCount.load(); }
+  void close(UDPserver *session);
+  // Longest a worker sleeps between rounds of tick handlers
+  void set_idle_ms(int ms) { idleMs = ms > 0 ? ms : 1; }
+private:
+  ShardPool(const ShardPool &);
+  ShardPool &operator=(const ShardPool &);
+  void run(int index);
+  void accept(SocketShare &share);
+  std::vector<SocketShare *> shares;	// one per worker
+  std::vector<std::thread> threads;
+  std::atomic<bool> stopping;
+  std::atomic<int> sessionCount;
+  SessionHandler onAccept;
+  SessionHandler onTick;
+  int idleMs;	// longest sleep of a worker, SHARD_IDLE_MS unless set
+  int debug;
+  ServerOptions options;
+};
+
+#endif //SHARD_H
@@ -0,0 +1,87 @@
+// ==============================================================
+//                  ORBITER MODULE: Rcontrol
+//
+// shmring.h
+//
+// Shared-memory transport for a client running on the same
+// host. Frames are exchanged through a pair of single-producer
+// single-consumer rings in a POSIX shared-memory segment and
+// read in place, without a copy or a trip through the network
+// stack.
+// ==============================================================
+
+#ifndef SHMRING_H
+#define SHMRING_H
+
+#include <atomic>
+#include <string>
+#include <stddef.h>
+#include <stdint.h>
+
+#define SHM_MAGIC 0x52435348	// "HSCR" in little-endian byte order
+#define SHM_VERSION 1
+#define SHM_RING_SLOTS 256	// frames per direction, a power of two
+#define SHM_FRAME_LEN 1500	// largest frame, the same as a datagram
+#define SHM_SPIN 2000	// polls of the ring before sleeping on the futex
+#define SHM_DEFAULT_NAME "/rcontrol"
+
+/**
+ * One direction of the channel. The producer only writes head,
+ * the consumer only writes tail, each on its own cache line.
+ * head is also the futex word a sleeping consumer waits on.
+ * @brief Single-producer single-consumer frame ring
+ */
+struct ShmRing {
+  std::atomic<uint32_t> head;	///< frames written, wraps
+  char headPad[60];
+  std::atomic<uint32_t> tail;	///< frames consumed, wraps
+  std::atomic<uint32_t> sleeping;	///< consumer is waiting on head
+  char tailPad[56];
+  struct Frame {
+    uint32_t len;
+    char data[SHM_FRAME_LEN + 1];	///< one spare byte to terminate a text frame
+  } frames[SHM_RING_SLOTS];
+};
+
+/**
+ * @brief Layout of the shared-memory segment
+ */
+struct ShmSegment {
+  uint32_t magic;	///< SHM_MAGIC once the creator has initialised the rings
+  uint32_t version;	///< SHM_VERSION
+  ShmRing toClient;	///< requests, written by the server
+  ShmRing toServer;	///< replies and telemetry, written by the client
+};
+
+/**
+ * One end of the shared-memory channel. The server creates the
+ * segment and the client on the same host opens it by name.
+ * Outbound frames are encoded straight into the ring and inbound
+ * frames are decoded where they lie, then released.
+ * @brief Shared-memory frame channel
+ */
+class ShmChannel
+{
+public:
+  ShmChannel();
+  ~ShmChannel();
+  bool create(const std::string &name);
+  bool open(const std::string &name);
+  char *reserve();
+  bool commit(size_t len);	// true if the consumer had to be woken
+  char *peek(size_t *len);
+  void release();
+  bool wait(int timeout_ms);
+private:
+  ShmChannel(const ShmChannel &);
+  ShmChannel &operator=(const ShmChannel &);
+  bool map(const std::string &name, bool create);
+  ShmSegment *segment;
+  ShmRing *out;	// ring this end produces into
+  ShmRing *in;	// ring this end consumes from
+  std::string segmentName;
+  bool owner;	// unlink the segment on close
+  int spin;	// polls before sleeping, zero on a single core
+};
+
+#endif //SHMRING_H
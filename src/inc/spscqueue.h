@@ -0,0 +1,106 @@
+// ==============================================================
+//                  ORBITER MODULE: Rcontrol
+//
+// spscqueue.h
+//
+// Bounded lock-free queue between two threads of the process,
+// one pushing records and the other popping them.
+// ==============================================================
+
+#ifndef SPSCQUEUE_H
+#define SPSCQUEUE_H
+
+#include <atomic>
+#include <stdint.h>
+
+void queue_wait(std::atomic<uint32_t> *word, uint32_t value, int timeout_ms);
+void queue_wake(std::atomic<uint32_t> *word);
+
+/**
+ * The same ring as ShmRing, for records that stay inside the
+ * process. The producer only writes head and the consumer only
+ * writes tail, each on its own cache line. A consumer with
+ * nothing to do sleeps on head and is woken by the next push.
+ * @brief Single-producer single-consumer record queue
+ * @tparam T Record type, copied in and out
+ * @tparam Slots Capacity, a power of two
+ */
+template <typename T, uint32_t Slots>
+class SpscQueue
+{
+public:
+  SpscQueue() : head(0), tail(0), sleeping(0) {}
+  bool push(const T &record);
+  bool pop(T *record);
+  bool wait(int timeout_ms);
+  uint32_t size() const { return head.load(std::memory_order_acquire) - tail.load(std::memory_order_acquire); }
+private:
+  SpscQueue(const SpscQueue &);
+  SpscQueue &operator=(const SpscQueue &);
+  std::atomic<uint32_t> head;	// records pushed, wraps
+  char headPad[60];
+  std::atomic<uint32_t> tail;	// records popped, wraps
+  std::atomic<uint32_t> sleeping;	// consumer is waiting on head
+  char tailPad[56];
+  T records[Slots];
+};
+
+/**
+ * @brief Append a record, called by the producer only
+ * @param record Record to copy into the queue
+ * @return false if the queue is full, the record is not queued
+ */
+template <typename T, uint32_t Slots>
+bool SpscQueue<T, Slots>::push(const T &record)
+{
+  uint32_t h = head.load(std::memory_order_relaxed);
+  if (h - tail.load(std::memory_order_acquire) == Slots)
+    return false;
+  records[h & (Slots - 1)] = record;
+  // Sequentially consistent so the store to head and the load
+  // of sleeping cannot pass each other, wait() does the same in
+  // the opposite order
+  head.store(h + 1, std::memory_order_seq_cst);
+  if (sleeping.load(std::memory_order_seq_cst))
+    queue_wake(&head);
+  return true;
+}
+
+/**
+ * @brief Take the oldest record, called by the consumer only
+ * @param *record Where the record is copied
+ * @return false if the queue is empty
+ */
+template <typename T, uint32_t Slots>
+bool SpscQueue<T, Slots>::pop(T *record)
+{
+  uint32_t t = tail.load(std::memory_order_relaxed);
+  if (head.load(std::memory_order_acquire) == t)
+    return false;
+  *record = records[t & (Slots - 1)];
+  tail.store(t + 1, std::memory_order_release);
+  return true;
+}
+
+/**
+ * @brief Sleep until a record is queued, called by the consumer only
+ * @param timeout_ms Longest wait in milliseconds, negative to wait forever
+ * @return true if a record is waiting
+ */
+template <typename T, uint32_t Slots>
+bool SpscQueue<T, Slots>::wait(int timeout_ms)
+{
+  uint32_t t = tail.load(std::memory_order_relaxed);
+  if (head.load(std::memory_order_acquire) != t)
+    return true;
+  if (timeout_ms == 0)
+    return false;
+  sleeping.store(1, std::memory_order_seq_cst);
+  uint32_t h = head.load(std::memory_order_seq_cst);
+  if (h == t)
+    queue_wait(&head, h, timeout_ms);
+  sleeping.store(0, std::memory_order_relaxed);
+  return head.load(std::memory_order_acquire) != t;
+}
+
+#endif //SPSCQUEUE_H
@@ -0,0 +1,107 @@
+// ==============================================================
+//                  ORBITER MODULE: Rcontrol
+//
+// tasks.h
+//
+// Resumable manoeuvre tasks. A task is written as straight-line
+// code that suspends until the next vessel state, a deadline, the
+// reply to its commands or a condition, and any number of tasks
+// take turns on one thread.
+// ==============================================================
+
+#ifndef TASKS_H
+#define TASKS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+/**
+ * @brief Result of resuming a task
+ */
+enum TaskStatus {
+  TASK_RUNNING = 0,	///< suspended, resume it again with the next state
+  TASK_DONE = 1	///< reached TASK_END
+};
+
+/**
+ * @brief What a task is resumed with
+ */
+struct TaskContext {
+  uint32_t tick;	///< control tick of the state being acted on
+  int64_t nowUs;	///< when that state was sensed, steady clock
+  uint32_t answeredTick;	///< newest tick whose commands the client had answered when the state was sensed
+};
+
+/**
+ * Ticks wrap, so they are compared by their difference
+ * @brief Check whether the commands planned at a tick have been answered
+ * @param answeredTick TaskContext::answeredTick
+ * @param tick Tick the commands were planned at
+ * @return true once they have
+ */
+static inline bool tick_answered(uint32_t answeredTick, uint32_t tick)
+{
+  return (int32_t)(answeredTick - tick) >= 0;
+}
+
+/**
+ * A task keeps its place in resumePoint and returns from resume()
+ * wherever it suspends, so no stack is kept between resumes. The
+ * body of resume() sits between TASK_BEGIN and TASK_END. Anything
+ * that must survive a suspension is a member of the task, not a
+ * local, and each suspension is on a line of its own with no
+ * switch statement around it.
+ * @brief Stackless resumable task
+ */
+class ManoeuvreTask
+{
+public:
+  ManoeuvreTask() : resumePoint(0), wakeUs(0), replyTick(0) {}
+  virtual ~ManoeuvreTask() {}
+  virtual int resume(const TaskContext &ctx) = 0;
+  void restart() { resumePoint = 0; }
+  bool finished() const { return resumePoint < 0; }
+protected:
+  int resumePoint;	// line to carry on from, 0 at the start, -1 once finished
+  int64_t wakeUs;	// deadline of TASK_SLEEP_US, steady clock
+  uint32_t replyTick;	// tick awaited by TASK_AWAIT_REPLY
+};
+
+#define TASK_BEGIN() switch (resumePoint) { case 0:
+// Suspend until the task is next resumed, with the next state
+#define TASK_YIELD() do { resumePoint = __LINE__; return TASK_RUNNING; case __LINE__:; } while (0)
+// Suspend until a condition holds, checked at every resume
+#define TASK_AWAIT(cond) while (!(cond)) TASK_YIELD()
+// Suspend for a time of the steady clock, measured from the state being acted on
+#define TASK_SLEEP_US(ctx, us) do { wakeUs = (ctx).nowUs + (us); TASK_AWAIT((ctx).nowUs >= wakeUs); } while (0)
+// Suspend until the client has answered the commands planned
+// from the state being acted on, and resume with the first state
+// sensed after that. The reply is learnt from the states the task
+// is handed, never from the server, which belongs to the I/O thread
+#define TASK_AWAIT_REPLY(ctx) do { replyTick = (ctx).tick; TASK_AWAIT(tick_answered((ctx).answeredTick, replyTick)); } while (0)
+#define TASK_END() } resumePoint = -1; return TASK_DONE;
+
+/**
+ * Tasks are resumed in the order they were spawned, once per
+ * run(), and dropped once finished. The loop does not own them.
+ * Its capacity is fixed when it is made, so spawning a task never
+ * touches the heap.
+ * @brief Runs many manoeuvre tasks on one thread
+ */
+class TaskLoop
+{
+public:
+  explicit TaskLoop(int capacity);
+  bool spawn(ManoeuvreTask *task);
+  void cancel(ManoeuvreTask *task);
+  void cancel_all() { tasks.clear(); }
+  bool running(const ManoeuvreTask *task) const;
+  int run(const TaskContext &ctx);
+  int size() const { return (int)tasks.size(); }
+private:
+  std::vector<ManoeuvreTask *> tasks;
+  int capacity;
+};
+
+#endif //TASKS_H
@@ -0,0 +1,44 @@
+// ==============================================================
+//                  ORBITER MODULE: Rcontrol
+//
+// telemetry.h
+//
+// Latest-value cache for the vessel state streamed by the
+// client. The receive path publishes frames and the control
+// code reads the newest one without a network round trip.
+// ==============================================================
+
+#ifndef TELEMETRY_H
+#define TELEMETRY_H
+
+#include <atomic>
+#include <stdint.h>
+#include "types.h"
+
+int64_t monotonic_us();
+
+/**
+ * Holds the newest telemetry sample behind a sequence lock.
+ * One thread publishes, any number of threads read without
+ * taking a lock; a reader that overlaps a publish retries.
+ * @brief Lock-free latest-value telemetry cache
+ */
+class TelemetryCache
+{
+public:
+  TelemetryCache();
+  bool publish(const TelemetrySample &sample);
+  bool read(TelemetrySample *sample) const;
+  int64_t age_us() const;
+  bool fresh(int64_t max_age_us) const;
+  unsigned long published() const { return accepted.load(std::memory_order_relaxed); }
+  unsigned long stale() const { return rejected.load(std::memory_order_relaxed); }
+private:
+  std::atomic<uint32_t> version;	// odd while a publish is in progress
+  std::atomic<int64_t> receivedUs;	// receive time of the cached sample, -1 if none
+  std::atomic<unsigned long> accepted, rejected;
+  TelemetrySample latest;
+  uint32_t lastFrame;	// only touched by the publishing thread
+};
+
+#endif //TELEMETRY_H
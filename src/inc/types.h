@@ -1,6 +1,8 @@
 #ifndef TYPES_H
 #define TYPES_H
 
+#include <stdint.h>
+
 /**
  * Type-definition of representation of 3D vectors
  * @brief 3D vector representation
@@ -10,4 +12,33 @@ typedef union {
 	struct { double x, y, z; };   ///< named data interface
 } v3;
 
+/**
+ * Entry of a scene snapshot, laid out so a whole scene can be
+ * held in one contiguous array for the collision checks
+ * @brief Simulation object in a scene snapshot
+ */
+struct SceneObject {
+	int id;		///< object index in the simulation
+	int isVessel;	///< non-zero if the object is a vessel
+	v3 position;	///< global position
+	double radius;	///< mean radius
+};
+
+/**
+ * State of the active vessel as streamed by the client after
+ * a SUBSCRIBE request
+ * @brief Telemetry frame of the active vessel
+ */
+struct TelemetrySample {
+	uint32_t frame;		///< frame counter, increases with every frame sent
+	double simTime;		///< simulation time of the sample, seconds
+	int64_t receivedUs;	///< local steady clock when received, microseconds
+	v3 position;		///< global position
+	v3 angularVelocity;	///< angular velocity
+	double pitch;
+	double bank;
+	double yaw;
+	v3 airspeed;		///< airspeed vector
+};
+
 #endif //TYPES_H
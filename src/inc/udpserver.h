@@ -20,18 +20,44 @@
 # include<unistd.h>
 # include<sys/socket.h>
 # include<sys/types.h>
+# include<sys/uio.h>
+# include<sys/epoll.h>
+# include<fcntl.h>
 # endif
 #include<stdio.h>
 #include<string.h>
 #include<string>
+#include<vector>
+#include<functional>
 #include<cstring>
 #include<stdlib.h>
+#include<stdint.h>
 #include "types.h"
+#include "protocol.h"
+#include "requests.h"
+#include "telemetry.h"
+#include "shmring.h"
+#include "uring.h"
+#include "alloccount.h"
+#include "clocksync.h"
 
 //#pragma comment(lib,"ws2_32.lib") // Winsock library
 
-#define BUFLEN 1024 // Max length of buffer
+#define BUFLEN 1500 // Max length of buffer, one Ethernet MTU
 #define PORT 8888 // The port on which to listen to incoming data
+#define MAX_IN_FLIGHT 64 // Requests that may await a reply at once
+#define BATCH_SIZE 32 // Datagrams sent or received per batched system call
+#define REQUEST_LEN 128 // Max length of an encoded request
+#define DEFAULT_TIMEOUT_MS 100 // Wait for a reply before the first retransmission
+#define DEFAULT_RETRIES 3 // Retransmissions before a request times out
+#define DEFAULT_TELEMETRY_HZ 50 // Rate of the pushed vessel state
+#define DEFAULT_TICK_HZ 50 // Rate of the autopilot's fixed-rate control loop
+#define CRITICAL_PORT (PORT + 1) // The port of the critical lane's socket
+#define CRITICAL_DEPTH 8 // Critical requests that may await a reply at once, a power of two
+#define CRITICAL_ID_BIT 0x80000000u // Set in the request id of every critical request
+#define CRITICAL_TOS 0xb8 // DSCP expedited forwarding, in the IP TOS byte
+#define LATENCY_BUCKETS 24 // Powers of two of microseconds in a LatencyStats histogram
+#define RX_CONTROL_LEN 64 // Ancillary data read with a datagram, room for its receive timestamp
 
 // socklen_t is part of unistd.h so needs to be created for windows
 # ifdef _WIN32
@@ -42,32 +68,404 @@ typedef int socklen_t;
 // pass the server as an argument to the program
 //#define SERVER "192.168.56.101"
 
+/**
+ * @brief How frames reach the client
+ */
+enum Transport {
+  TRANSPORT_UDP = 0,	///< datagrams on PORT
+  TRANSPORT_SHM = 1	///< shared-memory rings, client on the same host
+};
+
+/**
+ * @brief Settings chosen on the command line
+ */
+struct ServerOptions {
+  int transport = TRANSPORT_UDP;	///< Transport to the client
+  std::string shmName = SHM_DEFAULT_NAME;	///< segment used by TRANSPORT_SHM
+  int wire = WIRE_BINARY;	///< WireFormat of requests and replies
+  int replies = REPLY_PACKED;	///< ReplyMode expected from the client
+  bool batch = true;	///< use sendmmsg/recvmmsg where available
+  bool uring = false;	///< drive the socket through io_uring where available
+  int timeoutMs = DEFAULT_TIMEOUT_MS;	///< reply timeout before the first retransmission
+  int retries = DEFAULT_RETRIES;	///< retransmissions before giving up
+  double telemetryRate = DEFAULT_TELEMETRY_HZ;	///< pushed vessel state rate, zero to poll
+  double tickRate = DEFAULT_TICK_HZ;	///< control ticks per second, see TickScheduler
+  bool pipeline = true;	///< plan on a thread of its own while another does the I/O, see StateRecord
+  double sceneRadius = 0;	///< objects fetched for collision checks lie within this distance, zero for all
+  double sceneConeDeg = 0;	///< and within this half-angle of the vessel's travel, degrees, zero for all
+  bool sceneDelta = false;	///< fetch whole scenes as GET_SCENE_DELTA frames, the client must know them
+  int clients = 1;	///< Orbiter clients served at once, see SessionTable
+  int workers = 0;	///< SO_REUSEPORT worker threads, see ShardPool
+  bool criticalLane = true;	///< keep collision-critical commands apart from bulk traffic, see Lane
+  bool rxTimestamps = true;	///< have the kernel stamp every datagram it receives, see RoundTripPart
+};
+
+/**
+ * Collision-critical commands must never wait behind routine
+ * telemetry. Critical requests have request slots of their own,
+ * so a full bulk window never holds them up, and over UDP they
+ * are sent from a second socket bound to CRITICAL_PORT and
+ * marked for expedited forwarding. The client answers each
+ * request to the address it came from, so the replies arrive on
+ * that socket and are read before any bulk reply. Where there
+ * is no second socket (shared memory, io_uring, a shared socket
+ * or split replies) critical requests keep their own slots and
+ * are sent at once rather than queued.
+ * @brief Priority class of a request
+ */
+enum Lane {
+  LANE_BULK = 0,	///< telemetry polls and routine commands
+  LANE_CRITICAL = 1,	///< collision avoidance, bounded to CRITICAL_DEPTH in flight
+  NUM_LANES = 2
+};
+
+/**
+ * @brief Outcome of a request
+ */
+enum RequestStatus {
+  REQUEST_OK = 0,
+  REQUEST_TIMEOUT = -1,	///< no reply after every retransmission
+  REQUEST_FAILED = -2,	///< the request slot was reused before the reply was collected
+  REQUEST_MALFORMED = -3	///< the reply did not hold a value of the type the request returns
+};
+
+/**
+ * @brief Counters of socket activity
+ */
+struct IOStats {
+  unsigned long sendCalls;	///< sendto/sendmmsg calls, futex wakes or io_uring submits
+  unsigned long recvCalls;	///< recvfrom/recvmmsg calls
+  unsigned long waits;	///< epoll_wait/select calls or io_uring waits
+  unsigned long sent;	///< datagrams or frames sent
+  unsigned long received;	///< datagrams or frames received
+  unsigned long retries;	///< requests retransmitted
+  unsigned long timeouts;	///< requests given up on
+  unsigned long errors;	///< failed socket calls
+  unsigned long allocations;	///< heap allocations made inside UDPserver calls
+};
+
+/**
+ * The kernel stamps each reply as it arrives, so the round trip
+ * of a request splits into the time until the kernel had the
+ * reply, the time the reply waited in the socket buffer, and
+ * the time this process took to decode it and run its handler.
+ * Without a kernel timestamp (io_uring, shared memory) the wait
+ * in the buffer counts as network time. Retransmitted requests
+ * add nothing to the network time, the reply may answer any
+ * copy.
+ * @brief Parts of the round trip of a request
+ */
+enum RoundTripPart {
+  RTT_NETWORK = 0,	///< request sent until the kernel received the reply, the client's time included
+  RTT_QUEUE = 1,	///< reply in the socket buffer until read
+  RTT_PROCESS = 2,	///< reply read until its handler returned
+  NUM_RTT_PARTS = 3
+};
+
+/**
+ * Time from submitting a request to its reply, as a histogram
+ * of powers of two so recording costs a few instructions
+ * @brief Request latency statistics
+ */
+struct LatencyStats {
+  unsigned long completed;	///< requests answered
+  unsigned long timeouts;	///< requests given up on
+  int64_t totalUs;	///< sum of the latencies of the answered requests
+  int64_t maxUs;	///< worst latency
+  unsigned long buckets[LATENCY_BUCKETS];	///< bucket i counts latencies below 2^(i+1) us
+  void record(int64_t us);
+  int64_t mean_us() const { return completed ? totalUs / (int64_t)completed : 0; }
+  int64_t percentile_us(double fraction) const;
+};
+
+#ifndef _WIN32
+/**
+ * @brief Readings of both clocks taken together, to place kernel timestamps on the steady clock
+ */
+struct RxClock {
+  int64_t steadyUs;	///< monotonic_us()
+  int64_t realNs;	///< CLOCK_REALTIME, the clock of the kernel's timestamps
+};
+
+RxClock rx_clock();
+bool enable_rx_timestamps(int fd);
+void attach_rx_control(struct msghdr *msg, char *control);
+int64_t kernel_receive_us(struct msghdr *msg, const RxClock &clock);
+#endif
+
+class SocketShare;
+
 class UDPserver
 {
+  friend class SocketShare;
 public:
-  UDPserver(std::string server_addr, int debug_tmp);
-# ifdef _WIN32
-  ~UDPserver() { closesocket(socketS); }
-# else
-  ~UDPserver() { close(sockfd); close(newsocket); }
-# endif
+  // Called with the request id, RequestStatus and decoded value
+  // once a reply arrives or the request times out
+  typedef std::function<void(uint32_t id, int status, const v3 &value)> ReplyHandler;
+
+  UDPserver(std::string server_addr, int debug_tmp,
+            const ServerOptions &options = ServerOptions());
+  // Session for one client, over a socket already connected to it
+  UDPserver(int fd, const struct sockaddr_in &client, int debug_tmp,
+            const ServerOptions &options = ServerOptions());
+  // Session for one client of a socket shared with others
+  UDPserver(SocketShare *socket_share, const struct sockaddr_in &client, int debug_tmp,
+            const ServerOptions &options = ServerOptions());
+  ~UDPserver();
   bool check_ping();
-  void transfer_data(std::string operation, std::string detail);
-  void transfer_data(std::string operation, std::string detail, v3 *result);
-  void transfer_data(std::string operation, std::string detail, int *result);
-  void transfer_data(std::string operation, std::string detail, double *result);
+  // Typed requests, the opcode fixes the argument and reply
+  // types and the codec, see RequestTraits
+  template <int Opcode>
+  int request(typename RequestTraits<Opcode>::Arg arg, typename RequestTraits<Opcode>::Reply *result);
+  template <int Opcode>
+  int request(typename RequestTraits<Opcode>::Arg arg, typename RequestTraits<Opcode>::Reply *result,
+              double *simTime);
+  int get_scene(std::vector<SceneObject> *scene, const SceneQuery *query = NULL);
+  // Pipelined interface, requests are sent straight away and
+  // their replies collected later by id
+  uint32_t submit(int opcode, double arg, ReplyHandler handler = ReplyHandler(), int lane = LANE_BULK);
+  template <int Opcode>
+  Ticket<Opcode> submit(typename RequestTraits<Opcode>::Arg arg, ReplyHandler handler = ReplyHandler(),
+                        int lane = LANE_BULK);
+  uint32_t submit_scene(std::vector<SceneObject> *scene, const SceneQuery *query = NULL);
+  uint32_t submit_actuators(const ActuatorFrame &frame, ReplyHandler handler = ReplyHandler(),
+                            int lane = LANE_BULK);
+  int apply_actuators(const ActuatorFrame &frame, v3 *rcs, int lane = LANE_BULK);
+  // Whole vessel state at one simulation time, see get_vessel_state
+  uint32_t submit_vessel_state(TelemetrySample *state, ReplyHandler handler = ReplyHandler(),
+                               int lane = LANE_BULK);
+  int get_vessel_state(TelemetrySample *state);
+  bool ready(uint32_t id);
+  // The reply of an untyped request or an interface of its own
+  // only gives its status, a typed one is waited for by Ticket
+  int wait(uint32_t id);
+  template <int Opcode>
+  int wait(Ticket<Opcode> ticket) { return wait(ticket.id); }
+  template <int Opcode>
+  int wait(Ticket<Opcode> ticket, typename RequestTraits<Opcode>::Reply *result);
+  template <int Opcode>
+  int wait(Ticket<Opcode> ticket, typename RequestTraits<Opcode>::Reply *result, double *simTime);
+  void wait_all();
+  void set_timeouts(int timeout_ms, int retries);
+  // Pushed vessel state, see TelemetryCache
+  int subscribe(double rate_hz);
+  const TelemetryCache &telemetry() const { return cache; }
+  // Simulation time of the client, see ClockSync
+  int sync_clock();
+  const ClockSync &clock() const { return clockSync; }
+  unsigned long dropped_replies() const { return dropped; }
+  // Batched socket I/O, requests are queued until flush() and
+  // poll() reads every reply already waiting on the socket
+  void set_batching(bool enable);
+  void flush();
+  void poll();
+  const IOStats &io_stats() const { return stats; }
+  // Latency of the requests of one Lane
+  const LatencyStats &lane_stats(int lane) const { return laneStats[lane]; }
+  // Where the round trips of one opcode's requests went, see RoundTripPart
+  const LatencyStats &round_trip_stats(int opcode, int part) const { return roundTrips[opcode][part]; }
+  bool critical_socket() const { return critfd >= 0; }
 private:
+  /**
+   * @brief State of a request awaiting its reply
+   */
+  struct Slot {
+    uint32_t id;
+    int opcode;
+    double arg;	// kept for retransmission
+    const WireCodec *codec;	// codec generated for a typed request, NULL for the generic one
+    int state;
+    int status;	// RequestStatus once the slot is done
+    int attempts;	// retransmissions so far
+    int lane;	// Lane the request travels in
+    int64_t deadline;	// steady clock, microseconds
+    int64_t submittedUs;	// first transmission, steady clock
+    int64_t sentUs;	// last transmission, steady clock
+    int64_t kernelUs;	// reply reached the kernel, steady clock, zero if unknown
+    int64_t repliedUs;	// reply read from the socket, steady clock
+    bool stamped;	// the client sent the simulation time of the value
+    double simTime;	// valid if stamped, seconds
+    ActuatorFrame actuators;	// payload of a SET_ACTUATORS request
+    SceneQuery query;	// payload of a GET_SCENE_NEAR request
+    TelemetrySample *stateDst;	// where a GET_VESSEL_STATE reply is copied, may be NULL
+    v3 value;
+    ReplyHandler handler;
+  };
+  enum { SLOT_FREE, SLOT_PENDING, SLOT_DONE };
+  /**
+   * Adds the heap allocations made during a public call to
+   * stats.allocations, calls made from inside another are
+   * only counted by the outermost one
+   * @brief Allocation tally of a public call
+   */
+  class CallTally {
+  public:
+    explicit CallTally(UDPserver &s) : server(s), start(heap_allocations()) { server.callDepth++; }
+    ~CallTally() {
+      if (--server.callDepth == 0)
+        server.stats.allocations += heap_allocations() - start;
+    }
+  private:
+    UDPserver &server;
+    uint64_t start;
+  };
+  int callDepth;	// public calls in progress on this thread
   int debug;
+  int wire;	// WireFormat used for requests and replies
+  int replies;	// ReplyMode expected from the client
+  uint32_t seq;	// sequence number of the last request sent
+  uint32_t criticalSeq;	// the same for the critical lane, without CRITICAL_ID_BIT
+  bool lanes;	// critical requests are kept apart, see Lane
+  unsigned long dropped;	// late, duplicate or unexpected replies
+  bool batching;	// queue requests and use sendmmsg/recvmmsg
+  int queued;	// requests waiting in the outbound queue
+  IOStats stats;
+  LatencyStats laneStats[NUM_LANES];
+  LatencyStats roundTrips[NUM_OPCODES][NUM_RTT_PARTS];
+  bool rxTimestamps;	// the kernel stamps the replies on the sockets read here
+  int64_t rxReadUs, rxKernelUs;	// when the datagram being dispatched was read and reached the kernel
+  TelemetryCache cache;	// newest pushed telemetry frame
+  bool stateRequests;	// ask for the vessel state with GET_VESSEL_STATE
+  bool stateAnswered;	// the client has answered a GET_VESSEL_STATE
+  ClockSync clockSync;	// local clock to simulation time
+  int timeoutMs;	// reply timeout before the first retransmission
+  int maxRetries;
   void error(const char *msg) { perror(msg); exit(EXIT_FAILURE); }
-  //void perform_transfer(const char *data);
+  void report(const char *msg) { perror(msg); stats.errors++; }
+  void init(int debug_tmp, const ServerOptions &options);
+  void open_socket(const ServerOptions &options);
+  void watch_socket(const ServerOptions &options);
+  void open_critical_lane();
+  Slot &slot_for(uint32_t id);
+  Slot &acquire_slot(int opcode, double arg, ReplyHandler handler, int lane = LANE_BULK);
+  void complete(Slot &slot, int status, const v3 &value);
+  int64_t arrival_us(const Slot &slot) const { return slot.kernelUs != 0 ? slot.kernelUs : slot.repliedUs; }
+  uint32_t submit_request(int opcode, double arg, const WireCodec *codec, ReplyHandler handler, int lane);
+  // Any destination converts, so these are only reached through
+  // the typed waits and the interfaces whose replies they know
+  int wait(uint32_t id, v3 *result);
+  int wait(uint32_t id, int *result);
+  int wait(uint32_t id, double *result);
+  int wait(uint32_t id, v3 *result, double *simTime);
+  void send_request(Slot &slot);
+  int receive_reply();
+  int receive_batch();
+  bool wait_readable(int timeout_ms);
+  void drain();
+  void drain_critical();
+  void expire();
+  int next_timeout();
+  void pump();
+  void dispatch(char *data, int n, int64_t readUs, int64_t kernelUs);
+  void dispatch_fragment(const SceneFragment &frag);
+  void dispatch_delta(const SceneDeltaFragment &frag);
+  void dispatch_state(uint32_t seq, const TelemetrySample &state);
+  int receive_split(int count, v3 *result);
+  double reply_time(const Slot &slot) const;
+  int poll_scene(std::vector<SceneObject> *scene, const SceneQuery *query);
+  int poll_vessel_state(TelemetrySample *state);
+  // Bulk requests take the first MAX_IN_FLIGHT slots by request
+  // id, critical ones the CRITICAL_DEPTH after them
+  Slot slots[MAX_IN_FLIGHT + CRITICAL_DEPTH];
+  uint32_t sceneId;	// request id of the scene being reassembled
+  std::vector<SceneObject> *sceneDst;	// scene being reassembled
+  int sceneFragments, sceneReceived;
+  std::vector<char> fragmentSeen;	// fragments of the scene received so far
+  bool deltaScenes;	// whole scenes are fetched with GET_SCENE_DELTA
+  uint32_t sceneFrame;	// delta frame held whole by deltaBase, zero for none
+  uint32_t sceneNextFrame;	// delta frame being decoded into deltaBase
+  std::vector<SceneObject> deltaBase;	// scene the deltas apply to, copied to sceneDst once whole
   int port, sockfd, newsocket, serverlen, pid;
+  int epfd;	// epoll instance watching sockfd and critfd
+  int critfd;	// socket of the critical lane, -1 without one
+  ShmChannel *shm;	// NULL unless the client is reached through shared memory
+  UringSocket *uring;	// NULL unless the socket is driven through io_uring
+  SocketShare *share;	// NULL unless the socket is shared with other sessions
 # ifdef _WIN32
   SOCKET socketS;
 # endif
   socklen_t cli_len;
   struct sockaddr_in server, cli_addr;
   char buffer[BUFLEN];
+  char outBufs[BATCH_SIZE][REQUEST_LEN];	// outbound queue
+  char inBufs[BATCH_SIZE][BUFLEN];	// receive ring for recvmmsg
+  char critIn[BUFLEN];	// critical reply being dispatched
+  char rxControl[RX_CONTROL_LEN];	// ancillary data of a datagram read alone
+  char critOut[REQUEST_LEN];	// critical request being sent
+# ifndef _WIN32
+  struct mmsghdr outMsgs[BATCH_SIZE], inMsgs[BATCH_SIZE];
+  struct iovec outIov[BATCH_SIZE], inIov[BATCH_SIZE];
+  struct sockaddr_in inAddrs[BATCH_SIZE];
+  char inControl[BATCH_SIZE][RX_CONTROL_LEN];
+# endif
   const char *serv_addr;
 };
 
+/**
+ * Send a typed request without waiting for its reply. Over the
+ * binary encoding it is encoded and its reply decoded by the
+ * RequestCodec of the opcode.
+ * @brief Submit a typed request
+ * @param arg Argument of the request
+ * @param handler Called with the reply, as for the untyped submit
+ * @param lane Lane of the request
+ * @return Ticket to wait on
+ */
+template <int Opcode>
+Ticket<Opcode> UDPserver::submit(typename RequestTraits<Opcode>::Arg arg, ReplyHandler handler, int lane)
+{
+  return Ticket<Opcode>(submit_request(Opcode, arg, &RequestCodec<Opcode>::wire, std::move(handler), lane));
+}
+
+/**
+ * @brief Wait for the reply to a typed request
+ * @param ticket Returned by submit()
+ * @param result Decoded reply, of the type the opcode returns
+ * @return RequestStatus
+ */
+template <int Opcode>
+int UDPserver::wait(Ticket<Opcode> ticket, typename RequestTraits<Opcode>::Reply *result)
+{
+  return wait(ticket.id, result);
+}
+
+/**
+ * @brief Wait for the reply to a typed request and the time it was taken, see wait()
+ * @param ticket Returned by submit()
+ * @param result Decoded reply, of the type the opcode returns
+ * @param simTime Time the value was taken
+ * @return RequestStatus
+ */
+template <int Opcode>
+int UDPserver::wait(Ticket<Opcode> ticket, typename RequestTraits<Opcode>::Reply *result, double *simTime)
+{
+  return wait(ticket.id, result, simTime);
+}
+
+/**
+ * @brief Send a typed request and wait for its reply
+ * @param arg Argument of the request
+ * @param result Decoded reply
+ * @return RequestStatus
+ */
+template <int Opcode>
+int UDPserver::request(typename RequestTraits<Opcode>::Arg arg, typename RequestTraits<Opcode>::Reply *result)
+{
+  return wait(submit<Opcode>(arg), result);
+}
+
+/**
+ * @brief Send a typed request and wait for its reply and the time it was taken, see wait()
+ * @param arg Argument of the request
+ * @param result Decoded reply
+ * @param simTime Time the value was taken
+ * @return RequestStatus
+ */
+template <int Opcode>
+int UDPserver::request(typename RequestTraits<Opcode>::Arg arg, typename RequestTraits<Opcode>::Reply *result,
+                       double *simTime)
+{
+  return wait(submit<Opcode>(arg), result, simTime);
+}
+
 #endif //UDPSERVER_h
@@ -0,0 +1,87 @@
+// ==============================================================
+//                  ORBITER MODULE: Rcontrol
+//
+// uring.h
+//
+// io_uring backend for the UDP socket. Sends queued during a
+// control tick are submitted together and datagrams are read
+// by a multishot receive into a ring of provided buffers, so
+// most ticks cost a single io_uring_enter call. Only built
+// where the kernel headers describe multishot receives; the
+// caller falls back to plain socket calls when open() fails.
+// ==============================================================
+
+#ifndef URING_H
+#define URING_H
+
+#include <stddef.h>
+#include <stdint.h>
+#ifndef _WIN32
+# include <netinet/in.h>
+# include <sys/socket.h>
+# include <sys/uio.h>
+#endif
+
+#define URING_ENTRIES 256	// submission queue entries
+#define URING_SEND_SLOTS 128	// sends that may be in flight at once
+#define URING_SEND_LEN 128	// largest request
+#define URING_RECV_BUFS 256	// provided receive buffers, a power of two
+#define URING_RECV_LEN 1500	// largest datagram
+
+/**
+ * Wraps an io_uring instance driving one UDP socket through raw
+ * system calls, without liburing. Inbound datagrams are read in
+ * place from the provided buffer they landed in, which is handed
+ * back to the kernel by release().
+ * @brief io_uring driven UDP socket
+ */
+class UringSocket
+{
+public:
+  UringSocket();
+  ~UringSocket();
+  bool open(int sockfd);
+  char *send_buffer();
+  bool queue_send(size_t len, const struct sockaddr_in *addr, socklen_t addrlen);
+  int submit();
+  bool wait(int timeout_ms);
+  char *next_datagram(size_t *len, struct sockaddr_in *from);
+  void release();
+  unsigned long take_send_errors();
+private:
+  UringSocket(const UringSocket &);
+  UringSocket &operator=(const UringSocket &);
+  struct io_uring_sqe *get_sqe();
+  bool arm_receive();
+  int enter(unsigned to_submit, unsigned min_complete, unsigned flags, const void *arg, size_t argsz);
+  int ringfd;
+  void *rings;	// SQ and CQ rings, one mapping
+  size_t ringsLen;
+  struct io_uring_sqe *sqes;
+  size_t sqesLen;
+  // SQ ring fields
+  unsigned *sqHead, *sqTail, *sqMask, *sqArray;
+  unsigned sqLocalTail;	// SQEs written, submitted up to *sqTail
+  // CQ ring fields
+  unsigned *cqHead, *cqTail, *cqMask;
+  struct io_uring_cqe *cqes;
+  // Provided receive buffers
+  struct io_uring_buf_ring *bufRing;
+  size_t bufRingLen;
+  char *recvBufs;
+  uint16_t bufTail;
+  int heldBuffer;	// buffer of the datagram last returned, -1 if none
+  // Send slots, each reused once its completion is seen
+  char sendBufs[URING_SEND_SLOTS][URING_SEND_LEN];
+#ifndef _WIN32
+  struct msghdr recvHdr;	// template for the multishot receive
+  struct msghdr sendHdrs[URING_SEND_SLOTS];
+  struct iovec sendIov[URING_SEND_SLOTS];
+  struct sockaddr_in sendAddrs[URING_SEND_SLOTS];
+#endif
+  bool sendBusy[URING_SEND_SLOTS];
+  int nextSend;
+  unsigned long sendErrors;
+};
+
+#endif //URING_H
@@ -0,0 +1,74 @@
+// ==============================================================
+//                  ORBITER MODULE: Rcontrol
+//
+// wire.h
+//
+// Little-endian field access for the binary frames, shared by
+// the protocol codec and the typed request codecs.
+// ==============================================================
+
+#ifndef WIRE_H
+#define WIRE_H
+
+#include <stdint.h>
+#include <string.h>
+
+// Little-endian helpers, independent of the host byte order
+static inline void put16(char *p, uint16_t v)
+{
+  p[0] = (char)(v & 0xff);
+  p[1] = (char)(v >> 8);
+}
+
+static inline void put32(char *p, uint32_t v)
+{
+  for (int i = 0; i < 4; i++)
+    p[i] = (char)((v >> (8 * i)) & 0xff);
+}
+
+static inline void put64(char *p, uint64_t v)
+{
+  for (int i = 0; i < 8; i++)
+    p[i] = (char)((v >> (8 * i)) & 0xff);
+}
+
+static inline uint16_t get16(const char *p)
+{
+  const unsigned char *u = (const unsigned char *)p;
+  return (uint16_t)(u[0] | (u[1] << 8));
+}
+
+static inline uint32_t get32(const char *p)
+{
+  const unsigned char *u = (const unsigned char *)p;
+  uint32_t v = 0;
+  for (int i = 3; i >= 0; i--)
+    v = (v << 8) | u[i];
+  return v;
+}
+
+static inline uint64_t get64(const char *p)
+{
+  const unsigned char *u = (const unsigned char *)p;
+  uint64_t v = 0;
+  for (int i = 7; i >= 0; i--)
+    v = (v << 8) | u[i];
+  return v;
+}
+
+static inline void putDouble(char *p, double d)
+{
+  uint64_t v;
+  memcpy(&v, &d, sizeof(v));
+  put64(p, v);
+}
+
+static inline double getDouble(const char *p)
+{
+  uint64_t v = get64(p);
+  double d;
+  memcpy(&d, &v, sizeof(d));
+  return d;
+}
+
+#endif //WIRE_H
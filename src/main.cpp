@@ -1,7 +1,13 @@
 #include "udpserver.h"
 #include "navap.h"
+#include "session.h"
+#include "shard.h"
 #include "types.h"
+#include <chrono>
 #include <iostream>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
 
 
 static void show_help(std::string name)
@@ -11,9 +17,85 @@ static void show_help(std::string name)
         << "\t-h, --help\t\tShow this help\n"
         << "\t-v, --verbose\tSet to verbose mode"
         << "\t-f, --file FILE_LOCATION\tSpecify the OpenCL file location"
+        << "\t-w, --wire FORMAT\tWire format, binary (default) or json"
+        << "\t-s, --split-replies\tOld JSON clients, one reply per vector component"
+        << "\t--no-batch\tOne system call per datagram instead of sendmmsg/recvmmsg"
+        << "\t--io-uring\tDrive the socket through io_uring, falls back if unavailable"
+        << "\t--no-critical-lane\tSend collision avoidance commands with the rest of the traffic"
+        << "\t--no-timestamps\tDo not have the kernel stamp replies, round trips are not split up"
+        << "\t-t, --timeout MS\tReply timeout before the first retransmission"
+        << "\t-r, --retries N\tRetransmissions before a request is given up"
+        << "\t--telemetry-rate HZ\tRate of the pushed vessel state, 0 to poll it"
+        << "\t--tick-rate HZ\tRate of the control loop of the autopilot"
+        << "\t--no-pipeline\tPlan on the thread doing the I/O instead of a thread of its own"
+        << "\t--transport TYPE\tReach the client over udp (default) or shm for one on this host"
+        << "\t--shm-name NAME\tShared memory segment used by --transport shm"
+        << "\t-c, --clients N\tServe up to N Orbiter clients at once, one session each"
+        << "\t--workers N\tSpread the clients over N threads with a SO_REUSEPORT socket each"
+        << "\t--scene-radius M\tOnly check objects within M metres of the vessel"
+        << "\t--scene-cone DEG\tOnly check objects within DEG degrees of the direction of travel"
+        << "\t--scene-delta\tFetch whole scenes as changes since the last one, the client must support it"
         << std::endl;
 }
 
+// Fly one client's vessel until it arrives, then hand its
+// session back so the client can start again
+static void run_session(SessionTable *table, UDPserver *session, int debug,
+                        std::string file, ServerOptions options)
+{
+  NavAP nav(session, debug, file, options);
+  nav.init();
+  nav.NavAPMain();
+  table->close(session);
+}
+
+// Fly the vessels of every client on the worker threads of a
+// ShardPool. A worker runs the ticks of its clients in turn as
+// they fall due, so there is no thread per client
+static int run_workers(int debug, std::string file, ServerOptions options)
+{
+  // The worker is the one thread of each of its autopilots
+  options.pipeline = false;
+  ShardPool pool(debug, options);
+  // Wake often enough to start each tick within a millisecond of its deadline
+  pool.set_idle_ms(1);
+  std::unordered_map<UDPserver *, NavAP *> navs;
+  std::mutex lock;	// guards navs, each entry is only used by its session's worker
+  ShardPool::SessionHandler accepted = [&](UDPserver *session) {
+    NavAP *nav = new NavAP(session, debug, file, options);
+    nav->init();
+    nav->startNavigation();
+    std::lock_guard<std::mutex> guard(lock);
+    navs[session] = nav;
+  };
+  ShardPool::SessionHandler tick = [&](UDPserver *session) {
+    NavAP *nav;
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      std::unordered_map<UDPserver *, NavAP *>::iterator it = navs.find(session);
+      if (it == navs.end())
+        return;
+      nav = it->second;
+    }
+    if (nav->pollNavigation())
+      return;
+    // Arrived, the client can ping again to start over
+    nav->stopNavigation();
+    delete nav;
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      navs.erase(session);
+    }
+    pool.close(session);
+  };
+  if (!pool.start(accepted, tick))
+    return 1;
+  std::cout << "Awaiting incoming connections on " << pool.size() << " workers..." << std::endl;
+  while (1)
+    std::this_thread::sleep_for(std::chrono::seconds(1));
+  return 0;
+}
+
 
 int main(int argc, char *argv[])
 {
@@ -21,6 +103,7 @@ int main(int argc, char *argv[])
   int debug = 0;
   std::string file;
   std::string ip;
+  ServerOptions options;
   if (argc > 1) {
     for (int i = 1; i < argc; ++i) {
         std::string arg = argv[i];
@@ -52,6 +135,164 @@ int main(int argc, char *argv[])
                 return 1;
             }
         }
+        else if ((arg == "-s") || (arg == "--split-replies")) {
+            std::cout << "Message: --split-replies specified, expecting one datagram per component." << std::endl;
+            options.replies = REPLY_SPLIT;
+        }
+        else if (arg == "--no-batch") {
+            std::cout << "Message: --no-batch specified, batched socket I/O disabled." << std::endl;
+            options.batch = false;
+        }
+        else if (arg == "--no-critical-lane") {
+            std::cout << "Message: --no-critical-lane specified, one lane for every request." << std::endl;
+            options.criticalLane = false;
+        }
+        else if (arg == "--no-timestamps") {
+            std::cout << "Message: --no-timestamps specified, kernel receive timestamps disabled." << std::endl;
+            options.rxTimestamps = false;
+        }
+        else if (arg == "--no-pipeline") {
+            std::cout << "Message: --no-pipeline specified, planning and I/O share one thread." << std::endl;
+            options.pipeline = false;
+        }
+        else if (arg == "--scene-delta") {
+            std::cout << "Message: --scene-delta specified, scenes are fetched as delta frames." << std::endl;
+            options.sceneDelta = true;
+        }
+        else if (arg == "--io-uring") {
+            std::cout << "Message: --io-uring specified, using io_uring where the kernel supports it." << std::endl;
+            options.uring = true;
+        }
+        else if ((arg == "-t") || (arg == "--timeout")) {
+            if (i + 1 < argc) {
+                options.timeoutMs = atoi(argv[i + 1]);
+                std::cout << "Reply timeout: " << options.timeoutMs << " ms" << std::endl;
+            }
+            else {
+                std::cerr << "--timeout option requires one argument." << std::endl;
+                return 1;
+            }
+        }
+        else if ((arg == "-r") || (arg == "--retries")) {
+            if (i + 1 < argc) {
+                options.retries = atoi(argv[i + 1]);
+                std::cout << "Retransmissions per request: " << options.retries << std::endl;
+            }
+            else {
+                std::cerr << "--retries option requires one argument." << std::endl;
+                return 1;
+            }
+        }
+        else if (arg == "--telemetry-rate") {
+            if (i + 1 < argc) {
+                options.telemetryRate = atof(argv[i + 1]);
+                std::cout << "Telemetry rate: " << options.telemetryRate << " Hz" << std::endl;
+            }
+            else {
+                std::cerr << "--telemetry-rate option requires one argument." << std::endl;
+                return 1;
+            }
+        }
+        else if (arg == "--tick-rate") {
+            if (i + 1 < argc && atof(argv[i + 1]) > 0) {
+                options.tickRate = atof(argv[i + 1]);
+                std::cout << "Control tick rate: " << options.tickRate << " Hz" << std::endl;
+            }
+            else {
+                std::cerr << "--tick-rate option requires a positive rate." << std::endl;
+                return 1;
+            }
+        }
+        else if (arg == "--scene-radius") {
+            if (i + 1 < argc) {
+                options.sceneRadius = atof(argv[i + 1]);
+                std::cout << "Scene radius: " << options.sceneRadius << " m" << std::endl;
+            }
+            else {
+                std::cerr << "--scene-radius option requires one argument." << std::endl;
+                return 1;
+            }
+        }
+        else if (arg == "--scene-cone") {
+            if (i + 1 < argc) {
+                options.sceneConeDeg = atof(argv[i + 1]);
+                std::cout << "Scene cone: " << options.sceneConeDeg << " degrees" << std::endl;
+            }
+            else {
+                std::cerr << "--scene-cone option requires one argument." << std::endl;
+                return 1;
+            }
+        }
+        else if (arg == "--transport") {
+            if (i + 1 < argc) {
+                std::string transport = argv[i + 1];
+                if (transport == "udp") {
+                    options.transport = TRANSPORT_UDP;
+                }
+                else if (transport == "shm") {
+                    options.transport = TRANSPORT_SHM;
+                }
+                else {
+                    std::cerr << "--transport must be udp or shm." << std::endl;
+                    return 1;
+                }
+                std::cout << "Transport: " << transport << std::endl;
+            }
+            else {
+                std::cerr << "--transport option requires one argument." << std::endl;
+                return 1;
+            }
+        }
+        else if ((arg == "-c") || (arg == "--clients")) {
+            if (i + 1 < argc) {
+                options.clients = atoi(argv[i + 1]);
+                std::cout << "Clients served at once: " << options.clients << std::endl;
+            }
+            else {
+                std::cerr << "--clients option requires one argument." << std::endl;
+                return 1;
+            }
+        }
+        else if (arg == "--workers") {
+            if (i + 1 < argc && atoi(argv[i + 1]) > 0) {
+                options.workers = atoi(argv[i + 1]);
+                std::cout << "Worker threads: " << options.workers << std::endl;
+            }
+            else {
+                std::cerr << "--workers option requires a positive count." << std::endl;
+                return 1;
+            }
+        }
+        else if (arg == "--shm-name") {
+            if (i + 1 < argc) {
+                options.shmName = argv[i + 1];
+                std::cout << "Shared memory segment: " << options.shmName << std::endl;
+            }
+            else {
+                std::cerr << "--shm-name option requires one argument." << std::endl;
+                return 1;
+            }
+        }
+        else if ((arg == "-w") || (arg == "--wire")) {
+            if (i + 1 < argc) {
+                std::string format = argv[i + 1];
+                if (format == "json") {
+                    options.wire = WIRE_JSON;
+                }
+                else if (format == "binary") {
+                    options.wire = WIRE_BINARY;
+                }
+                else {
+                    std::cerr << "--wire must be binary or json." << std::endl;
+                    return 1;
+                }
+                std::cout << "Wire format: " << format << std::endl;
+            }
+            else {
+                std::cerr << "--wire option requires one argument." << std::endl;
+                return 1;
+            }
+        }
     }
   }
   if (file == "") {
@@ -62,7 +303,22 @@ int main(int argc, char *argv[])
       return 1;
   }
 
-  NavAP *nav = new NavAP(ip, debug, file);
+  if (options.workers > 0 && options.transport == TRANSPORT_UDP)
+    return run_workers(debug, file, options);
+
+  // Several clients each get a session and a NavAP of their
+  // own, running in its own thread
+  if (options.clients > 1 && options.transport == TRANSPORT_UDP) {
+    SessionTable table(debug, options);
+    std::cout << "Awaiting incoming connections..." << std::endl;
+    UDPserver *session;
+    while ((session = table.accept()) != NULL) {
+        std::thread(run_session, &table, session, debug, file, options).detach();
+    }
+    return 1;
+  }
+
+  NavAP *nav = new NavAP(ip, debug, file, options);
   std::cout << "Awaiting incoming connections..." << std::endl;
   while (1) {
     if (nav->check_ping()) {
@@ -20,19 +20,61 @@
 #include <chrono>
 
 #define PI 3.1415
+#define RAY_HORIZON_S 1.0	// seconds of travel the collision ray covers
 
 /**
  * Constructor for the NavAP class. Receives the program arguments
  * and copies them to private members
  * @brief Setups the members for the NavAP class
  */
-NavAP::NavAP(std::string ip, int debug, std::string file)
+NavAP::NavAP(std::string ip, int debug, std::string file, const ServerOptions &options)
 {
-  serverConnect = new UDPserver(ip, debug);
+  serverConnect = new UDPserver(ip, debug, options);
+  telemetryRate = options.telemetryRate;
+  tickRate = options.tickRate;
+  pipeline = options.pipeline;
+  setSceneQuery(options);
   debugID = debug;
   cl_file = file;
 }
 
+/**
+ * Constructor for a NavAP attached to one client session of a
+ * SessionTable. The client has already been pinged, so init()
+ * is called instead of check_ping().
+ * @brief Attach a NavAP to a client session
+ */
+NavAP::NavAP(UDPserver *session, int debug, std::string file, const ServerOptions &options)
+{
+  serverConnect = session;
+  telemetryRate = options.telemetryRate;
+  tickRate = options.tickRate;
+  pipeline = options.pipeline;
+  setSceneQuery(options);
+  debugID = debug;
+  cl_file = file;
+}
+
+/**
+ * Only the objects inside the query region are fetched and
+ * checked for collisions, the cone follows the direction of
+ * travel once the vessel is moving
+ * @brief Set the interest region of the scene snapshots
+ * @param options Server options giving the radius and cone
+ */
+void NavAP::setSceneQuery(const ServerOptions &options)
+{
+  sceneQuery.flags = 0;
+  if (options.sceneRadius > 0) {
+    sceneQuery.flags |= QUERY_RADIUS;
+    sceneQuery.radius = options.sceneRadius;
+  }
+  if (options.sceneConeDeg > 0 && options.sceneConeDeg < 180) {
+    sceneQuery.flags |= QUERY_CONE;
+    sceneQuery.cone = options.sceneConeDeg * M_PI / 180;
+  }
+}
+
 /**
  * Initialise the variables of the vessels present in the simulation
  * @brief Initialise vessel variables
@@ -46,15 +88,44 @@ void NavAP::init()
     dest.currentPosition.data[i] = 0;
     dest.previousPosition.data[i] = 0;
     dest.direction.data[i] = 0;
+    vessel.velocity.data[i] = 0;
+    dest.velocity.data[i] = 0;
   }
+  vessel.currentTime = vessel.previousTime = 0;
+  dest.currentTime = dest.previousTime = 0;
   // set the destination for the vessel
   v3 destinationPos;
 
-  operation = "GET_POS";
-  detail = "60";
-  serverConnect->transfer_data(operation, detail, &destinationPos);
+  serverConnect->request<GET_POS>(60, &destinationPos);
   setNavDestination(destinationPos);
 
+  // Have the vessel state pushed to us instead of polling it,
+  // clients that can't stream are polled as before
+  subscribed = false;
+  if (telemetryRate > 0) {
+    subscribed = serverConnect->subscribe(telemetryRate) == REQUEST_OK;
+    // Accept samples up to three frame periods old
+    telemetryMaxAge = (int64_t)(3e6 / telemetryRate);
+    std::cout << "Telemetry " << (subscribed ? "streaming" : "unavailable, polling") << std::endl;
+  }
+
+  // Map our clock onto simulation time so positions can be
+  // differentiated over the time that really passed between them
+  clockSynced = false;
+  for (int i = 0; i < CLOCK_SYNC_SAMPLES; i++) {
+    if (serverConnect->sync_clock() != REQUEST_OK)
+      break;
+    clockSynced = true;
+  }
+  if (clockSynced) {
+    const ClockSync &clock = serverConnect->clock();
+    std::cout << "Clock synced, round trip " << clock.min_rtt_us() << " us, smoothed "
+              << clock.rtt_us() << " +/- " << clock.rtt_var_us() << " us" << std::endl;
+  }
+  else {
+    std::cout << "Clock sync unavailable, timing positions locally" << std::endl;
+  }
+
 }
 
 /**
@@ -72,259 +143,357 @@ bool NavAP::check_ping()
 }
 
 /**
- * Main loop to perform navigation techniques and call appropriate functions
+ * Main loop to perform navigation techniques and call appropriate
+ * functions. Every tick senses the vessel and the scene, advances
+ * the navigation one step and sends the commands, so no wait for
+ * an angle to converge or a collision to clear holds up the rest.
+ * With a planning thread, the step of a tick is worked out while
+ * this thread does the I/O of the next one, and its commands are
+ * sent in the first tick after they are ready.
  * @brief Main navigation loop
  */
 void NavAP::NavAPMain()
+{
+  startNavigation();
+  while (navigationTick())
+    ticks.wait_next();
+  stopNavigation();
+}
+
+/**
+ * For a thread flying several vessels, a ShardPool worker, that
+ * paces their ticks itself. The first tick is due straight away.
+ * @brief Start the navigation without entering its loop
+ */
+void NavAP::startNavigation()
 {
   if (debugID) {
     std::cout << "Running in debug mode" << std::endl;
   } else {
     std::cout << "Running in normal mode" << std::endl;
   }
-  // get the position of the vessel
-  operation = "GET_POS";
-  detail = "0";
-  serverConnect->transfer_data(operation, detail, &vessel.currentPosition);
-
-  // Set the main thrusters
-  operation = "SET_THRUST";
-  detail = "1";
-  int thrustCheck;
-  serverConnect->transfer_data(operation, detail, &thrustCheck);
-
-  // while the vessel isn't at the destination
-  while (!((vessel.currentPosition.x < dest.currentPosition.x + 5) && (vessel.currentPosition.x > dest.currentPosition.x - 5) &&
-           (vessel.currentPosition.y < dest.currentPosition.y + 5) && (vessel.currentPosition.y > dest.currentPosition.x - 5) &&
-           (vessel.currentPosition.z < dest.currentPosition.z + 5) && (vessel.currentPosition.z > dest.currentPosition.z - 5)))
-  {
-    // count the objects currently in the rendered simulation area
-    int num_obj = 0;
-    operation = "GET_OBJ_COUNT";
-    serverConnect->transfer_data(operation, detail, &num_obj);
+  // get the state of the vessel and set the main thrusters,
+  // both requests are in flight together
+  Ticket<SET_THRUST> thrustRequest = serverConnect->submit<SET_THRUST>(1);
+  tickState = VesselState();
+  fetchVesselState(&tickState);
+  double thrustCheck;
+  serverConnect->wait(thrustRequest, &thrustCheck);
+
+  enterPhase(NAV_ALIGN_X);
+  loopPhase = navPhase;
+  pipelined = startPlanner();
+  scenesFetched = 0;
+  answeredTick = UINT32_MAX;
+  ticks = TickScheduler(tickRate);
+  ticks.start();
+}
+
+/**
+ * @brief Run the next control tick if it is due, without sleeping
+ * @return false once the vessel has arrived, stopNavigation() is left to the caller
+ */
+bool NavAP::pollNavigation()
+{
+  if (!ticks.due())
+    return true;
+  ticks.woke();
+  if (!navigationTick())
+    return false;
+  ticks.advance();
+  return true;
+}
+
+/**
+ * @brief Stop the planning thread once the vessel has arrived
+ */
+void NavAP::stopNavigation()
+{
+  stopPlanner();
+  std::cout << "Arrived at the destination" << std::endl;
+}
 
-    if (debugID) {
-      std::cout << "The number of objects is " << num_obj << std::endl;
+/**
+ * One tick of the navigation loop, from sensing the vessel to
+ * sending the commands. The caller waits for the next deadline.
+ * @brief Run one control tick
+ * @return false once the vessel has arrived
+ */
+bool NavAP::navigationTick()
+{
+  ticks.begin(PHASE_SENSE);
+  // Send anything still queued and collect the replies left
+  // over from the last tick without blocking
+  serverConnect->poll();
+  // Keep the offset estimate fresh, the reply is collected by
+  // a later poll() without holding up this tick
+  unsigned long syncEvery = tickRate >= 1 ? (unsigned long)tickRate : 1;
+  if (clockSynced && ticks.ticks() % syncEvery == 0)
+    serverConnect->submit<SYNC_CLOCK>(0);
+
+  // Snapshot the objects currently in the rendered simulation
+  // area, or only those near the vessel's path if a region is
+  // set. Each queued state has a scene array of its own, which
+  // stays untouched until the planner is done with it. Without
+  // a snapshot the threats of the last one stand
+  std::vector<SceneObject> *scene = &scenes[pipelined ? scenesFetched % (PIPELINE_DEPTH + 1) : 0];
+  bool room = !pipelined || sensed.size() < PIPELINE_DEPTH;
+  sceneQuery.axis = vessel.velocity;
+  if (room && serverConnect->get_scene(scene, sceneQuery.flags ? &sceneQuery : NULL) != REQUEST_OK) {
+    std::cout << "Scene snapshot timed out" << std::endl;
+    scene = NULL;
+  }
+
+  // Every decision of this tick reads the same snapshot, with
+  // no fresh position there is no direction to check against
+  bool sensedState = fetchVesselState(&tickState);
+  StateRecord record;
+  record.tick = (uint32_t)ticks.ticks();
+  record.sensedUs = monotonic_us();
+  record.answeredTick = answeredTick;
+  record.state = tickState;
+  record.scene = scene;
+  if (pipelined) {
+    if (sensedState && room) {
+      sensed.push(record);
+      scenesFetched++;
     }
-    for (int obj_it = 0; obj_it < num_obj; obj_it++)
-    {
-      int is_sim = 0;
-      operation = "IS_VESSEL";
-      detail = std::to_string(obj_it);
-      serverConnect->transfer_data(operation, detail, &is_sim);
-
-      if (is_sim == 1) {
-	return;
-      }
-
-      // Find the global position of the vessel and possible collision object
-      v3 nearObjPos;
-      operation = "GET_POS";
-      detail = std::to_string(obj_it);
-      serverConnect->transfer_data(operation, detail, &nearObjPos);
-
-
-      // Get the new current position and store the old
-      for(int i = 0; i < NUMDIM; i++) {
-        vessel.previousPosition.data[i] = vessel.currentPosition.data[i];
-      }
-      operation = "GET_POS";
-      detail = "0";
-      serverConnect->transfer_data(operation,detail, &vessel.currentPosition);
-      // Find the direction vector by subtracting the previous vector position
-      // from the new vector position
-      double directionX = vessel.currentPosition.x - vessel.previousPosition.x;
-      double directionY = vessel.currentPosition.y - vessel.previousPosition.y;
-      double directionZ = vessel.currentPosition.z - vessel.previousPosition.z;
-
-      // Create a RayBox object to determine if a collision is likely
-      // This will set up a bounding box around the near object so
-      // detections can be calculated.
-      operation = "GET_SIZE";
-      detail = std::to_string(obj_it);
-      serverConnect->transfer_data(operation, detail, &objSize);
-
-      RayBox *collisionCheck = new RayBox(nearObjPos, objSize);
-
-      // Generate a Ray using the global position and the direction vector
-      // for the vessel
-      collisionCheck->vessel_ray.origin = vessel.currentPosition;
-      collisionCheck->vessel_ray.direction.x = directionX;
-      collisionCheck->vessel_ray.direction.y = directionY;
-      collisionCheck->vessel_ray.direction.z = directionZ;
-
-
-      // Check if there is a collision object on the current path
-      if (debugID) {
-		std::cout << "Checking collision..." << std::endl;
-      }
-	  std::chrono::high_resolution_clock::time_point t1 = std::chrono::high_resolution_clock::now();
-	bool ifCollide = collisionCheck->intersect(collisionCheck->vessel_ray);
-		std::chrono::high_resolution_clock::time_point t2 = std::chrono::high_resolution_clock::now();
-		auto duration = std::chrono::duration_cast<std::chrono::nanoseconds>(t2 - t1).count();
-		std::cout << "Intersect function took: " << duration << " nanoseconds" << std::endl;
-      isCollision = ifCollide;
-      if (ifCollide)
-      {
-        printf("Collision detected!\n");
-        collisionHandler(collisionCheck, nearObjPos);
-      }
+    else if (sensedState) {
+      statesDropped++;
     }
-    // make sure the thrusters are set to zero
-    stopThrust();
+    ticks.begin(PHASE_ACT);
+    CommandRecord command;
+    while (planned.pop(&command)) {
+      sendActuators(command.frame, command.lane);
+      // Answered or given up, either way the manoeuvres waiting
+      // on it hear so with the next state
+      answeredTick = command.tick;
+      senseToAct.record(monotonic_us() - command.sensedUs);
+      planStats.record(command.planUs);
+      statesSuperseded += command.superseded;
+      loopPhase = command.phase;
+    }
+  }
+  else if (sensedState) {
+    ticks.begin(PHASE_DECIDE);
+    int lane = stepNavigation(record);
+    loopPhase = navPhase;
+    ticks.begin(PHASE_ACT);
+    flushActuators(lane);
+    answeredTick = record.tick;
+  }
+  if (debugID)
+    reportTicks(ticks);
+  return loopPhase != NAV_ARRIVED;
+}
+
+/**
+ * @brief Check whether the vessel is within 5 m of the destination on every axis
+ * @param state Vessel state of this tick
+ * @return true once it has arrived
+ */
+bool NavAP::hasArrived(const VesselState &state)
+{
+  for (int i = 0; i < NUMDIM; i++) {
+    if (!(state.position.data[i] < dest.currentPosition.data[i] + 5 &&
+          state.position.data[i] > dest.currentPosition.data[i] - 5))
+      return false;
+  }
+  return true;
+}
 
+/**
+ * The manoeuvre under way is dropped wherever it is and the one
+ * of the new phase starts from the top
+ * @brief Move the navigation to another NavPhase
+ * @param phase NavPhase to enter
+ */
+void NavAP::enterPhase(int phase)
+{
+  const char *phaseNames[NUM_NAV_PHASES] = { "align x", "align y", "cruise", "avoid", "arrived" };
+  if (debugID)
+    std::cout << "Navigation: " << phaseNames[phase] << std::endl;
+  navPhase = phase;
+  manoeuvres.cancel_all();
+  switch (phase) {
+    case NAV_ALIGN_X:
+      manoeuvres.spawn(&alignX);
+      break;
+    case NAV_ALIGN_Y:
+      manoeuvres.spawn(&alignY);
+      break;
+    case NAV_CRUISE:
+      manoeuvres.spawn(&cruise);
+      break;
+    case NAV_AVOID:
+      manoeuvres.spawn(&escape);
+      break;
+  }
+}
 
-    //  Get the current position of vessel
-    operation = "GET_POS";
-    detail = "0";
-    serverConnect->transfer_data(operation, detail, &vessel.currentPosition);
-
-    // Declare the variables to hold the vector angles
-    double ax, ay, az, ax_dest, ay_dest, az_dest;
-
-    // Calculate in radians the value for the angle for each component
-    //ax = atan2(sqrt(pow(vessel.currentPosition.y,2) + pow(vessel.currentPosition.z,2)), vessel.currentPosition.x);
-    ax = atan2(vessel.currentPosition.y, vessel.currentPosition.x);
-    //ay = atan2(sqrt(pow(vessel.currentPosition.x,2) + pow(vessel.currentPosition.z,2)), vessel.currentPosition.y);
-    ay = atan2(vessel.currentPosition.x, vessel.currentPosition.y);
-    az = atan2(sqrt(pow(vessel.currentPosition.x,2) + pow(vessel.currentPosition.y,2)), vessel.currentPosition.z);
-
-
-    printf("Angle for x component of vessel = %lf\n", ax);
-    printf("Angle for y component of vessel = %lf\n", ay);
-    printf("Angle for z component of vessel = %lf\n", az);
-
-    //ax_dest = atan2(sqrt(pow(dest.currentPosition.x,2) + pow(dest.currentPosition.z,2)), dest.currentPosition.x);
-    ax_dest = atan2(dest.currentPosition.y, dest.currentPosition.x);
-    //ay_dest = atan2(sqrt(pow(dest.currentPosition.x,2) + pow(dest.currentPosition.z,2)), dest.currentPosition.y);
-    ay_dest = atan2(dest.currentPosition.x, dest.currentPosition.y);
-    az_dest = atan2(sqrt(pow(dest.currentPosition.x,2) + pow(dest.currentPosition.y,2)), dest.currentPosition.z);
-
-    printf("Angle for x component of dest = %lf\n", ax_dest);
-    printf("Angle for y component of dest = %lf\n", ay_dest);
-    printf("Angle for z component of dest = %lf\n", az_dest);
-
-
-    bool thrustSet = false;
-    int thrustModifier = 0;
-    // Compare the angles of each of the components between vessel and dest
-    if (onCourse == false) {
-      while(abs(ax - ax_dest) > 0.2) {
-        if(ax-ax_dest > 0 && !thrustSet) {
-          setYawSpeed(-0.04);
-          thrustSet = true;
-          thrustModifier = 1;
-        }
-        else if(ax-ax_dest < 0 && thrustModifier == 1) {
-          setYawSpeed(0.04);
-          thrustModifier = 2;
-          thrustSet = true;
-        }
-        else if(ax-ax_dest < 0 && !thrustSet) {
-          setYawSpeed(0.04);
-          thrustSet = true;
-          thrustModifier = 2;
-        }
-        else if(ax-ax_dest > 0 && thrustModifier == 2) {
-          setYawSpeed(-0.04);
-          thrustModifier = 1;
-          thrustSet = true;
-        }
-        // stop thrusters to continue ascent
-        stopThrust();
-        // Get the new angle
-        //  Get the current position of vessel
-        operation = "GET_POS";
-        detail = "0";
-        serverConnect->transfer_data(operation, detail, &vessel.currentPosition);
-        //ax = atan2(sqrt(pow(vessel.currentPosition.y,2) + pow(vessel.currentPosition.z,2)), vessel.currentPosition.x);#
-        ax = atan2(vessel.currentPosition.y, vessel.currentPosition.x);
-        printf("Angle for x component of vessel = %lf\n", ax);
-        printf("Difference between the x-components = %lf\n", ax-ax_dest);
-      }
-    }
-    printf("x component angles are aligned\n");
+/**
+ * One step of the autopilot, run once per tick. Every object of
+ * the scene is checked for a collision first, whatever the phase,
+ * then the manoeuvres under way are resumed with the state. The
+ * commands are left in pendingActuators.
+ * @brief Advance the navigation state machine by one tick
+ * @param record State and scene of this tick, a NULL scene keeps the threats of the last one
+ * @return Lane to send the commands in
+ */
+int NavAP::stepNavigation(const StateRecord &record)
+{
+  if (navPhase == NAV_ARRIVED)
+    return LANE_BULK;
+  if (hasArrived(record.state)) {
     stopThrust();
-    thrustSet = false;
-    thrustModifier = 0;
-
-    if (onCourse == false) {
-      while(abs(ay - ay_dest) > 0.2) {
-        if(ay-ay_dest > 0 && !thrustSet) {
-          setPitchSpeed(-0.04);
-          thrustSet = true;
-          thrustModifier = 1;
-        }
-        else if(ay-ay_dest < 0 && thrustModifier == 1) {
-          setPitchSpeed(0.04);
-          thrustModifier = 2;
-          thrustSet = true;
-        }
-        else if(ay-ay_dest < 0 && !thrustSet) {
-          setPitchSpeed(0.04);
-          thrustSet = true;
-          thrustModifier = 2;
-        }
-        else if(ay-ay_dest > 0 && thrustModifier == 2) {
-          setPitchSpeed(-0.04);
-          thrustModifier = 1;
-          thrustSet = true;
-        }
-        // stop thrusters to continue ascent
-        stopThrust();
-        // Get the new angle
-        //  Get the current position of vessel
-        operation = "GET_POS";
-        detail = "0";
-        serverConnect->transfer_data(operation, detail, &vessel.currentPosition);
-        //ax = atan2(sqrt(pow(vessel.currentPosition.y,2) + pow(vessel.currentPosition.z,2)), vessel.currentPosition.x);#
-        ay = atan2(vessel.currentPosition.x, vessel.currentPosition.y);
-        printf("Angle for y component of vessel = %lf\n", ay);
-        printf("Difference between the y-components = %lf\n", ay-ay_dest);
-      }
+    enterPhase(NAV_ARRIVED);
+    return LANE_BULK;
+  }
+
+  if (record.scene != NULL) {
+    threatened = findThreat(record.state, *record.scene, &threat);
+    isCollision = threatened;
+    if (threatened && navPhase != NAV_AVOID) {
+      printf("Collision detected!\n");
+      enterPhase(NAV_AVOID);
     }
+  }
 
-    onCourse = true;
+  planState = &record.state;
+  TaskContext ctx;
+  ctx.tick = record.tick;
+  ctx.nowUs = record.sensedUs;
+  ctx.answeredTick = record.answeredTick;
+  manoeuvres.run(ctx);
+  int lane = navPhase == NAV_AVOID ? LANE_CRITICAL : LANE_BULK;
+
+  // The manoeuvre of the phase has finished, move on
+  if (manoeuvres.size() == 0) {
+    switch (navPhase) {
+      case NAV_ALIGN_X:
+        enterPhase(NAV_ALIGN_Y);
+        break;
+      case NAV_ALIGN_Y:
+        countIterations++;
+        enterPhase(NAV_CRUISE);
+        break;
+      case NAV_CRUISE:
+      case NAV_AVOID:
+        // Drifted off course or turned by the escape, line up again
+        enterPhase(NAV_ALIGN_X);
+        break;
+    }
+  }
+  return lane;
+}
 
-    printf("y component angles are aligned\n");
-    stopThrust();
-    thrustSet = false;
-    thrustModifier = 0;
-    countIterations++;
-    v3 currentRotVel;
-    while(abs(ay-ay_dest) < 0.2 && abs(ax-ax_dest) < 0.2) {
-      printf("On course, performing minor adjustments\n");
-      getCurrentRotVel(&currentRotVel);
-      setPitchSpeed(currentRotVel.x);
-#ifdef _WIN32
-      Sleep(20);
-#else
-      usleep(1000 * 20);
-#endif
-      setYawSpeed(-currentRotVel.y);
-#ifdef _WIN32
-      Sleep(20);
-#else
-      usleep(1000 * 20);
-#endif
-      stopThrust();
-      setPitchSpeed(currentRotVel.x);
-#ifdef _WIN32
-      Sleep(20);
-#else
-      usleep(1000 * 20);
-#endif
-      setYawSpeed(currentRotVel.y);
-#ifdef _WIN32
-      Sleep(200);
-#else
-      usleep(1000 * 200);
-#endif
+/**
+ * Angles of the vessel and destination positions about the z
+ * axis, seen from the x axis for NAV_ALIGN_X and from the y axis
+ * for NAV_ALIGN_Y
+ * @brief Angle between the vessel and destination positions
+ * @param phase NAV_ALIGN_X or NAV_ALIGN_Y
+ * @return Vessel angle less destination angle, radians
+ */
+double NavAP::alignError(int phase)
+{
+  const v3 &p = planState->position;
+  const v3 &d = dest.currentPosition;
+  if (phase == NAV_ALIGN_X)
+    return atan2(p.y, p.x) - atan2(d.y, d.x);
+  return atan2(p.x, p.y) - atan2(d.x, d.y);
+}
+
+/**
+ * Each turn is judged from the first state sensed after the
+ * client answered it, not from states that were already on their
+ * way while the command was
+ * @brief Turn about one axis until lined up with the destination
+ * @param ctx State the task acts on
+ * @return TaskStatus
+ */
+int AlignTask::resume(const TaskContext &ctx)
+{
+  TASK_BEGIN();
+  turn = 0;
+  error = nav->alignError(phase);
+  while (abs(error) > 0.2) {
+    // Turn towards the destination, the command is only sent
+    // when the turn has to change direction
+    if (error > 0 && turn != 1) {
+      if (phase == NAV_ALIGN_X)
+        nav->setYawSpeed(*nav->planState, -0.04);
+      else
+        nav->setPitchSpeed(*nav->planState, -0.04);
+      turn = 1;
+    }
+    else if (error < 0 && turn != 2) {
+      if (phase == NAV_ALIGN_X)
+        nav->setYawSpeed(*nav->planState, 0.04);
+      else
+        nav->setPitchSpeed(*nav->planState, 0.04);
+      turn = 2;
     }
+    // stop thrusters to continue ascent
+    nav->stopThrust();
+    if (nav->debugID)
+      printf("Difference between the %c-components = %lf\n", phase == NAV_ALIGN_X ? 'x' : 'y', error);
+    TASK_AWAIT_REPLY(ctx);
+    error = nav->alignError(phase);
   }
+  printf("%c component angles are aligned\n", phase == NAV_ALIGN_X ? 'x' : 'y');
+  nav->stopThrust();
+  TASK_END();
 }
 
+/**
+ * One step of the adjustment cycle every CRUISE_STEP_US, for as
+ * long as the vessel stays on course
+ * @brief Make the minor adjustments while on course
+ * @param ctx State the task acts on
+ * @return TaskStatus
+ */
+int CruiseTask::resume(const TaskContext &ctx)
+{
+  TASK_BEGIN();
+  printf("On course, performing minor adjustments\n");
+  nav->adjustStep = 0;
+  while (abs(nav->alignError(NAV_ALIGN_X)) < 0.2 && abs(nav->alignError(NAV_ALIGN_Y)) < 0.2) {
+    nav->adjustCourse(*nav->planState);
+    TASK_SLEEP_US(ctx, CRUISE_STEP_US);
+  }
+  nav->stopThrust();
+  TASK_END();
+}
 
+/**
+ * The turn is held for ESCAPE_HOLD_US before the distance to the
+ * object is compared with the one it started from, so the
+ * comparison sees what the turn did rather than the noise of a
+ * single tick
+ * @brief Turn away from the object on the path until it is clear
+ * @param ctx State the task acts on
+ * @return TaskStatus
+ */
+int EscapeTask::resume(const TaskContext &ctx)
+{
+  TASK_BEGIN();
+  nav->startEscape();
+  lastDistance = nav->threat.distance;
+  TASK_SLEEP_US(ctx, ESCAPE_HOLD_US);
+  // While a collision occurs, keep going in that direction
+  while (nav->threatened) {
+    if (nav->debugID)
+      std::cout << "Distance to collision was " << lastDistance << ", now " << nav->threat.distance << std::endl;
+    if (nav->threat.distance < lastDistance)
+      nav->reverseEscape();
+    lastDistance = nav->threat.distance;
+    TASK_SLEEP_US(ctx, ESCAPE_HOLD_US);
+  }
+  std::cout << "collision avoided" << std::endl;
+  nav->stopThrust();
+  TASK_END();
+}
 
 /**
  * Store an input coordinate vector into the destination vector
@@ -341,15 +510,12 @@ void NavAP::setNavDestination(v3 targetDest)
 /**
  * Get the airspeed angle using oapiGetAirspeedVector
  * @brief Get current airspeed angle
+ * @param state Vessel state of this tick
  * @return angle in radians
  */
-double NavAP::getAirspeedAngle()
+double NavAP::getAirspeedAngle(const VesselState &state)
 {
-  v3 speedVector;
-  std::string operation = "GET_AIRSPEED";
-  std::string detail = "0";
-  serverConnect->transfer_data(operation, detail, &speedVector);
-  //serverConnect->perform_transfer(GET_AIRSPEED, 0, &speedVector);
+  v3 speedVector = state.airspeed;
   double angle;
   angle = atan(speedVector.x / speedVector.z);
   double x = speedVector.x;
@@ -362,200 +528,178 @@ double NavAP::getAirspeedAngle()
 }
 
 /**
- * Get the current rotational velocity of vessel
- * @brief Get current rotational velocity
- * @param *currentRotVel Pointer to the v3 variable to store the result
+ * Read the newest pushed telemetry sample if it is fresh enough
+ * to act on. Frames already waiting on the socket are taken in
+ * first, without blocking.
+ * @brief Get latest telemetry
+ * @param *sample Pointer to the sample to write to
+ * @return false if there is no fresh sample and the state must be polled
  */
-void NavAP::getCurrentRotVel(v3 *currentRotVel)
+bool NavAP::latestTelemetry(TelemetrySample *sample)
 {
-  std::string operation = "GET_ANG_VEL";
-  std::string detail = "0";
-  serverConnect->transfer_data(operation, detail, currentRotVel);
+  if (!subscribed)
+    return false;
+  serverConnect->poll();
+  const TelemetryCache &cache = serverConnect->telemetry();
+  return cache.fresh(telemetryMaxAge) && cache.read(sample);
+}
+
+/**
+ * Fetch the vessel state once for a control tick, from the
+ * newest telemetry frame if it is fresh and otherwise with one
+ * request. The velocity is the displacement since the previous
+ * snapshot over the simulation time between the two, so it does
+ * not depend on how long the requests took.
+ * @brief Take the vessel state snapshot of a tick
+ * @param *state Snapshot to fill in
+ * @return false if the state could not be fetched, the snapshot is left as it was
+ */
+bool NavAP::fetchVesselState(VesselState *state)
+{
+  TelemetrySample sample;
+  if (!latestTelemetry(&sample) && serverConnect->get_vessel_state(&sample) != REQUEST_OK)
+    return false;
+  vessel.previousPosition = vessel.currentPosition;
+  vessel.previousTime = vessel.currentTime;
+  vessel.currentPosition = sample.position;
+  vessel.currentTime = sample.simTime;
+  double elapsed = vessel.currentTime - vessel.previousTime;
+  if (elapsed > 0) {
+    for (int i = 0; i < NUMDIM; i++)
+      vessel.velocity.data[i] = (vessel.currentPosition.data[i] - vessel.previousPosition.data[i]) / elapsed;
+  }
+  state->simTime = sample.simTime;
+  state->position = sample.position;
+  state->velocity = vessel.velocity;
+  state->angularVelocity = sample.angularVelocity;
+  state->pitch = sample.pitch;
+  state->bank = sample.bank;
+  state->yaw = sample.yaw;
+  state->airspeed = sample.airspeed;
+  return true;
 }
 
 /**
  * Set the bank speed using the angular velocity of the vessel to set the thrusters in a given direction
  * @brief Set the bank speed
+ * @param state Vessel state of this tick
  * @param value Bank velocity
  */
-void NavAP::setBankSpeed(double value)
+void NavAP::setBankSpeed(const VesselState &state, double value)
 {
-  v3 currentRotVel;
-  std::string operation = "GET_ANG_VEL";
-  std::string detail = "0";
-  serverConnect->transfer_data(operation, detail, &currentRotVel);
-  double deltaVel = value - currentRotVel.z;
+  double deltaVel = value - state.angularVelocity.z;
   // Reset the RCS thrusters to 0 so a bank maneouver
   // is only attempted in a single direction, then set
-  // the thrust in a gtiven direction based of the delta velocity
-  operation = "SET_BANK";
-  detail = std::to_string(deltaVel);
-  serverConnect->transfer_data(operation, detail, &valuesRCS[0]);
+  // the thrust in a gtiven direction based of the delta velocity.
+  // Sent with the rest of the tick by flushActuators
+  pendingActuators.bank = deltaVel;
+  pendingActuators.flags |= ACT_BANK;
   valuesDelta[0] = deltaVel;
 }
 
 /**
  * Set the pitch speed using the angular velocity of the vessel to set the thrusters in a given direction
  * @brief Set the pitch speed
+ * @param state Vessel state of this tick
  * @param value Pitch velocity
  */
-void NavAP::setPitchSpeed(double value)
+void NavAP::setPitchSpeed(const VesselState &state, double value)
 {
-  v3 currentRotVel;
-  std::string operation = "GET_ANG_VEL";
-  std::string detail = "0";
-  serverConnect->transfer_data(operation, detail, &currentRotVel);
-  double deltaVel = value - currentRotVel.x;
+  double deltaVel = value - state.angularVelocity.x;
   //std::cout << "\tdeltavel : " << deltaVel << std::endl;
   // Reset the RCS thrusters to 0 so a pitch maneouver
-  // is only attempted in a single direction
-  operation = "SET_PITCH";
-  detail = std::to_string(deltaVel);
-  serverConnect->transfer_data(operation, detail, &valuesRCS[1]);
+  // is only attempted in a single direction.
+  // Sent with the rest of the tick by flushActuators
+  pendingActuators.pitch = deltaVel;
+  pendingActuators.flags |= ACT_PITCH;
   valuesDelta[1] = deltaVel;
 }
 
 /**
  *  Set the yaw speed using the angular velocity of the vessel *to set the thrusters in a given direction
  * @brief Set the yaw speed
+ * @param state Vessel state of this tick
  * @param value Yaw velocity
  */
-void NavAP::setYawSpeed(double value)
+void NavAP::setYawSpeed(const VesselState &state, double value)
 {
-  v3 currentRotVel;
-  std::string operation = "GET_ANG_VEL";
-  std::string detail = "0";
-  serverConnect->transfer_data(operation, detail, &currentRotVel);
-  double deltaVel = value - (-currentRotVel.y);
+  double deltaVel = value - (-state.angularVelocity.y);
   //std::cout << "\tdeltavel : " << deltaVel << std::endl;
   // Reset the RCS thrusters to 0 so a yaw maneouver
-  // is only attempted in a single direction
-  operation = "SET_YAW";
-  detail = std::to_string(deltaVel);
-  serverConnect->transfer_data(operation, detail, &valuesRCS[2]);
+  // is only attempted in a single direction.
+  // Sent with the rest of the tick by flushActuators
+  pendingActuators.yaw = deltaVel;
+  pendingActuators.flags |= ACT_YAW;
   valuesDelta[2] = deltaVel;
 }
 
 /**
  * Set pitch of vessel relative to previous pitch
  * @brief Set pitch
+ * @param state Vessel state of this tick
  * @param pitch Pitch to set
  */
-void NavAP::setPitch(double pitch)
+void NavAP::setPitch(const VesselState &state, double pitch)
 {
   if (pitch > 1.5) pitch = 1.5;
   if (pitch < -1.5) pitch = -1.5;
-  double currentPitch;
-  operation = "GET_PITCH";
-  detail = "0";
-  //std::cout << "Sending operation " << operation << " : " << detail << std::endl;
-  serverConnect->transfer_data(operation, detail, &currentPitch);
+  double currentPitch = state.pitch;
   // std::cout << "Current pitch : " << currentPitch << std::endl;
   double deltaPitch = currentPitch - pitch;
   double pitchSpeed = deltaPitch * 0.1;
   if (pitchSpeed > 0.04) pitchSpeed = 0.04;
   if (pitchSpeed < -0.04) pitchSpeed = -0.04;
-  setPitchSpeed(-pitchSpeed);
-}
-
-/**
- * Get the current pitch of vessel
- * @brief Get current pitch
- * @return Current pitch of vessel
- */
-double NavAP::getPitch()
-{
-  double currentPitch;
-  operation = "GET_PITCH";
-  detail = "0";
-  //std::cout << "Sending operation " << operation << " : " << detail << std::endl;
-  serverConnect->transfer_data(operation, detail, &currentPitch);
-  return currentPitch;
+  setPitchSpeed(state, -pitchSpeed);
 }
 
 /**
  *  Set roll of vessel relative to previous bank
  * @brief Set roll
+ * @param state Vessel state of this tick
  * @param roll Roll to set
  */
-void NavAP::setRoll(double roll)
+void NavAP::setRoll(const VesselState &state, double roll)
 {
   roll = -roll;
-  double currentBank;
-  operation = "GET_BANK";
-  detail = "0";
-  //std::cout << "Sending operation " << operation << " : " << detail << std::endl;
-  serverConnect->transfer_data(operation, detail, &currentBank);
+  double currentBank = state.bank;
   // std::cout << "Current bank : " << currentBank << std::endl;
   double deltaBank = currentBank - roll;
   double bankSpeed = deltaBank * 0.1;
   if (bankSpeed > 0.04) bankSpeed = 0.04;
   if (bankSpeed < -0.04) bankSpeed = -0.04;
-  setBankSpeed(bankSpeed);
-}
-
-/**
- * Get the current bank of vessel
- * @brief Get current bank
- * @return Current bank of vessel
- */
-double NavAP::getBank()
-{
-  double currentBank;
-  operation = "GET_BANK";
-  detail = "0";
-  serverConnect->transfer_data(operation, detail, &currentBank);
-  return currentBank;
-}
-
-/**
- * Get the current yaw of vessel
- * @brief Get current yaw
- * @return Current yaw of vessel
- */
-double NavAP::getYaw()
-{
-  double currentYaw;
-  operation = "GET_YAW";
-  detail = "0";
-  serverConnect->transfer_data(operation, detail, &currentYaw);
-  return currentYaw;
+  setBankSpeed(state, bankSpeed);
 }
 
 /**
  * Set yaw of vessel relative to previous yaw
  * @brief Set yaw
+ * @param state Vessel state of this tick
  * @param yaw Yaw to set
  */
-void NavAP::setYaw(double yaw)
+void NavAP::setYaw(const VesselState &state, double yaw)
 {
   if (yaw > 1.5) yaw = 1.5;
   if (yaw < -1.5) yaw = -1.5;
-  double currentYaw;
-  operation = "GET_YAW";
-  detail = "0";
-  serverConnect->transfer_data(operation, detail, &currentYaw);
+  double currentYaw = state.yaw;
   //std::cout <<"Current yaw : " << currentYaw << std::endl;
   double deltaYaw = currentYaw - yaw;
   double yawSpeed = deltaYaw * 0.1;
   // std::cout << "yaw speed : " << yawSpeed << std::endl;
   if (yawSpeed > 0.04) yawSpeed = 0.04;
   if (yawSpeed < -0.04) yawSpeed = -0.04;
-  setYawSpeed(yawSpeed);
+  setYawSpeed(state, yawSpeed);
 }
 
 /**
  * Set the direction of the vessel
  * @brief Set direction 
+ * @param state Vessel state of this tick
  * @param *dir Pointer to direction vector to write to
  * @param normal Specify if normalized direction is required
  */
-void NavAP::setDir(v3 *dir, bool normal)
+void NavAP::setDir(const VesselState &state, v3 *dir, bool normal)
 {
-  v3 vesselPos;
-  operation = "GET_POS";
-  detail = "0";
-  serverConnect->transfer_data(operation, detail, &vesselPos);
+  v3 vesselPos = state.position;
   v3 targetPos = dest.currentPosition;
   // Find the heading to target destination
   v3 heading;
@@ -574,24 +718,18 @@ void NavAP::setDir(v3 *dir, bool normal)
 }
 
 /**
- * Get the current heading of vessel
+ * Get the current heading of vessel, the displacement since the
+ * previous snapshot
  * @brief Get current heading
+ * @param state Vessel state of this tick
  * @param *heading Pointer to heading vector to write to
  * @param normal Specify if normalized heading is required
  */
-void NavAP::getHeading(v3 *heading, bool normal)
+void NavAP::getHeading(const VesselState &state, v3 *heading, bool normal)
 {
-  // Store previous current position
-  vessel.previousPosition = vessel.currentPosition;
-  for (int i = 0; i < NUMDIM; i++) {
-    //std::cout << "tempPos[" << i << "] : " << vessel.previousPosition.data[i] << std::endl;
-  }
-  operation = "GET_POS";
-  detail = "0";
-  serverConnect->transfer_data(operation, detail, &vessel.currentPosition);
   // Find the current heading of vessel
   for(int i = 0; i < NUMDIM; i++) {
-    heading->data[i] = vessel.currentPosition.data[i] - vessel.previousPosition.data[i];
+    heading->data[i] = state.position.data[i] - vessel.previousPosition.data[i];
   }
   double distance = getDistance(*heading);
   //std::cout << "Distance : " << distance << std::endl;
@@ -621,34 +759,18 @@ double NavAP::getDistance(v3 heading)
 
 
 /**
- * Perform the setup for a new ray collision calculation
+ * Perform the setup for a new ray collision calculation. The ray
+ * covers a fixed time of travel, so it is as long as the distance
+ * the vessel will move.
  * @brief Setup a new ray
  * @param *ray Pointer to RayBox object
- * @param *currentPosition Pointer to position vector to write to
+ * @param state Vessel state of this tick
  */
-void NavAP::setupNewRay(RayBox *ray, v3 *currentPosition)
+void NavAP::setupNewRay(RayBox *ray, const VesselState &state)
 {
-  // Store the previous position to an old position
-  vessel.previousPosition.x = currentPosition->x;
-  vessel.previousPosition.y = currentPosition->y;
-  vessel.previousPosition.z = currentPosition->z;
-  // Get the latransfer_data position of the vessel
-  operation = "GET_POS";
-  detail = "0";
-  serverConnect->transfer_data(operation, detail, &vessel.currentPosition);
-
-  // Find direction vectors of new position
-  double newXDirection = vessel.currentPosition.x - vessel.previousPosition.x;
-  double newYDirection = vessel.currentPosition.y - vessel.previousPosition.y;
-  double newZDirection = vessel.currentPosition.z - vessel.previousPosition.z;
-
-  // Use new vectors to check collision again
-
-  // Set the properties of the collision ray
-  ray->vessel_ray.origin = vessel.currentPosition;
-  ray->vessel_ray.direction.x = newXDirection;
-  ray->vessel_ray.direction.y = newYDirection;
-  ray->vessel_ray.direction.z = newZDirection;
+  ray->vessel_ray.origin = state.position;
+  for (int i = 0; i < NUMDIM; i++)
+    ray->vessel_ray.direction.data[i] = state.velocity.data[i] * RAY_HORIZON_S;
 }
 
 /**
@@ -679,17 +801,18 @@ double NavAP::findAngleFromDot(double dot)
 /**
  * Get the relative heading between vessel and destination
  * @brief Get relative heading
+ * @param state Vessel state of this tick
  * @return Relative heading angle
  */
-double NavAP::getRelativeHeadingAngle()
+double NavAP::getRelativeHeadingAngle(const VesselState &state)
 {
   // Set the Normalised direction of the vessel
   v3 direction;
-  setDir(&direction, true);
+  setDir(state, &direction, true);
 
   // Get the current heading of the vessel
   v3 currentHeading;
-  getHeading(&currentHeading, true);
+  getHeading(state, &currentHeading, true);
 
   // Find the dot product using the normalised headings
   double dotHeading = dot(direction, currentHeading);
@@ -731,73 +854,264 @@ double NavAP::getComponentAngle(double adjacent, double hypotenuse)
  */
 void NavAP::stopThrust()
 {
-  operation = "STOP_THRUST";
-  detail = "0";
-  double thrust;
-  serverConnect->transfer_data(operation,detail, &thrust);
+  // Sent with the rest of the tick by flushActuators
+  pendingActuators.flags |= ACT_STOP_THRUST;
 }
 
 /**
- * Collision handler to handle possible incoming collisions
- * @brief Determine collisions
- * @param *collisionCheck Pointer to RayBox object
- * @param nearObjPos Position vector of nearby object
+ * Send the actuator commands recorded since the last flush as a
+ * single frame, so the client applies them together and the tick
+ * costs one round trip however many thrusters were touched
+ * @brief Send pending actuator commands
+ * @param lane LANE_CRITICAL for collision avoidance, see Lane
  */
-void NavAP::collisionHandler(RayBox *collisionCheck, v3 nearObjPos)
+void NavAP::flushActuators(int lane)
 {
-  // Create 3D vector for position of collision coordinate
-  v3 collisionCoord;
+  ActuatorFrame frame = pendingActuators;
+  pendingActuators = ActuatorFrame();
+  sendActuators(frame, lane);
+}
 
-  // Get the coordinates of the collision
-  collisionCheck->findCollisionCoord(collisionCheck->vessel_ray,
-                                     collisionCoord);
+/**
+ * @brief Send one frame of actuator commands and keep the RCS levels the client reports
+ * @param frame Commands to send, nothing is sent without flags
+ * @param lane Lane to send them in
+ */
+void NavAP::sendActuators(const ActuatorFrame &frame, int lane)
+{
+  if (frame.flags == 0)
+    return;
+  v3 rcs;
+  for (int i = 0; i < NUMDIM; i++)
+    rcs.data[i] = valuesRCS[i];
+  if (serverConnect->apply_actuators(frame, &rcs, lane) == REQUEST_OK) {
+    for (int i = 0; i < NUMDIM; i++)
+      valuesRCS[i] = rcs.data[i];
+  }
+}
 
-  // Create the direction vectors between the vessel and collision coord
-  v3 collisionDir;
-  collisionDir.x = collisionCoord.x - vessel.currentPosition.x;
-  collisionDir.y = collisionCoord.y - vessel.currentPosition.y;
-  collisionDir.z = collisionCoord.z - vessel.currentPosition.z;
+/**
+ * One step of the on-course cycle: pitch, yaw one way, stop the
+ * thrust and pitch, yaw the other way. The commands are left in
+ * pendingActuators.
+ * @brief Plan the minor adjustments of one tick
+ * @param state Vessel state to plan from
+ */
+void NavAP::adjustCourse(const VesselState &state)
+{
+  v3 currentRotVel = state.angularVelocity;
+  switch (adjustStep) {
+    case 0:
+      setPitchSpeed(state, currentRotVel.x);
+      break;
+    case 1:
+      setYawSpeed(state, -currentRotVel.y);
+      break;
+    case 2:
+      stopThrust();
+      setPitchSpeed(state, currentRotVel.x);
+      break;
+    case 3:
+      setYawSpeed(state, currentRotVel.y);
+      break;
+  }
+  adjustStep = (adjustStep + 1) % 4;
+}
+
+/**
+ * The I/O thread spends most of a tick waiting on the socket, so
+ * planning overlaps it even on a single core
+ * @brief Start the planning thread
+ * @return false if planning stays on the calling thread
+ */
+bool NavAP::startPlanner()
+{
+  if (!pipeline)
+    return false;
+  pendingActuators = ActuatorFrame();
+  planning.store(true, std::memory_order_release);
+  planner = std::thread(&NavAP::planLoop, this);
+  return true;
+}
 
-  std::cout << "Collision found at coordinate : {";
+/**
+ * Commands still queued are discarded, they were planned from a
+ * state that is no longer current
+ * @brief Stop and join the planning thread
+ */
+void NavAP::stopPlanner()
+{
+  if (!planner.joinable())
+    return;
+  planning.store(false, std::memory_order_release);
+  planner.join();
+  StateRecord record;
+  while (sensed.pop(&record))
+    ;
+  CommandRecord command;
+  while (planned.pop(&command))
+    ;
+}
+
+/**
+ * Runs on the planning thread. Plans from the newest sensed
+ * state, any older ones still queued are out of date and are
+ * skipped, and queues the commands back to the I/O thread.
+ * @brief Planning thread of the pipelined navigation loop
+ */
+void NavAP::planLoop()
+{
+  while (planning.load(std::memory_order_acquire)) {
+    if (!sensed.wait(PLAN_WAIT_MS))
+      continue;
+    StateRecord record;
+    unsigned long superseded = 0;
+    sensed.pop(&record);
+    StateRecord newer;
+    while (sensed.pop(&newer)) {
+      record = newer;
+      superseded++;
+    }
+    int64_t start = monotonic_us();
+    int lane = stepNavigation(record);
+    CommandRecord command;
+    command.tick = record.tick;
+    command.sensedUs = record.sensedUs;
+    command.superseded = superseded;
+    command.lane = lane;
+    command.phase = navPhase;
+    command.frame = pendingActuators;
+    pendingActuators = ActuatorFrame();
+    command.planUs = monotonic_us() - start;
+    if (!planned.push(command))
+      commandsDropped.fetch_add(1, std::memory_order_relaxed);
+  }
+}
+
+/**
+ * Print how well the control loop kept its rate and how its
+ * requests fared, about once a second
+ * @brief Report control loop timing
+ * @param ticks Scheduler pacing the loop
+ */
+void NavAP::reportTicks(const TickScheduler &ticks)
+{
+  unsigned long every = ticks.rate_hz() >= 1 ? (unsigned long)ticks.rate_hz() : 1;
+  if (ticks.ticks() == 0 || ticks.ticks() % every != 0)
+    return;
+  const LatencyStats &jitter = ticks.jitter();
+  std::cout << "Control loop: " << ticks.achieved_hz() << " of " << ticks.rate_hz() << " Hz, "
+            << ticks.overruns() << " overruns, " << ticks.skipped() << " ticks skipped, wake-up jitter p50 "
+            << jitter.percentile_us(0.5) << " us p99 " << jitter.percentile_us(0.99) << " us" << std::endl;
+  const char *phaseNames[NUM_PHASES] = { "sense", "decide", "act" };
+  for (int phase = 0; phase < NUM_PHASES; phase++) {
+    const LatencyStats &latency = ticks.phase_stats(phase);
+    std::cout << "  " << phaseNames[phase] << " p50 " << latency.percentile_us(0.5) << " us p99 "
+              << latency.percentile_us(0.99) << " us max " << latency.maxUs << " us" << std::endl;
+  }
+  // The decide phase is on the planning thread when it runs
+  if (planner.joinable()) {
+    std::cout << "  planning thread p50 " << planStats.percentile_us(0.5) << " us p99 "
+              << planStats.percentile_us(0.99) << " us, sensed to sent p50 " << senseToAct.percentile_us(0.5)
+              << " us p99 " << senseToAct.percentile_us(0.99) << " us, " << statesSuperseded
+              << " states superseded, " << statesDropped << " states and "
+              << commandsDropped.load(std::memory_order_relaxed) << " commands dropped" << std::endl;
+  }
+  // Once its buffers have grown the request path should not
+  // touch the heap, so anything but zero here is a regression
+  unsigned long allocations = serverConnect->io_stats().allocations;
+  std::cout << "Request path allocations per tick: " << (double)(allocations - reportedAllocations) / every
+            << std::endl;
+  reportedAllocations = allocations;
+  const char *laneNames[NUM_LANES] = { "bulk", "critical" };
+  for (int lane = 0; lane < NUM_LANES; lane++) {
+    const LatencyStats &latency = serverConnect->lane_stats(lane);
+    std::cout << "Command latency, " << laneNames[lane] << " lane: p50 " << latency.percentile_us(0.5)
+              << " us, p99 " << latency.percentile_us(0.99) << " us, max " << latency.maxUs
+              << " us over " << latency.completed << " requests, " << latency.timeouts
+              << " timed out" << std::endl;
+  }
+  // Whether slow replies are the network's fault or ours
+  const char *partNames[NUM_RTT_PARTS] = { "network", "queue", "process" };
+  for (int opcode = 0; opcode < NUM_OPCODES; opcode++) {
+    if (serverConnect->round_trip_stats(opcode, RTT_PROCESS).completed == 0)
+      continue;
+    std::cout << "Round trip of " << opcode_name(opcode) << ":";
+    for (int part = 0; part < NUM_RTT_PARTS; part++) {
+      const LatencyStats &latency = serverConnect->round_trip_stats(opcode, part);
+      std::cout << " " << partNames[part] << " p50 " << latency.percentile_us(0.5)
+                << " us p99 " << latency.percentile_us(0.99) << " us";
+    }
+    std::cout << std::endl;
+  }
+}
+
+/**
+ * Check every object of the scene against the path of the vessel.
+ * Vessels, the active one among them, are not threats. The ray
+ * boxes live on the stack, so a tick allocates nothing however
+ * many objects there are.
+ * @brief Find the nearest object the vessel is on course to hit
+ * @param state Vessel state of this tick
+ * @param objects Scene of this tick
+ * @param *threat Filled in with the nearest object on the path
+ * @return false if the path is clear
+ */
+bool NavAP::findThreat(const VesselState &state, const std::vector<SceneObject> &objects, Threat *threat)
+{
+  bool found = false;
+  for (size_t i = 0; i < objects.size(); i++) {
+    if (objects[i].isVessel == 1)
+      continue;
+    // Create a RayBox object to determine if a collision is likely.
+    // This will set up a bounding box around the near object so
+    // detections can be calculated.
+    RayBox collisionCheck(objects[i].position, objects[i].radius);
+    setupNewRay(&collisionCheck, state);
+    if (!collisionCheck.intersect(collisionCheck.vessel_ray))
+      continue;
+    v3 fromVessel;
+    for (int k = 0; k < NUMDIM; k++)
+      fromVessel.data[k] = objects[i].position.data[k] - state.position.data[k];
+    double distance = getDistance(fromVessel);
+    if (!found || distance < threat->distance) {
+      threat->centre = objects[i].position;
+      threat->radius = objects[i].radius;
+      threat->distance = distance;
+      found = true;
+    }
+  }
+  return found;
+}
+
+/**
+ * Turn away along the axis on which the vessel is furthest from
+ * the centre of the object, the nearest edge to escape past
+ * @brief First step of a collision escape
+ */
+void NavAP::startEscape()
+{
+  const VesselState &state = *planState;
+  std::cout << "Collision threat at : {";
   for(int i =0; i < NUMDIM; i++) {
-    std::cout << " " << collisionCoord.data[i] << " ";
+    std::cout << " " << threat.centre.data[i] << " ";
   }
   std::cout << "}" << std::endl;
 
   // Print current vessel position
   std::cout << "Current vessel position : {";
   for(int i =0; i < NUMDIM; i++) {
-    std::cout << " " << vessel.currentPosition.data[i] << " ";
+    std::cout << " " << state.position.data[i] << " ";
   }
   std::cout << "}" << std::endl;
-
-  // Find how far the collision is
-  v3 collisionVector;
-  for(int i = 0; i < NUMDIM; i++) {
-    collisionVector.data[i] = collisionCoord.data[i] - vessel.currentPosition.data[i];
-  }
-  double collisionDistance = getDistance(collisionVector);
-  std::cout  << "Distance to collision is : " << collisionDistance << std::endl;
-  
-  // Finding the coordinate for a point on the associated edge of
-  // a collision object based on the mean radius can be performed
-  // via rearranging the equation for finding the distance between
-  // two vector coordinates
-  // example:
-  // Ex = Cx - sqrt(pow(radius, 2.0)-pow(Cy-Ey, 2.0)-pow(Cz - Ez, 2.0))
-  // Where E = edge, C = centre and the x,y and z can be interchanged
-  // depending which axis we are investigating
-
-
-
+  std::cout  << "Distance to collision is : " << threat.distance << std::endl;
 
   // Need to determine how the adjustments are to be made
   // Work out which side of the centre of the object we are at
   // and which edge boundary we are closest to escape from
   v3 distFromCentre;
-  distFromCentre.x = nearObjPos.x - vessel.currentPosition.x;
-  distFromCentre.y = nearObjPos.y - vessel.currentPosition.y;
-  distFromCentre.z = nearObjPos.z - vessel.currentPosition.z;
+  for (int i = 0; i < NUMDIM; i++)
+    distFromCentre.data[i] = threat.centre.data[i] - state.position.data[i];
 
   int distIndex = 0;
   for (int index = 1; index < NUMDIM; index++)
@@ -808,133 +1122,45 @@ void NavAP::collisionHandler(RayBox *collisionCheck, v3 nearObjPos)
   }
 
   // Perform an adjustment to the direction of the vessel
+  completedRCSOperations = 0;
   switch (distIndex)
   {
     case 0:
       // Largest in the x axis, move along horizontal axis
       // Will require change in bank and roll
-      setPitch(0.08);
+      setPitch(state, 0.08);
       completedRCSOperations = 3;
       break;
     case 1:
       // Largest in the y axis, move along vertical axis
       // Requires change in pitch and maybe roll
-      setRoll(0.08);
+      setRoll(state, 0.08);
       completedRCSOperations = 5;
       break;
   }
-  // Check if the direction reduces the distance to collision
-  // point on the collision object
-  bool pathCollision = true;
-  while (pathCollision)
+}
+
+/**
+ * Only the first reversal of an escape turns the vessel, later
+ * calls do nothing
+ * @brief Turn the other way, the escape is closing in on the object
+ */
+void NavAP::reverseEscape()
+{
+  // Revert the thrusters to move in the opposite direction
+  switch(completedRCSOperations)
   {
-    // Create new ray collider object
-    RayBox *newRay = new RayBox(nearObjPos, objSize);
-
-    // Setup the ray properties for the collider
-    setupNewRay(newRay, &vessel.currentPosition);
-
-    // Store the 3D collision coordinate
-    v3 newCollide;
-    // Store the direction vectors
-    v3 newDirection;
-
-    // Distance to collision
-    double prevDistance;
-    double nextDistance;
-    bool ifNewCollide = newRay->intersect(newRay->vessel_ray);
-    // If an intersection takes place, determine the collision
-    // coordinates
-    if (ifNewCollide)
-    {
-      for(int i =0 ; i <NUMDIM; i++) {
-        std::cout << "Position "<< i << " : " << vessel.currentPosition.data[i] << std::endl;
-      }
-      // Get collision coordinate
-      newRay->findCollisionCoord(newRay->vessel_ray, newCollide);
-
-      // Generate new direction vectors of collision
-      newDirection.x = newCollide.x - newRay->vessel_ray.direction.x;
-      newDirection.y = newCollide.y - newRay->vessel_ray.direction.y;
-      newDirection.z = newCollide.z - newRay->vessel_ray.direction.z;
-
-      // Find the distance to the collision with the
-      // new direction vectors
-      nextDistance = getDistance(newDirection);
-    }
-    else
-    {
-      // The current path no longer results in a collision
-      pathCollision = false;
+    // Pitch was used to escape
+    case 3:
+      std::cout << "Gaining proximity to object, reversing direction" << std::endl;
+      setPitch(*planState, -0.08);
+      completedRCSOperations = 0;
+      break;
+    // Bank was used to escape
+    case 5:
+      std::cout << "Gaining proximity to object, reversing direction" << std::endl;
+      setRoll(*planState, -0.08);
+      completedRCSOperations = 0;
       break;
-    }
-
-
-    // If it does then continue on that path
-    // While a collision occurs, keep going in that direction
-    while(ifNewCollide) {
-      for(int i =0 ; i <NUMDIM; i++) {
-        std::cout << "Position "<< i << " : " << vessel.currentPosition.data[i] << std::endl;
-      }
-
-      setupNewRay(newRay, &vessel.currentPosition);
-
-      ifNewCollide = newRay->intersect(newRay->vessel_ray);
-
-      if (!ifNewCollide) {
-        std::cout << "collision avoided" << std::endl;
-        for(int i =0 ; i <NUMDIM; i++) {
-          std::cout << "Position "<< i << " : " << vessel.currentPosition.data[i] << std::endl;
-        }
-        break;
-      }
-
-      // Get new collision coordinate
-      newRay->findCollisionCoord(newRay->vessel_ray, newCollide);
-
-      // Generate the new direction vectors of collision
-      newDirection.x = newCollide.x - newRay->vessel_ray.direction.x;
-      newDirection.y = newCollide.y - newRay->vessel_ray.direction.y;
-      newDirection.z = newCollide.z - newRay->vessel_ray.direction.z;
-
-      // Store the old distance and get a new one
-      prevDistance = nextDistance;
-      std::cout << "Previous distance was" << prevDistance << std::endl;
-      nextDistance = getDistance(newDirection);
-      std::cout << "New distance is " << nextDistance << std::endl;
-
-      // Check if the new distance to the collision is less than the
-      // previous distance to collision
-      if(nextDistance < prevDistance) {
-        std::cout << "Gaining proximity to object, reversing direction" << std::endl;
-        // Revert the thrusters to move in the opposite direction
-        // Should keep note of which thrusters were changed previously
-        // and revert them here
-        switch(completedRCSOperations)
-        {
-          // Bank and Yaw operations have been performed
-          case 3:
-            // Perform the opposite operation to what has been
-            // done previously
-            //setBankSpeed((valuesDelta[0] * -1 ));
-            //setYawSpeed((valuesDelta[2] * -1));
-            std::cout << "Setting pitch to invert direction" << std::endl;
-            setPitch(-0.08);
-            completedRCSOperations = 0;
-            break;
-          case 5:
-            //setPitchSpeed((valuesDelta[1] * -1));
-            //setYawSpeed((valuesDelta[2] * -1));
-            setRoll(-0.08);
-            completedRCSOperations = 0;
-            break;
-          default:
-            std::cout << "RCS operations couldn't be determined"
-                      << std::endl;
-            break;
-        }
-      }
-      std::cout << "Keeping course" << std::endl;
-    }
   }
 }
@@ -0,0 +1,905 @@
+// ==============================================================
+//                  ORBITER MODULE: Rcontrol
+//
+// protocol.cpp
+//
+// Builds request frames for the Orbiter client and decodes the
+// replies straight into int/double/v3 values, binary ones
+// without any text parsing and JSON ones in a single pass.
+// ==============================================================
+
+#include "protocol.h"
+#include "wire.h"
+#include "rapidjson/reader.h"
+#include <limits.h>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+#define JSON_PARSE_STACK 256	// bytes for the parser stack, unused by in-place parsing
+
+typedef rapidjson::GenericReader<rapidjson::UTF8<>, rapidjson::UTF8<>,
+                                 rapidjson::MemoryPoolAllocator<> > JsonReader;
+
+// Names used by the JSON encoding, indexed by opcode
+static const char *opcodeNames[NUM_OPCODES] = {
+  "GET_POS", "GET_OBJ_COUNT", "GET_OBJ", "IS_VESSEL", "GET_SIZE",
+  "GET_AIRSPEED", "GET_ANG_VEL", "GET_BANK", "GET_YAW", "GET_PITCH",
+  "SET_PITCH", "SET_BANK", "SET_YAW", "SET_THRUST", "STOP_THRUST",
+  "GET_SCENE", "SUBSCRIBE", "TELEMETRY", "SET_ACTUATORS", "SYNC_CLOCK",
+  "GET_SCENE_NEAR", "GET_SCENE_DELTA", "GET_VESSEL_STATE"
+};
+
+/**
+ * Get the JSON name of an operation
+ * @brief Name of an opcode
+ * @param opcode Code from opcodes.h
+ * @return Operation name, or NULL for an unknown code
+ */
+const char *opcode_name(int opcode)
+{
+  if (opcode < 0 || opcode >= NUM_OPCODES)
+    return NULL;
+  return opcodeNames[opcode];
+}
+
+/**
+ * Setters and SUBSCRIBE carry a rate or thrust value, every other
+ * operation carries an object index, or for GET_SCENE_DELTA a
+ * frame number
+ * @brief Payload type of the request argument
+ * @param opcode Code from opcodes.h
+ * @return PAYLOAD_DOUBLE or PAYLOAD_INT
+ */
+int opcode_arg_type(int opcode)
+{
+  switch (opcode) {
+    case SET_PITCH:
+    case SET_BANK:
+    case SET_YAW:
+    case SET_THRUST:
+    case SUBSCRIBE:
+      return PAYLOAD_DOUBLE;
+    default:
+      return PAYLOAD_INT;
+  }
+}
+
+/**
+ * Positions, airspeed, angular velocity, the RCS levels
+ * acknowledging an actuator frame and the simulation times of a
+ * clock exchange come back as vectors, the whole vessel state
+ * as a telemetry payload, every other reply is a single number
+ * @brief Payload type of the reply
+ * @param opcode Code from opcodes.h
+ * @return PAYLOAD_V3, PAYLOAD_SCENE, PAYLOAD_SCENE_DELTA, PAYLOAD_TELEMETRY
+ * or PAYLOAD_DOUBLE
+ */
+int opcode_reply_type(int opcode)
+{
+  switch (opcode) {
+    case GET_POS:
+    case GET_AIRSPEED:
+    case GET_ANG_VEL:
+    case SET_ACTUATORS:
+    case SYNC_CLOCK:
+      return PAYLOAD_V3;
+    case GET_SCENE:
+    case GET_SCENE_NEAR:
+      return PAYLOAD_SCENE;
+    case GET_SCENE_DELTA:
+      return PAYLOAD_SCENE_DELTA;
+    case GET_VESSEL_STATE:
+      return PAYLOAD_TELEMETRY;
+    default:
+      return PAYLOAD_DOUBLE;
+  }
+}
+
+/**
+ * Encode a request into the supplied buffer
+ * @brief Encode a request
+ * @param format WIRE_BINARY or WIRE_JSON
+ * @param opcode Code from opcodes.h
+ * @param arg Object index or value, typed by opcode_arg_type
+ * @param seq Sequence number the client echoes in its reply
+ * @param buf Destination buffer
+ * @param len Size of the destination buffer
+ * @return Number of bytes to send, or -1 if the request does not fit
+ */
+int encode_request(int format, int opcode, double arg, uint32_t seq, char *buf, size_t len)
+{
+  const char *name = opcode_name(opcode);
+  if (name == NULL)
+    return -1;
+  int type = opcode_arg_type(opcode);
+
+  if (format == WIRE_JSON) {
+    // Keep the terminating null so old clients can treat the
+    // datagram as a C string
+    int n;
+    if (type == PAYLOAD_DOUBLE)
+      n = snprintf(buf, len, "{\"operation\":\"%s\",\"detail\":%f,\"seq\":%u}",
+                   name, arg, (unsigned)seq);
+    else
+      n = snprintf(buf, len, "{\"operation\":\"%s\",\"detail\":%d,\"seq\":%u}",
+                   name, (int)arg, (unsigned)seq);
+    if (n < 0 || (size_t)n >= len)
+      return -1;
+    return n + 1;
+  }
+
+  size_t payload = (type == PAYLOAD_DOUBLE) ? 8 : 4;
+  if (len < WIRE_HEADER_LEN + payload)
+    return -1;
+  put16(buf, WIRE_MAGIC);
+  buf[2] = (char)WIRE_VERSION;
+  buf[3] = (char)opcode;
+  buf[4] = (char)type;
+  buf[5] = 0;
+  put16(buf + 6, (uint16_t)payload);
+  put32(buf + 8, seq);
+  if (type == PAYLOAD_DOUBLE)
+    putDouble(buf + WIRE_HEADER_LEN, arg);
+  else
+    put32(buf + WIRE_HEADER_LEN, (uint32_t)(int32_t)arg);
+  return (int)(WIRE_HEADER_LEN + payload);
+}
+
+/**
+ * Encode a SET_ACTUATORS request. Only the binary encoding
+ * carries actuator frames
+ * @brief Encode an actuator frame
+ * @param frame Commands to apply
+ * @param seq Sequence number the client echoes in its reply
+ * @param buf Destination buffer
+ * @param len Size of the destination buffer
+ * @return Number of bytes to send, or -1 if the frame does not fit
+ */
+int encode_actuator_frame(const ActuatorFrame &frame, uint32_t seq, char *buf, size_t len)
+{
+  if (len < WIRE_HEADER_LEN + ACTUATOR_LEN)
+    return -1;
+  put16(buf, WIRE_MAGIC);
+  buf[2] = (char)WIRE_VERSION;
+  buf[3] = (char)SET_ACTUATORS;
+  buf[4] = (char)PAYLOAD_ACTUATORS;
+  buf[5] = 0;
+  put16(buf + 6, ACTUATOR_LEN);
+  put32(buf + 8, seq);
+  char *p = buf + WIRE_HEADER_LEN;
+  put32(p, frame.flags);
+  put32(p + 4, 0);
+  putDouble(p + 8, frame.bank);
+  putDouble(p + 16, frame.pitch);
+  putDouble(p + 24, frame.yaw);
+  putDouble(p + 32, frame.thrust);
+  return WIRE_HEADER_LEN + ACTUATOR_LEN;
+}
+
+/**
+ * Encode a GET_SCENE_NEAR request. Only the binary encoding
+ * carries scene queries
+ * @brief Encode a scene query
+ * @param query Region to return the objects of
+ * @param seq Sequence number the client echoes in its reply
+ * @param buf Destination buffer
+ * @param len Size of the destination buffer
+ * @return Number of bytes to send, or -1 if the query does not fit
+ */
+int encode_scene_query(const SceneQuery &query, uint32_t seq, char *buf, size_t len)
+{
+  if (len < WIRE_HEADER_LEN + SCENE_QUERY_LEN)
+    return -1;
+  put16(buf, WIRE_MAGIC);
+  buf[2] = (char)WIRE_VERSION;
+  buf[3] = (char)GET_SCENE_NEAR;
+  buf[4] = (char)PAYLOAD_SCENE_QUERY;
+  buf[5] = 0;
+  put16(buf + 6, SCENE_QUERY_LEN);
+  put32(buf + 8, seq);
+  char *p = buf + WIRE_HEADER_LEN;
+  put32(p, query.flags);
+  put32(p + 4, 0);
+  putDouble(p + 8, query.radius);
+  putDouble(p + 16, query.cone);
+  for (int i = 0; i < 3; i++)
+    putDouble(p + 24 + 8 * i, query.axis.data[i]);
+  return WIRE_HEADER_LEN + SCENE_QUERY_LEN;
+}
+
+/**
+ * Decode a GET_SCENE_NEAR request, the client side of
+ * encode_scene_query
+ * @brief Decode a scene query
+ * @param buf Received datagram
+ * @param len Length of the received datagram
+ * @param query Decoded region
+ * @return false if the datagram is not a scene query
+ */
+bool decode_scene_query(const char *buf, size_t len, SceneQuery *query)
+{
+  if (len < WIRE_HEADER_LEN + SCENE_QUERY_LEN)
+    return false;
+  if (get16(buf) != WIRE_MAGIC || (uint8_t)buf[2] != WIRE_VERSION)
+    return false;
+  if ((uint8_t)buf[3] != GET_SCENE_NEAR || (uint8_t)buf[4] != PAYLOAD_SCENE_QUERY)
+    return false;
+  if (get16(buf + 6) != SCENE_QUERY_LEN)
+    return false;
+
+  const char *p = buf + WIRE_HEADER_LEN;
+  query->flags = get32(p);
+  query->radius = getDouble(p + 8);
+  query->cone = getDouble(p + 16);
+  for (int i = 0; i < 3; i++)
+    query->axis.data[i] = getDouble(p + 24 + 8 * i);
+  return true;
+}
+
+/**
+ * @brief Bytes of a delta record of the given kind, -1 for an unknown kind
+ */
+static int delta_record_len(int kind)
+{
+  switch (kind) {
+    case DELTA_FULL:
+      return 4 + SCENE_RECORD_LEN;
+    case DELTA_SHORT:
+      return 4 + 3 * 2;
+    case DELTA_LONG:
+      return 4 + 3 * 4;
+    default:
+      return -1;
+  }
+}
+
+/**
+ * Encode the change of one object since the base frame, the
+ * client side of apply_scene_delta. The base object is moved to
+ * where the server will decode it, so that the next frame is
+ * encoded against what the server holds. An object whose id,
+ * kind or radius changed, or that moved too far for 32-bit steps,
+ * is sent whole.
+ * @brief Encode an object of a delta scene frame
+ * @param object Object as it is now
+ * @param index Index of the object in the scene
+ * @param keyframe Send the object whole whatever the base holds
+ * @param base Object as the server holds it, updated to the object as it will
+ * @param buf Destination buffer
+ * @param len Size of the destination buffer
+ * @return Bytes written, 0 if the object has not moved, or -1 if the record does not fit
+ */
+int encode_scene_delta_record(const SceneObject &object, int index, bool keyframe, SceneObject *base,
+                              char *buf, size_t len)
+{
+  int kind = DELTA_FULL;
+  long long steps[3];
+  if (!keyframe && base->id == object.id && base->isVessel == object.isVessel &&
+      base->radius == object.radius) {
+    long long largest = 0;
+    for (int i = 0; i < 3; i++) {
+      double step = (object.position.data[i] - base->position.data[i]) / SCENE_DELTA_QUANTUM;
+      // Also true of NaN, which only a whole record can carry
+      if (!(fabs(step) < INT_MAX)) {
+        largest = -1;
+        break;
+      }
+      steps[i] = llround(step);
+      if (llabs(steps[i]) > largest)
+        largest = llabs(steps[i]);
+    }
+    if (largest == 0)
+      return 0;
+    if (largest > 0)
+      kind = largest <= SHRT_MAX ? DELTA_SHORT : DELTA_LONG;
+  }
+  int recordLen = delta_record_len(kind);
+  if (len < (size_t)recordLen)
+    return -1;
+
+  put32(buf, ((uint32_t)index & DELTA_INDEX_MASK) | ((uint32_t)kind << DELTA_KIND_SHIFT));
+  char *p = buf + 4;
+  if (kind == DELTA_FULL) {
+    put32(p, (uint32_t)object.id);
+    put32(p + 4, object.isVessel ? SCENE_FLAG_VESSEL : 0);
+    for (int i = 0; i < 3; i++)
+      putDouble(p + 8 + 8 * i, object.position.data[i]);
+    putDouble(p + 32, object.radius);
+    *base = object;
+    return recordLen;
+  }
+  for (int i = 0; i < 3; i++) {
+    if (kind == DELTA_SHORT)
+      put16(p + 2 * i, (uint16_t)(int16_t)steps[i]);
+    else
+      put32(p + 4 * i, (uint32_t)(int32_t)steps[i]);
+    base->position.data[i] += steps[i] * SCENE_DELTA_QUANTUM;
+  }
+  return recordLen;
+}
+
+/**
+ * Check whether any part of an object lies inside a query
+ * region. Both ends apply the same test, the client to answer
+ * GET_SCENE_NEAR and the server to filter the scenes of clients
+ * that cannot. A cone with a zero axis is ignored, and an object
+ * the vessel is inside always matches.
+ * @brief Test an object against a scene query
+ * @param query Region to test against
+ * @param origin Position of the active vessel
+ * @param object Object to test
+ * @return true if the object belongs in the reply
+ */
+bool scene_query_match(const SceneQuery &query, const v3 &origin, const SceneObject &object)
+{
+  v3 offset;
+  for (int i = 0; i < 3; i++)
+    offset.data[i] = object.position.data[i] - origin.data[i];
+  double distance = sqrt(offset.x * offset.x + offset.y * offset.y + offset.z * offset.z);
+  if (distance <= object.radius)
+    return true;
+  if ((query.flags & QUERY_RADIUS) && distance - object.radius > query.radius)
+    return false;
+  if (query.flags & QUERY_CONE) {
+    const v3 &axis = query.axis;
+    double axisLength = sqrt(axis.x * axis.x + axis.y * axis.y + axis.z * axis.z);
+    if (axisLength > 0) {
+      double cosine = (offset.x * axis.x + offset.y * axis.y + offset.z * axis.z) / (distance * axisLength);
+      if (cosine > 1)
+        cosine = 1;
+      else if (cosine < -1)
+        cosine = -1;
+      // Widen the cone by the angle the object's sphere spans
+      if (acos(cosine) - asin(object.radius / distance) > query.cone)
+        return false;
+    }
+  }
+  return true;
+}
+
+/**
+ * @brief Describe a DecodeStatus for log messages
+ * @param status Value returned by one of the decoders
+ * @return Static description
+ */
+const char *decode_status_name(int status)
+{
+  switch (status) {
+    case DECODE_OK: return "ok";
+    case DECODE_SHORT: return "truncated";
+    case DECODE_BAD_HEADER: return "bad header";
+    case DECODE_BAD_TYPE: return "wrong type";
+    case DECODE_BAD_LENGTH: return "wrong length";
+    case DECODE_SYNTAX: return "syntax error";
+    case DECODE_MISSING_FIELD: return "missing or repeated field";
+    case DECODE_BAD_NUMBER: return "number out of range";
+    default: return "unknown error";
+  }
+}
+
+/**
+ * Casting a double that does not fit an int is undefined, and
+ * a peer can send NaN, an infinity or any magnitude
+ * @brief Convert a decoded number to an int if it fits
+ * @param d Number to convert, truncated towards zero
+ * @param value Converted number, zero if it does not fit
+ * @return Whether the number fits an int
+ */
+bool int_from_double(double d, int *value)
+{
+  // Also false for NaN
+  bool fits = d >= INT_MIN && d <= INT_MAX;
+  *value = fits ? (int)d : 0;
+  return fits;
+}
+
+/**
+ * Decode a binary reply frame. Scalars are widened so the
+ * caller can store them in whichever type it expects. With
+ * WIRE_FLAG_TIMESTAMP the payload is followed, inside the
+ * length in the header, by the simulation time of the value
+ * @brief Decode a binary reply
+ * @param buf Received datagram
+ * @param len Length of the received datagram
+ * @param reply Decoded reply
+ * @return DECODE_OK, or the DecodeStatus describing why the frame is malformed
+ */
+int decode_binary_reply(const char *buf, size_t len, WireReply *reply)
+{
+  if (len < WIRE_HEADER_LEN)
+    return DECODE_SHORT;
+  if (get16(buf) != WIRE_MAGIC || (uint8_t)buf[2] != WIRE_VERSION)
+    return DECODE_BAD_HEADER;
+  size_t payload = get16(buf + 6);
+  if (len < WIRE_HEADER_LEN + payload)
+    return DECODE_SHORT;
+
+  const char *p = buf + WIRE_HEADER_LEN;
+  reply->seq = get32(buf + 8);
+  reply->opcode = (uint8_t)buf[3];
+  reply->type = (uint8_t)buf[4];
+  reply->ivalue = 0;
+  for (int i = 0; i < 3; i++)
+    reply->vvalue.data[i] = 0;
+  reply->stamped = ((uint8_t)buf[5] & WIRE_FLAG_TIMESTAMP) != 0;
+  reply->simTime = 0;
+  if (reply->stamped) {
+    if (payload < 8)
+      return DECODE_BAD_LENGTH;
+    payload -= 8;
+    reply->simTime = getDouble(p + payload);
+  }
+
+  switch (reply->type) {
+    case PAYLOAD_NONE:
+      return payload == 0 ? DECODE_OK : DECODE_BAD_LENGTH;
+    case PAYLOAD_INT:
+      if (payload != 4)
+        return DECODE_BAD_LENGTH;
+      reply->ivalue = (int32_t)get32(p);
+      reply->vvalue.x = reply->ivalue;
+      return DECODE_OK;
+    case PAYLOAD_DOUBLE:
+      if (payload != 8)
+        return DECODE_BAD_LENGTH;
+      reply->vvalue.x = getDouble(p);
+      int_from_double(reply->vvalue.x, &reply->ivalue);
+      return DECODE_OK;
+    case PAYLOAD_V3:
+      if (payload != 24)
+        return DECODE_BAD_LENGTH;
+      for (int i = 0; i < 3; i++)
+        reply->vvalue.data[i] = getDouble(p + 8 * i);
+      return DECODE_OK;
+    default:
+      return DECODE_BAD_TYPE;
+  }
+}
+
+/**
+ * SAX handler for a packed JSON reply. Values are written
+ * straight into the WireReply as the reader reaches them, no
+ * DOM is built. The first problem found is kept in status and
+ * stops the reader.
+ * @brief Reader handler for decode_json_reply
+ */
+struct JsonReplyHandler : public rapidjson::BaseReaderHandler<rapidjson::UTF8<>, JsonReplyHandler> {
+  enum Field { FIELD_OTHER, FIELD_SEQ, FIELD_DATA, FIELD_TIME };
+
+  JsonReplyHandler(WireReply *r)
+    : reply(r), status(DECODE_OK), depth(0), field(FIELD_OTHER),
+      elements(0), haveSeq(false), haveData(false) {}
+
+  bool fail(int why)
+  {
+    status = why;
+    return false;
+  }
+
+  // Null, booleans and strings are only allowed under keys we ignore
+  bool Default()
+  {
+    return depth == 1 && field == FIELD_OTHER ? true : fail(DECODE_BAD_TYPE);
+  }
+
+  bool StartObject()
+  {
+    // Only the root may be an object
+    return depth++ == 0 ? true : fail(DECODE_BAD_TYPE);
+  }
+
+  bool EndObject(rapidjson::SizeType)
+  {
+    depth--;
+    return true;
+  }
+
+  bool Key(const char *str, rapidjson::SizeType len, bool)
+  {
+    field = FIELD_OTHER;
+    if (len == 3 && memcmp(str, "seq", 3) == 0) {
+      if (haveSeq)
+        return fail(DECODE_MISSING_FIELD);
+      field = FIELD_SEQ;
+    }
+    else if (len == 4 && memcmp(str, "data", 4) == 0) {
+      if (haveData)
+        return fail(DECODE_MISSING_FIELD);
+      field = FIELD_DATA;
+    }
+    else if (len == 1 && str[0] == 't') {
+      if (reply->stamped)
+        return fail(DECODE_MISSING_FIELD);
+      field = FIELD_TIME;
+    }
+    return true;
+  }
+
+  bool StartArray()
+  {
+    if (depth != 1 || field != FIELD_DATA)
+      return fail(DECODE_BAD_TYPE);
+    depth++;
+    elements = 0;
+    return true;
+  }
+
+  bool EndArray(rapidjson::SizeType count)
+  {
+    depth--;
+    if (count != 3)
+      return fail(DECODE_BAD_LENGTH);
+    reply->type = PAYLOAD_V3;
+    haveData = true;
+    return true;
+  }
+
+  bool Uint(unsigned u)
+  {
+    if (depth == 1 && field == FIELD_SEQ) {
+      reply->seq = u;
+      haveSeq = true;
+      return true;
+    }
+    return u <= INT_MAX ? integer((int)u) : number((double)u);
+  }
+
+  bool Int(int i) { return integer(i); }
+  bool Int64(int64_t i) { return number((double)i); }
+  bool Uint64(uint64_t u) { return number((double)u); }
+  bool Double(double d) { return number(d); }
+
+  // An integral scalar is kept exact as PAYLOAD_INT
+  bool integer(int i)
+  {
+    if (depth == 1 && field == FIELD_DATA) {
+      reply->type = PAYLOAD_INT;
+      reply->ivalue = i;
+      reply->vvalue.x = i;
+      haveData = true;
+      return true;
+    }
+    return number(i);
+  }
+
+  bool number(double d)
+  {
+    if (depth == 2) {
+      if (elements == 3)
+        return fail(DECODE_BAD_LENGTH);
+      reply->vvalue.data[elements++] = d;
+      return true;
+    }
+    if (depth != 1)
+      return fail(DECODE_BAD_TYPE);
+    switch (field) {
+      case FIELD_SEQ:
+        // Negative, fractional or wider than 32 bits
+        return fail(DECODE_BAD_NUMBER);
+      case FIELD_TIME:
+        reply->simTime = d;
+        reply->stamped = true;
+        return true;
+      case FIELD_DATA:
+        reply->type = PAYLOAD_DOUBLE;
+        reply->vvalue.x = d;
+        int_from_double(d, &reply->ivalue);
+        haveData = true;
+        return true;
+      default:
+        return true;
+    }
+  }
+
+  WireReply *reply;
+  int status;
+  int depth;	// 1 inside the root object, 2 inside the data array
+  Field field;	// key of the value being read
+  int elements;	// numbers read from the data array
+  bool haveSeq, haveData;
+};
+
+/**
+ * SAX handler accepting a single JSON number and nothing else
+ * @brief Reader handler for decode_json_number
+ */
+struct JsonNumberHandler : public rapidjson::BaseReaderHandler<rapidjson::UTF8<>, JsonNumberHandler> {
+  JsonNumberHandler(double *v) : value(v) {}
+  bool Default() { return false; }
+  bool Int(int i) { *value = i; return true; }
+  bool Uint(unsigned u) { *value = u; return true; }
+  bool Int64(int64_t i) { *value = (double)i; return true; }
+  bool Uint64(uint64_t u) { *value = (double)u; return true; }
+  bool Double(double d) { *value = d; return true; }
+  double *value;
+};
+
+/**
+ * @brief Map a reader error to a DecodeStatus
+ * @param reader Reader that failed
+ * @param handlerStatus Status left by the handler, if it stopped the reader
+ * @return DecodeStatus for the caller
+ */
+static int json_status(const JsonReader &reader, int handlerStatus)
+{
+  switch (reader.GetParseErrorCode()) {
+    case rapidjson::kParseErrorTermination:
+      return handlerStatus;
+    case rapidjson::kParseErrorNumberTooBig:
+      return DECODE_BAD_NUMBER;
+    case rapidjson::kParseErrorDocumentEmpty:
+      return DECODE_SHORT;
+    default:
+      return DECODE_SYNTAX;
+  }
+}
+
+/**
+ * Decode a packed JSON reply of the form
+ * {"seq":1,"data":[x,y,z]} or {"seq":1,"data":x}, with the
+ * simulation time of the value in "t" if the client stamps it.
+ * The buffer is read once, in place, by a SAX reader that
+ * checks every field as it goes, and must be null terminated.
+ * An integral data value is decoded as PAYLOAD_INT, any other
+ * number as PAYLOAD_DOUBLE. Other keys with scalar values are
+ * ignored.
+ * @brief Decode a packed JSON reply
+ * @param buf Received datagram
+ * @param len Length of the received datagram
+ * @param reply Decoded reply, the opcode is left unset
+ * @return DECODE_OK, or the DecodeStatus describing why the reply is malformed
+ */
+int decode_json_reply(char *buf, size_t len, WireReply *reply)
+{
+  (void)len;
+  reply->opcode = -1;
+  reply->ivalue = 0;
+  reply->stamped = false;
+  reply->simTime = 0;
+  for (int i = 0; i < 3; i++)
+    reply->vvalue.data[i] = 0;
+  // The parser stack lives on the stack, in-place parsing
+  // never pushes to it so the heap is not touched
+  char parseBuffer[JSON_PARSE_STACK];
+  rapidjson::MemoryPoolAllocator<> parseAllocator(parseBuffer, sizeof(parseBuffer));
+  JsonReader reader(&parseAllocator, sizeof(parseBuffer) / 2);
+  JsonReplyHandler handler(reply);
+  rapidjson::InsituStringStream stream(buf);
+  if (reader.Parse<rapidjson::kParseInsituFlag>(stream, handler).IsError())
+    return json_status(reader, handler.status);
+  if (handler.depth != 0 || !handler.haveSeq || !handler.haveData)
+    return handler.depth != 0 ? DECODE_BAD_TYPE : DECODE_MISSING_FIELD;
+  return DECODE_OK;
+}
+
+/**
+ * Decode the bare number sent as a legacy split reply. Unlike
+ * atof(), text that is not exactly one number is an error
+ * rather than a zero.
+ * @brief Decode a number sent as text
+ * @param buf Received datagram, null terminated, parsed in place
+ * @param len Length of the received datagram
+ * @param value Decoded number, untouched on error
+ * @return DECODE_OK, or the DecodeStatus describing why the text is not a number
+ */
+int decode_json_number(char *buf, size_t len, double *value)
+{
+  (void)len;
+  char parseBuffer[JSON_PARSE_STACK];
+  rapidjson::MemoryPoolAllocator<> parseAllocator(parseBuffer, sizeof(parseBuffer));
+  JsonReader reader(&parseAllocator, sizeof(parseBuffer) / 2);
+  double parsed = 0;
+  JsonNumberHandler handler(&parsed);
+  rapidjson::InsituStringStream stream(buf);
+  if (reader.Parse<rapidjson::kParseInsituFlag>(stream, handler).IsError())
+    return json_status(reader, DECODE_BAD_TYPE);
+  *value = parsed;
+  return DECODE_OK;
+}
+
+/**
+ * Decode the header of a GET_SCENE or GET_SCENE_NEAR fragment and check that
+ * the records it announces are all present in the datagram
+ * @brief Decode a scene fragment
+ * @param buf Received datagram
+ * @param len Length of the received datagram
+ * @param frag Decoded fragment header
+ * @return false if the fragment is malformed
+ */
+bool decode_scene_fragment(const char *buf, size_t len, SceneFragment *frag)
+{
+  if (len < WIRE_HEADER_LEN + SCENE_FRAG_HEADER_LEN)
+    return false;
+  if (get16(buf) != WIRE_MAGIC || (uint8_t)buf[2] != WIRE_VERSION)
+    return false;
+  uint8_t opcode = (uint8_t)buf[3];
+  if ((opcode != GET_SCENE && opcode != GET_SCENE_NEAR) || (uint8_t)buf[4] != PAYLOAD_SCENE)
+    return false;
+  size_t payload = get16(buf + 6);
+  if (len < WIRE_HEADER_LEN + payload || payload < SCENE_FRAG_HEADER_LEN)
+    return false;
+
+  const char *p = buf + WIRE_HEADER_LEN;
+  frag->seq = get32(buf + 8);
+  frag->index = get16(p);
+  frag->count = get16(p + 2);
+  frag->total = (int)get32(p + 4);
+  frag->first = (int)get32(p + 8);
+  frag->objects = get16(p + 12);
+  frag->records = p + SCENE_FRAG_HEADER_LEN;
+
+  if (frag->index >= frag->count || frag->total < 0 || frag->first < 0)
+    return false;
+  // Both come straight off the wire, so the sums are taken wide
+  // enough not to overflow. No scene holds more objects than its
+  // fragments can carry
+  if ((int64_t)frag->total > (int64_t)frag->count * SCENE_FRAG_MAX_OBJECTS)
+    return false;
+  if ((int64_t)frag->first + frag->objects > frag->total)
+    return false;
+  return payload >= SCENE_FRAG_HEADER_LEN + (size_t)frag->objects * SCENE_RECORD_LEN;
+}
+
+/**
+ * Decode one object record of a scene fragment
+ * @brief Decode a scene object
+ * @param record Start of the record
+ * @param object Destination in the scene array
+ */
+void decode_scene_object(const char *record, SceneObject *object)
+{
+  object->id = (int32_t)get32(record);
+  object->isVessel = (get32(record + 4) & SCENE_FLAG_VESSEL) ? 1 : 0;
+  for (int i = 0; i < 3; i++)
+    object->position.data[i] = getDouble(record + 8 + 8 * i);
+  object->radius = getDouble(record + 32);
+}
+
+/**
+ * Decode the header of a GET_SCENE_DELTA fragment. The records
+ * are checked as they are applied
+ * @brief Decode a delta scene fragment
+ * @param buf Received datagram
+ * @param len Length of the received datagram
+ * @param frag Decoded fragment header
+ * @return false if the fragment is malformed
+ */
+bool decode_scene_delta(const char *buf, size_t len, SceneDeltaFragment *frag)
+{
+  if (len < WIRE_HEADER_LEN + SCENE_DELTA_HEADER_LEN)
+    return false;
+  if (get16(buf) != WIRE_MAGIC || (uint8_t)buf[2] != WIRE_VERSION)
+    return false;
+  if ((uint8_t)buf[3] != GET_SCENE_DELTA || (uint8_t)buf[4] != PAYLOAD_SCENE_DELTA)
+    return false;
+  size_t payload = get16(buf + 6);
+  if (len < WIRE_HEADER_LEN + payload || payload < SCENE_DELTA_HEADER_LEN)
+    return false;
+
+  const char *p = buf + WIRE_HEADER_LEN;
+  frag->seq = get32(buf + 8);
+  frag->index = get16(p);
+  frag->count = get16(p + 2);
+  frag->total = (int)get32(p + 4);
+  frag->frame = get32(p + 8);
+  frag->base = get32(p + 12);
+  frag->records = get16(p + 16);
+  frag->data = p + SCENE_DELTA_HEADER_LEN;
+  frag->length = payload - SCENE_DELTA_HEADER_LEN;
+  if (frag->index >= frag->count || frag->total < 0 || frag->frame == 0)
+    return false;
+  // A keyframe carries every object whole, so its fragments bound
+  // the total. A delta leaves objects out and is only held to the
+  // scene it applies to
+  return frag->base != 0 || (int64_t)frag->total <= (int64_t)frag->count * SCENE_DELTA_FRAG_MAX_OBJECTS;
+}
+
+/**
+ * Apply the records of a delta scene fragment to the scene
+ * array, which must hold the base frame, or be sized for a
+ * keyframe. A malformed record stops the decoding, the records
+ * before it are already applied.
+ * @brief Apply a delta scene fragment
+ * @param frag Fragment decoded by decode_scene_delta
+ * @param objects Scene array
+ * @param count Objects in the scene array
+ * @return false if a record is malformed or out of range
+ */
+bool apply_scene_delta(const SceneDeltaFragment &frag, SceneObject *objects, int count)
+{
+  const char *p = frag.data;
+  const char *end = frag.data + frag.length;
+  for (int r = 0; r < frag.records; r++) {
+    if (end - p < 4)
+      return false;
+    uint32_t word = get32(p);
+    int kind = (int)(word >> DELTA_KIND_SHIFT);
+    int index = (int)(word & DELTA_INDEX_MASK);
+    int recordLen = delta_record_len(kind);
+    if (recordLen < 0 || end - p < recordLen || index >= count)
+      return false;
+    SceneObject &object = objects[index];
+    if (kind == DELTA_FULL)
+      decode_scene_object(p + 4, &object);
+    else {
+      for (int i = 0; i < 3; i++) {
+        long long steps = kind == DELTA_SHORT ? (int16_t)get16(p + 4 + 2 * i) : (int32_t)get32(p + 4 + 4 * i);
+        object.position.data[i] += steps * SCENE_DELTA_QUANTUM;
+      }
+    }
+    p += recordLen;
+  }
+  return p == end;
+}
+
+/**
+ * Telemetry frames and GET_VESSEL_STATE replies share the
+ * payload, which holds, as doubles, the simulation time,
+ * position, angular velocity, pitch, bank, yaw and airspeed
+ * @brief Check a vessel state frame and decode its payload
+ * @param buf Received datagram
+ * @param len Length of the received datagram
+ * @param opcode TELEMETRY or GET_VESSEL_STATE
+ * @param sample Decoded sample, frame and receivedUs are left unset
+ * @return false if the datagram is not a vessel state frame of the opcode
+ */
+static bool decode_state_payload(const char *buf, size_t len, int opcode, TelemetrySample *sample)
+{
+  if (len < WIRE_HEADER_LEN + TELEMETRY_LEN)
+    return false;
+  if (get16(buf) != WIRE_MAGIC || (uint8_t)buf[2] != WIRE_VERSION)
+    return false;
+  if ((uint8_t)buf[3] != opcode || (uint8_t)buf[4] != PAYLOAD_TELEMETRY)
+    return false;
+  if (get16(buf + 6) != TELEMETRY_LEN)
+    return false;
+
+  const char *p = buf + WIRE_HEADER_LEN;
+  sample->simTime = getDouble(p);
+  for (int i = 0; i < 3; i++) {
+    sample->position.data[i] = getDouble(p + 8 + 8 * i);
+    sample->angularVelocity.data[i] = getDouble(p + 32 + 8 * i);
+    sample->airspeed.data[i] = getDouble(p + 80 + 8 * i);
+  }
+  sample->pitch = getDouble(p + 56);
+  sample->bank = getDouble(p + 64);
+  sample->yaw = getDouble(p + 72);
+  return true;
+}
+
+/**
+ * Decode a TELEMETRY frame pushed by the client. The header
+ * sequence number is the frame counter of the stream.
+ * @brief Decode a telemetry frame
+ * @param buf Received datagram
+ * @param len Length of the received datagram
+ * @param sample Decoded sample, receivedUs is left unset
+ * @return false if the datagram is not a telemetry frame
+ */
+bool decode_telemetry_frame(const char *buf, size_t len, TelemetrySample *sample)
+{
+  if (!decode_state_payload(buf, len, TELEMETRY, sample))
+    return false;
+  sample->frame = get32(buf + 8);
+  return true;
+}
+
+/**
+ * Decode the reply to a GET_VESSEL_STATE request, the whole
+ * state of the vessel taken at one simulation time. The header
+ * sequence number is the request's.
+ * @brief Decode a vessel state reply
+ * @param buf Received datagram
+ * @param len Length of the received datagram
+ * @param seq Sequence number of the reply
+ * @param state Decoded state, frame and receivedUs are left unset
+ * @return false if the datagram is not a vessel state reply
+ */
+bool decode_vessel_state(const char *buf, size_t len, uint32_t *seq, TelemetrySample *state)
+{
+  if (!decode_state_payload(buf, len, GET_VESSEL_STATE, state))
+    return false;
+  *seq = get32(buf + 8);
+  return true;
+}
@@ -0,0 +1,134 @@
+// ==============================================================
+//                  ORBITER MODULE: Rcontrol
+//
+// scheduler.cpp
+//
+// Fixed-rate control loop scheduler.
+// ==============================================================
+
+#include "scheduler.h"
+#include <time.h>
+
+/**
+ * @brief Constructor for a scheduler that has not started
+ * @param rate_hz Ticks per second, at most one per microsecond
+ */
+TickScheduler::TickScheduler(double rate_hz)
+  : periodUs(rate_hz > 0 && rate_hz < 1e6 ? (int64_t)(1e6 / rate_hz) : 1),
+    startUs(0), deadlineUs(0), phaseUs(0), phase(-1),
+    tickCount(0), overrunCount(0), skippedCount(0)
+{
+  memset(&lateness, 0, sizeof(lateness));
+  memset(phases, 0, sizeof(phases));
+}
+
+/**
+ * The first tick is due straight away
+ * @brief Start counting deadlines from now
+ */
+void TickScheduler::start()
+{
+  startUs = deadlineUs = monotonic_us();
+  tickCount = overrunCount = skippedCount = 0;
+}
+
+/**
+ * Called at the end of a tick. Sleeps until the next deadline
+ * and records how late the wake-up was. If the deadline has
+ * already passed, the tick overran and every deadline it
+ * covered is skipped.
+ * @brief Wait for the start of the next tick
+ */
+void TickScheduler::wait_next()
+{
+  if (advance())
+    sleep_until(deadlineUs);
+  woke();
+}
+
+/**
+ * The part of wait_next() that does not sleep, for a loop that
+ * paces several schedulers itself. It checks due() and calls
+ * woke() when it starts the tick.
+ * @brief End a tick and work out the deadline of the next
+ * @return false if the tick overran, the next one is due now
+ */
+bool TickScheduler::advance()
+{
+  end();
+  tickCount++;
+  deadlineUs += periodUs;
+  int64_t now = monotonic_us();
+  if (now >= deadlineUs) {
+    overrunCount++;
+    int64_t missed = (now - deadlineUs) / periodUs;
+    skippedCount += missed;
+    deadlineUs += missed * periodUs;
+    return false;
+  }
+  return true;
+}
+
+/**
+ * @brief Record how late the tick being started is
+ */
+void TickScheduler::woke()
+{
+  lateness.record(monotonic_us() - deadlineUs);
+}
+
+/**
+ * @brief Sleep until an instant of the steady clock
+ * @param deadline Steady clock, microseconds
+ */
+void TickScheduler::sleep_until(int64_t deadline)
+{
+#ifdef _WIN32
+  int64_t remaining = deadline - monotonic_us();
+  if (remaining > 0)
+    Sleep((DWORD)((remaining + 999) / 1000));
+#else
+  // monotonic_us() reads CLOCK_MONOTONIC, sleeping to an
+  // absolute time of that clock leaves no gap for drift
+  struct timespec until;
+  until.tv_sec = deadline / 1000000;
+  until.tv_nsec = (deadline % 1000000) * 1000;
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &until, NULL) == EINTR)
+    ;
+#endif
+}
+
+/**
+ * Ends the phase being timed, if any
+ * @brief Start timing a phase of the tick
+ * @param next TickPhase starting now
+ */
+void TickScheduler::begin(int next)
+{
+  end();
+  phase = next;
+  phaseUs = monotonic_us();
+}
+
+/**
+ * @brief Stop timing the current phase
+ */
+void TickScheduler::end()
+{
+  if (phase < 0)
+    return;
+  phases[phase].record(monotonic_us() - phaseUs);
+  phase = -1;
+}
+
+/**
+ * @brief Ticks completed per second since start()
+ * @return Ticks per second, zero before the first tick
+ */
+double TickScheduler::achieved_hz() const
+{
+  int64_t elapsed = monotonic_us() - startUs;
+  if (tickCount == 0 || elapsed <= 0)
+    return 0;
+  return tickCount * 1e6 / elapsed;
+}
@@ -0,0 +1,237 @@
+// ==============================================================
+//                  ORBITER MODULE: Rcontrol
+//
+// session.cpp
+//
+// Serves several Orbiter clients from one process, one session
+// per client address.
+// ==============================================================
+
+#include "session.h"
+#include <iostream>
+#include <cerrno>
+
+/**
+ * Bind the socket every new client pings first. It shares PORT
+ * with the sessions, which the kernel prefers for datagrams from
+ * their own client because they are connected to it.
+ * @brief Constructor, binds the listening socket
+ * @param debug Debug level passed on to the sessions
+ * @param options Server options passed on to the sessions
+ */
+SessionTable::SessionTable(int debug, const ServerOptions &options)
+  : listenfd(-1), debug(debug), options(options)
+{
+#ifndef _WIN32
+  listenfd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+  if (listenfd < 0) {
+    perror("ERROR: Could not create SOCKET connection");
+    exit(EXIT_FAILURE);
+  }
+  int on = 1;
+  setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+  struct sockaddr_in local;
+  memset(&local, 0, sizeof(local));
+  local.sin_family = AF_INET;
+  local.sin_port = htons(PORT);
+  local.sin_addr.s_addr = htonl(INADDR_ANY);
+  if (bind(listenfd, (struct sockaddr *)&local, sizeof(local)) < 0) {
+    perror("ERROR: Could not bind");
+    exit(EXIT_FAILURE);
+  }
+#endif
+}
+
+/**
+ * @brief Destructor, closes every session and the listening socket
+ */
+SessionTable::~SessionTable()
+{
+  for (size_t i = 0; i < sessions.size(); i++)
+    delete sessions[i].server;
+#ifndef _WIN32
+  if (listenfd >= 0)
+    ::close(listenfd);
+#endif
+}
+
+/**
+ * Wait for a ping from a client that has no session yet, answer
+ * it and open a session for that client. Pings from clients
+ * already served, or beyond options.clients, are ignored.
+ * @brief Accept the next client
+ * @return Session for the new client, NULL where sessions are unsupported
+ */
+UDPserver *SessionTable::accept()
+{
+#ifdef _WIN32
+  std::cerr << "ERROR: client sessions need POSIX sockets" << std::endl;
+  return NULL;
+#else
+  ClientPing ping;
+  for (;;) {
+    if (!next_ping(&ping))
+      continue;
+    std::lock_guard<std::mutex> guard(lock);
+    // A retransmitted ping from a client whose session was
+    // opened in the meantime
+    if (find(ping.from) >= 0)
+      continue;
+    if ((int)sessions.size() >= options.clients) {
+      std::cerr << "WARNING: " << sessions.size() << " clients already served, ignoring "
+                << inet_ntoa(ping.from.sin_addr) << ":" << ntohs(ping.from.sin_port) << std::endl;
+      continue;
+    }
+    int fd = connect_socket(ping.from);
+    if (fd < 0) {
+      perror("ERROR: Could not open session socket");
+      continue;
+    }
+    std::cout << "Received " << ping.data << " from " << inet_ntoa(ping.from.sin_addr) << ":"
+              << ntohs(ping.from.sin_port) << ", now returning ping..." << std::endl;
+    if (send(fd, ping.data, ping.len, 0) < 0) {
+      perror("ERROR writing to client");
+      ::close(fd);
+      continue;
+    }
+    Session session;
+    session.addr = ping.from;
+    session.server = new UDPserver(fd, ping.from, debug, options);
+    sessions.push_back(session);
+    return session.server;
+  }
+#endif
+}
+
+/**
+ * A client opens its session with the text "ping", a trailing
+ * null included or not
+ * @brief Check that a datagram from an unknown client is a ping
+ * @param ping Datagram, null terminated
+ * @return false for anything else, which gets no session
+ */
+bool is_ping(const ClientPing &ping)
+{
+  return (ping.len == 4 || (ping.len == 5 && ping.data[4] == 0)) && memcmp(ping.data, "ping", 4) == 0;
+}
+
+/**
+ * Close a session and forget its client, whose next ping opens
+ * a new one
+ * @brief Close a session returned by accept()
+ * @param session Session whose client is done
+ */
+void SessionTable::close(UDPserver *session)
+{
+  std::lock_guard<std::mutex> guard(lock);
+  for (size_t i = 0; i < sessions.size(); i++) {
+    if (sessions[i].server == session) {
+      delete session;
+      sessions.erase(sessions.begin() + i);
+      return;
+    }
+  }
+}
+
+/**
+ * @brief Number of clients being served
+ */
+size_t SessionTable::size()
+{
+  std::lock_guard<std::mutex> guard(lock);
+  return sessions.size();
+}
+
+/**
+ * @brief Look up the session of a client, the lock must be held
+ * @param addr Client address
+ * @return Index into sessions, -1 if the client has none
+ */
+int SessionTable::find(const struct sockaddr_in &addr)
+{
+  for (size_t i = 0; i < sessions.size(); i++) {
+    if (sessions[i].addr.sin_addr.s_addr == addr.sin_addr.s_addr &&
+        sessions[i].addr.sin_port == addr.sin_port)
+      return (int)i;
+  }
+  return -1;
+}
+
+/**
+ * @brief Take the next ping, a stray one first, otherwise block on the listening socket
+ * @param ping Received ping, null terminated
+ * @return false if nothing could be read
+ */
+bool SessionTable::next_ping(ClientPing *ping)
+{
+#ifdef _WIN32
+  (void)ping;
+  return false;
+#else
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    if (!strays.empty()) {
+      *ping = strays.front();
+      strays.pop_front();
+      return true;
+    }
+  }
+  socklen_t len = sizeof(ping->from);
+  int n = recvfrom(listenfd, ping->data, BUFLEN - 1, 0, (struct sockaddr *)&ping->from, &len);
+  if (n < 0) {
+    if (errno != EINTR)
+      perror("ERROR reading from client");
+    return false;
+  }
+  ping->data[n] = 0;
+  ping->len = n;
+  return true;
+#endif
+}
+
+/**
+ * Open a socket on PORT connected to one client. Until connect()
+ * it is as good a match as the listening socket for any client,
+ * so pings that land on it in that window are kept as strays for
+ * the next accept().
+ * @brief Open the socket of a new session, the lock must be held
+ * @param client Address of the client
+ * @return Socket descriptor, -1 on failure
+ */
+int SessionTable::connect_socket(const struct sockaddr_in &client)
+{
+#ifdef _WIN32
+  (void)client;
+  return -1;
+#else
+  int fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+  if (fd < 0)
+    return -1;
+  int on = 1;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+  struct sockaddr_in local;
+  memset(&local, 0, sizeof(local));
+  local.sin_family = AF_INET;
+  local.sin_port = htons(PORT);
+  local.sin_addr.s_addr = htonl(INADDR_ANY);
+  if (bind(fd, (struct sockaddr *)&local, sizeof(local)) < 0 ||
+      connect(fd, (const struct sockaddr *)&client, sizeof(client)) < 0) {
+    int saved = errno;
+    ::close(fd);
+    errno = saved;
+    return -1;
+  }
+  ClientPing ping;
+  socklen_t len = sizeof(ping.from);
+  int n;
+  while ((n = recvfrom(fd, ping.data, BUFLEN - 1, MSG_DONTWAIT, (struct sockaddr *)&ping.from, &len)) >= 0) {
+    len = sizeof(ping.from);
+    if (ping.from.sin_addr.s_addr == client.sin_addr.s_addr && ping.from.sin_port == client.sin_port)
+      continue;
+    ping.data[n] = 0;
+    ping.len = n;
+    strays.push_back(ping);
+  }
+  return fd;
+#endif
+}
@@ -0,0 +1,398 @@
+// ==============================================================
+//                  ORBITER MODULE: Rcontrol
+//
+// shard.cpp
+//
+// SO_REUSEPORT worker pool, one socket and one pinned thread
+// per worker.
+// ==============================================================
+
+#include "shard.h"
+#include <iostream>
+#include <cerrno>
+#ifndef _WIN32
+# include <pthread.h>
+# include <sched.h>
+#endif
+
+/**
+ * @brief Constructor for a share without a socket
+ */
+SocketShare::SocketShare()
+  : fd(-1), epfd(-1), draining(false)
+{
+  memset(&stats, 0, sizeof(stats));
+}
+
+/**
+ * @brief Destructor, deletes the sessions before closing the socket they use
+ */
+SocketShare::~SocketShare()
+{
+  for (size_t i = 0; i < sessions.size(); i++)
+    delete sessions[i];
+#ifndef _WIN32
+  if (epfd >= 0)
+    close(epfd);
+  if (fd >= 0)
+    close(fd);
+#endif
+}
+
+/**
+ * Bind a socket to PORT alongside the other workers' sockets.
+ * All of them must be bound before the first client pings, the
+ * kernel hashes clients over the sockets bound at the time.
+ * @brief Open this worker's socket
+ * @param rxTimestamps Have the kernel stamp the datagrams it receives
+ * @return false on failure, errno is set
+ */
+bool SocketShare::open(bool rxTimestamps)
+{
+#ifdef _WIN32
+  (void)rxTimestamps;
+  return false;
+#else
+  fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+  if (fd < 0)
+    return false;
+  int on = 1;
+  struct sockaddr_in local;
+  memset(&local, 0, sizeof(local));
+  local.sin_family = AF_INET;
+  local.sin_port = htons(PORT);
+  local.sin_addr.s_addr = htonl(INADDR_ANY);
+  if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0 ||
+      bind(fd, (struct sockaddr *)&local, sizeof(local)) < 0 ||
+      fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK) < 0)
+    return false;
+  epfd = epoll_create1(0);
+  if (epfd < 0)
+    return false;
+  struct epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;
+  ev.data.fd = fd;
+  if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+    return false;
+  // Best effort, sessions without stamps count the socket wait as network time
+  if (rxTimestamps && !enable_rx_timestamps(fd))
+    perror("WARNING: Could not enable receive timestamps");
+  for (int i = 0; i < BATCH_SIZE; i++) {
+    memset(&inMsgs[i], 0, sizeof(inMsgs[i]));
+    inIov[i].iov_base = inBufs[i];
+    inIov[i].iov_len = BUFLEN - 1;
+    inMsgs[i].msg_hdr.msg_iov = &inIov[i];
+    inMsgs[i].msg_hdr.msg_iovlen = 1;
+    inMsgs[i].msg_hdr.msg_name = &inAddrs[i];
+    attach_rx_control(&inMsgs[i].msg_hdr, inControl[i]);
+  }
+  return true;
+#endif
+}
+
+/**
+ * @brief Block until the socket is readable or the timeout passes
+ * @param timeout_ms Longest wait in milliseconds, negative to wait forever
+ * @return true if datagrams are waiting
+ */
+bool SocketShare::wait(int timeout_ms)
+{
+#ifdef _WIN32
+  (void)timeout_ms;
+  return false;
+#else
+  struct epoll_event ev;
+  int n = epoll_wait(epfd, &ev, 1, timeout_ms);
+  if (n < 0 && errno != EINTR) {
+    perror("ERROR waiting on socket");
+    stats.errors++;
+  }
+  return n > 0;
+#endif
+}
+
+/**
+ * Read every waiting datagram with recvmmsg and dispatch each to
+ * the session of its sender. Datagrams from other addresses are
+ * kept as pings of new clients.
+ * @brief Read the socket and route what was read
+ * @param stats Counters of whoever asked for the read
+ */
+void SocketShare::drain(IOStats *stats)
+{
+#ifndef _WIN32
+  // A handler that polls would overwrite the ring being walked,
+  // the outer loop reads whatever is left
+  if (draining)
+    return;
+  draining = true;
+  int n;
+  do {
+    for (int i = 0; i < BATCH_SIZE; i++) {
+      inMsgs[i].msg_hdr.msg_namelen = sizeof(inAddrs[i]);
+      inMsgs[i].msg_hdr.msg_controllen = RX_CONTROL_LEN;
+    }
+    n = recvmmsg(fd, inMsgs, BATCH_SIZE, 0, NULL);
+    stats->recvCalls++;
+    if (n < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        perror("ERROR reading from socket");
+        stats->errors++;
+      }
+      break;
+    }
+    stats->received += n;
+    RxClock clock = rx_clock();
+    for (int i = 0; i < n; i++) {
+      int len = inMsgs[i].msg_len;
+      // terminate so a text reply can be parsed in place
+      inBufs[i][len] = 0;
+      UDPserver *session = find(inAddrs[i]);
+      if (session != NULL) {
+        session->dispatch(inBufs[i], len, clock.steadyUs, kernel_receive_us(&inMsgs[i].msg_hdr, clock));
+        continue;
+      }
+      pings.push_back(ClientPing());
+      ClientPing &ping = pings.back();
+      ping.from = inAddrs[i];
+      ping.len = len;
+      memcpy(ping.data, inBufs[i], len + 1);
+    }
+  } while (n == BATCH_SIZE);
+  draining = false;
+#else
+  (void)stats;
+#endif
+}
+
+/**
+ * @brief Retransmit or time out the overdue requests of every session
+ */
+void SocketShare::expire()
+{
+  for (size_t i = 0; i < sessions.size(); i++)
+    sessions[i]->expire();
+}
+
+/**
+ * @brief Look up the session of a client
+ * @param addr Client address
+ * @return Session, NULL if the client has none
+ */
+UDPserver *SocketShare::find(const struct sockaddr_in &addr)
+{
+  std::unordered_map<uint64_t, UDPserver *>::const_iterator it = byAddress.find(key(addr));
+  return it == byAddress.end() ? NULL : it->second;
+}
+
+/**
+ * @brief Give a client its session
+ * @param session Session serving the client, deleted with the share
+ * @param addr Client address
+ */
+void SocketShare::add(UDPserver *session, const struct sockaddr_in &addr)
+{
+  sessions.push_back(session);
+  byAddress[key(addr)] = session;
+}
+
+/**
+ * Datagrams from a closed session's client are taken as pings
+ * again, so the client can start over
+ * @brief Delete the sessions queued in closing
+ * @return Sessions deleted
+ */
+int SocketShare::reap()
+{
+  int reaped = 0;
+  for (size_t c = 0; c < closing.size(); c++) {
+    UDPserver *session = closing[c];
+    for (size_t i = 0; i < sessions.size(); i++) {
+      if (sessions[i] == session) {
+        sessions.erase(sessions.begin() + i);
+        break;
+      }
+    }
+    std::unordered_map<uint64_t, UDPserver *>::iterator it = byAddress.begin();
+    while (it != byAddress.end()) {
+      if (it->second == session)
+        it = byAddress.erase(it);
+      else
+        ++it;
+    }
+    delete session;
+    reaped++;
+  }
+  closing.clear();
+  return reaped;
+}
+
+/**
+ * @brief Key of a client address in byAddress
+ */
+uint64_t SocketShare::key(const struct sockaddr_in &addr)
+{
+  return ((uint64_t)addr.sin_addr.s_addr << 16) | addr.sin_port;
+}
+
+/**
+ * @brief Constructor, the workers are started by start()
+ * @param debug Debug level passed on to the sessions
+ * @param options Server options, workers gives the number of workers
+ */
+ShardPool::ShardPool(int debug, const ServerOptions &options)
+  : stopping(false), sessionCount(0), idleMs(SHARD_IDLE_MS), debug(debug), options(options)
+{
+}
+
+/**
+ * @brief Destructor, stops the workers
+ */
+ShardPool::~ShardPool()
+{
+  stop();
+}
+
+/**
+ * Bind every worker's socket, then start the workers. Each one
+ * answers the pings of its new clients and calls accepted() with
+ * the new session, then tick() for every session each time round
+ * its loop.
+ * @brief Start the workers
+ * @param accepted Called once for every new session
+ * @param tick Called for every session whenever its worker wakes, may be empty
+ * @return false if a socket could not be bound
+ */
+bool ShardPool::start(SessionHandler accepted, SessionHandler tick)
+{
+  onAccept = accepted;
+  onTick = tick;
+  int workers = options.workers > 0 ? options.workers : 1;
+  for (int i = 0; i < workers; i++) {
+    SocketShare *share = new SocketShare();
+    shares.push_back(share);
+    if (!share->open(options.rxTimestamps)) {
+      perror("ERROR: Could not bind worker socket");
+      stop();
+      return false;
+    }
+  }
+  stopping = false;
+  for (int i = 0; i < workers; i++)
+    threads.push_back(std::thread(&ShardPool::run, this, i));
+  return true;
+}
+
+/**
+ * @brief Stop the workers and close their sessions and sockets
+ */
+void ShardPool::stop()
+{
+  stopping = true;
+  for (size_t i = 0; i < threads.size(); i++)
+    threads[i].join();
+  threads.clear();
+  for (size_t i = 0; i < shares.size(); i++)
+    delete shares[i];
+  shares.clear();
+  sessionCount = 0;
+}
+
+/**
+ * @brief Loop of one worker, pinned to a core of its own where there are enough
+ * @param index Worker number
+ */
+void ShardPool::run(int index)
+{
+#ifndef _WIN32
+  int cores = (int)std::thread::hardware_concurrency();
+  if (cores > 0) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(index % cores, &set);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0)
+      std::cerr << "WARNING: could not pin worker " << index << std::endl;
+  }
+#endif
+  SocketShare &share = *shares[index];
+  while (!stopping.load(std::memory_order_relaxed)) {
+    if (share.wait(idleMs))
+      share.drain(&share.stats);
+    if (!share.pings.empty())
+      accept(share);
+    if (onTick) {
+      for (size_t i = 0; i < share.sessions.size(); i++)
+        onTick(share.sessions[i]);
+    }
+    share.expire();
+    if (!share.closing.empty())
+      sessionCount -= share.reap();
+  }
+}
+
+/**
+ * The session is deleted once its worker has finished the round
+ * of handlers it is in, so a handler may close its own session
+ * @brief Close a session and free its place for another client
+ * @param session Session to close, must be called on its worker's thread
+ */
+void ShardPool::close(UDPserver *session)
+{
+  SocketShare *share = SocketShare::of(session);
+  for (size_t i = 0; i < share->closing.size(); i++) {
+    if (share->closing[i] == session)
+      return;
+  }
+  share->closing.push_back(session);
+}
+
+/**
+ * Answer the pings read by a worker and open a session for each
+ * new client, up to options.clients over all workers. Sessions
+ * are held until close()
+ * @brief Accept the new clients of a worker
+ * @param share Socket of the worker
+ */
+void ShardPool::accept(SocketShare &share)
+{
+#ifndef _WIN32
+  while (!share.pings.empty()) {
+    ClientPing &ping = share.pings.front();
+    // A late datagram from a client accepted by this worker
+    // while it was queued
+    if (share.find(ping.from) != NULL) {
+      share.pings.pop_front();
+      continue;
+    }
+    // Stray traffic gets no session, it would hold one for good
+    if (!is_ping(ping)) {
+      if (debug)
+        std::cerr << "WARNING: ignoring " << ping.len << " bytes from unknown client "
+                  << inet_ntoa(ping.from.sin_addr) << ":" << ntohs(ping.from.sin_port) << std::endl;
+      share.pings.pop_front();
+      continue;
+    }
+    if (sessionCount.fetch_add(1) >= options.clients) {
+      sessionCount--;
+      std::cerr << "WARNING: " << options.clients << " clients already served, ignoring "
+                << inet_ntoa(ping.from.sin_addr) << ":" << ntohs(ping.from.sin_port) << std::endl;
+      share.pings.pop_front();
+      continue;
+    }
+    if (debug)
+      std::cout << "Received " << ping.data << " from " << inet_ntoa(ping.from.sin_addr) << ":"
+                << ntohs(ping.from.sin_port) << ", now returning ping..." << std::endl;
+    if (sendto(share.fd, ping.data, ping.len, 0, (struct sockaddr *)&ping.from, sizeof(ping.from)) < 0) {
+      perror("ERROR writing to client");
+      share.stats.errors++;
+    }
+    share.stats.sendCalls++;
+    UDPserver *session = new UDPserver(&share, ping.from, debug, options);
+    share.add(session, ping.from);
+    share.pings.pop_front();
+    if (onAccept)
+      onAccept(session);
+  }
+#endif
+}
@@ -0,0 +1,262 @@
+// ==============================================================
+//                  ORBITER MODULE: Rcontrol
+//
+// shmring.cpp
+//
+// Shared-memory transport for a client running on the same
+// host.
+// ==============================================================
+
+#include "shmring.h"
+#include "telemetry.h"
+#include <string.h>
+#include <thread>
+#ifndef _WIN32
+# include <errno.h>
+# include <fcntl.h>
+# include <unistd.h>
+# include <sys/mman.h>
+# include <sys/stat.h>
+# include <sys/syscall.h>
+# include <linux/futex.h>
+# include <time.h>
+#endif
+
+#define SHM_MASK (SHM_RING_SLOTS - 1)
+
+#ifndef _WIN32
+/**
+ * @brief Sleep while a shared futex word still holds a value
+ * @param word Futex word in the shared segment
+ * @param value Value observed before going to sleep
+ * @param timeout_ms Longest sleep, negative to wait forever
+ */
+static void futex_wait(std::atomic<uint32_t> *word, uint32_t value, int timeout_ms)
+{
+  struct timespec ts;
+  ts.tv_sec = timeout_ms / 1000;
+  ts.tv_nsec = (long)(timeout_ms % 1000) * 1000000;
+  // Not FUTEX_PRIVATE_FLAG, the word is shared with another process
+  syscall(SYS_futex, reinterpret_cast<uint32_t *>(word), FUTEX_WAIT, value,
+          timeout_ms < 0 ? NULL : &ts, NULL, 0);
+}
+
+/**
+ * @brief Wake the process sleeping on a shared futex word
+ * @param word Futex word in the shared segment
+ */
+static void futex_wake(std::atomic<uint32_t> *word)
+{
+  syscall(SYS_futex, reinterpret_cast<uint32_t *>(word), FUTEX_WAKE, 1, NULL, NULL, 0);
+}
+#endif
+
+/**
+ * @brief Constructor for an unconnected channel
+ */
+ShmChannel::ShmChannel()
+  : segment(NULL), out(NULL), in(NULL), owner(false)
+{
+  // The client cannot answer while we spin on its only core
+  spin = std::thread::hardware_concurrency() > 1 ? SHM_SPIN : 0;
+}
+
+/**
+ * @brief Destructor, unmaps the segment and removes it if this end created it
+ */
+ShmChannel::~ShmChannel()
+{
+#ifndef _WIN32
+  if (segment == NULL)
+    return;
+  munmap(segment, sizeof(ShmSegment));
+  if (owner)
+    shm_unlink(segmentName.c_str());
+#endif
+}
+
+/**
+ * Create the segment and initialise both rings. A segment left
+ * behind by a previous run is replaced.
+ * @brief Create the server end of the channel
+ * @param name POSIX shared-memory name, starting with '/'
+ * @return false if the segment could not be created, errno is set
+ */
+bool ShmChannel::create(const std::string &name)
+{
+  return map(name, true);
+}
+
+/**
+ * @brief Open the client end of a channel created by the server
+ * @param name POSIX shared-memory name, starting with '/'
+ * @return false if the segment does not exist or is not initialised yet
+ */
+bool ShmChannel::open(const std::string &name)
+{
+  return map(name, false);
+}
+
+/**
+ * @brief Map the segment and pick the ring this end writes to
+ * @param name POSIX shared-memory name
+ * @param create true for the server end
+ * @return false on failure
+ */
+bool ShmChannel::map(const std::string &name, bool create)
+{
+#ifdef _WIN32
+  (void)name;
+  (void)create;
+  return false;
+#else
+  if (create)
+    shm_unlink(name.c_str());
+  int fd = shm_open(name.c_str(), create ? O_CREAT | O_EXCL | O_RDWR : O_RDWR, 0600);
+  if (fd < 0)
+    return false;
+  if (create && ftruncate(fd, sizeof(ShmSegment)) < 0) {
+    int saved = errno;
+    close(fd);
+    shm_unlink(name.c_str());
+    errno = saved;
+    return false;
+  }
+  void *addr = mmap(NULL, sizeof(ShmSegment), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (addr == MAP_FAILED) {
+    if (create)
+      shm_unlink(name.c_str());
+    return false;
+  }
+  ShmSegment *seg = static_cast<ShmSegment *>(addr);
+  if (create) {
+    // A new segment is zero filled, which is an empty ring;
+    // the magic number is written last so a client never
+    // sees half initialised rings
+    seg->version = SHM_VERSION;
+    std::atomic_thread_fence(std::memory_order_release);
+    seg->magic = SHM_MAGIC;
+  }
+  else {
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (seg->magic != SHM_MAGIC || seg->version != SHM_VERSION) {
+      munmap(addr, sizeof(ShmSegment));
+      errno = EAGAIN;
+      return false;
+    }
+  }
+  segment = seg;
+  segmentName = name;
+  owner = create;
+  out = create ? &seg->toClient : &seg->toServer;
+  in = create ? &seg->toServer : &seg->toClient;
+  return true;
+#endif
+}
+
+/**
+ * The frame is written in place and only becomes visible to the
+ * other end on commit()
+ * @brief Get the next free outbound frame
+ * @return Buffer of SHM_FRAME_LEN bytes, NULL if the ring is full
+ */
+char *ShmChannel::reserve()
+{
+  uint32_t head = out->head.load(std::memory_order_relaxed);
+  if (head - out->tail.load(std::memory_order_acquire) == SHM_RING_SLOTS)
+    return NULL;
+  return out->frames[head & SHM_MASK].data;
+}
+
+/**
+ * @brief Publish the frame last returned by reserve()
+ * @param len Bytes written to the frame
+ * @return true if the consumer was asleep and had to be woken
+ */
+bool ShmChannel::commit(size_t len)
+{
+  uint32_t head = out->head.load(std::memory_order_relaxed);
+  out->frames[head & SHM_MASK].len = (uint32_t)len;
+  // Sequentially consistent so the store to head and the load
+  // of sleeping cannot pass each other, the consumer does the
+  // same in the opposite order
+  out->head.store(head + 1, std::memory_order_seq_cst);
+#ifndef _WIN32
+  if (out->sleeping.load(std::memory_order_seq_cst)) {
+    futex_wake(&out->head);
+    return true;
+  }
+#endif
+  return false;
+}
+
+/**
+ * The frame stays valid, and may be modified in place, until
+ * release() is called. It is terminated one byte past its length.
+ * @brief Get the oldest inbound frame without copying it
+ * @param *len Pointer to store the frame length to
+ * @return Frame data, NULL if the ring is empty
+ */
+char *ShmChannel::peek(size_t *len)
+{
+  uint32_t tail = in->tail.load(std::memory_order_relaxed);
+  if (in->head.load(std::memory_order_acquire) == tail)
+    return NULL;
+  ShmRing::Frame &frame = in->frames[tail & SHM_MASK];
+  size_t n = frame.len;
+  if (n > SHM_FRAME_LEN)
+    n = SHM_FRAME_LEN;
+  frame.data[n] = 0;
+  *len = n;
+  return frame.data;
+}
+
+/**
+ * @brief Hand the frame returned by peek() back to the producer
+ */
+void ShmChannel::release()
+{
+  uint32_t tail = in->tail.load(std::memory_order_relaxed);
+  in->tail.store(tail + 1, std::memory_order_release);
+}
+
+/**
+ * Poll the ring for a short while, which catches a reply from a
+ * busy client on another core without a system call, then sleep
+ * on the futex.
+ * @brief Wait for an inbound frame
+ * @param timeout_ms Longest wait in milliseconds, negative to wait forever
+ * @return true if a frame is waiting
+ */
+bool ShmChannel::wait(int timeout_ms)
+{
+  uint32_t tail = in->tail.load(std::memory_order_relaxed);
+  for (int i = 0; i < spin; i++) {
+    if (in->head.load(std::memory_order_acquire) != tail)
+      return true;
+  }
+  if (timeout_ms == 0)
+    return false;
+#ifdef _WIN32
+  return false;
+#else
+  int64_t deadline = monotonic_us() + (int64_t)timeout_ms * 1000;
+  for (;;) {
+    in->sleeping.store(1, std::memory_order_seq_cst);
+    uint32_t head = in->head.load(std::memory_order_seq_cst);
+    if (head != tail)
+      break;
+    int remaining = -1;
+    if (timeout_ms >= 0) {
+      int64_t left = deadline - monotonic_us();
+      if (left <= 0)
+        break;
+      remaining = (int)((left + 999) / 1000);
+    }
+    futex_wait(&in->head, head, remaining);
+  }
+  in->sleeping.store(0, std::memory_order_relaxed);
+  return in->head.load(std::memory_order_acquire) != tail;
+#endif
+}
@@ -0,0 +1,58 @@
+// ==============================================================
+//                  ORBITER MODULE: Rcontrol
+//
+// spscqueue.cpp
+//
+// Sleeping and waking the consumer of an SpscQueue.
+// ==============================================================
+
+#include "spscqueue.h"
+#ifdef _WIN32
+# include <Windows.h>
+#else
+# include <unistd.h>
+# include <sys/syscall.h>
+# include <linux/futex.h>
+# include <time.h>
+#endif
+
+/**
+ * A spurious or early wake-up is harmless, the caller checks the
+ * queue again
+ * @brief Sleep while a queue's head still holds a value
+ * @param word Head of the queue
+ * @param value Value observed before going to sleep
+ * @param timeout_ms Longest sleep, negative to wait forever
+ */
+void queue_wait(std::atomic<uint32_t> *word, uint32_t value, int timeout_ms)
+{
+#ifdef _WIN32
+  // No futex, poll the word every millisecond
+  for (int i = 0; timeout_ms < 0 || i < timeout_ms; i++) {
+    if (word->load(std::memory_order_seq_cst) != value)
+      return;
+    Sleep(1);
+  }
+#else
+  struct timespec ts;
+  ts.tv_sec = timeout_ms / 1000;
+  ts.tv_nsec = (long)(timeout_ms % 1000) * 1000000;
+  // Both threads are in this process, so the private futex
+  // skips the lookup of the shared mapping
+  syscall(SYS_futex, reinterpret_cast<uint32_t *>(word), FUTEX_WAIT_PRIVATE, value,
+          timeout_ms < 0 ? NULL : &ts, NULL, 0);
+#endif
+}
+
+/**
+ * @brief Wake the consumer sleeping on a queue's head
+ * @param word Head of the queue
+ */
+void queue_wake(std::atomic<uint32_t> *word)
+{
+#ifdef _WIN32
+  (void)word;
+#else
+  syscall(SYS_futex, reinterpret_cast<uint32_t *>(word), FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+#endif
+}
@@ -0,0 +1,80 @@
+// ==============================================================
+//                  ORBITER MODULE: Rcontrol
+//
+// tasks.cpp
+//
+// Loop running resumable manoeuvre tasks on one thread.
+// ==============================================================
+
+#include "tasks.h"
+
+/**
+ * @brief Constructor for an empty loop
+ * @param capacity Most tasks that may run at once
+ */
+TaskLoop::TaskLoop(int capacity)
+  : capacity(capacity > 0 ? capacity : 1)
+{
+  tasks.reserve(this->capacity);
+}
+
+/**
+ * The task starts from the top, even if it ran before
+ * @brief Add a task to the loop
+ * @param task Task to run, must outlive its time in the loop
+ * @return false if the loop is full or the task is already in it
+ */
+bool TaskLoop::spawn(ManoeuvreTask *task)
+{
+  if ((int)tasks.size() >= capacity || running(task))
+    return false;
+  task->restart();
+  tasks.push_back(task);
+  return true;
+}
+
+/**
+ * @brief Drop a task wherever it is suspended
+ * @param task Task to drop, nothing happens if it is not in the loop
+ */
+void TaskLoop::cancel(ManoeuvreTask *task)
+{
+  for (size_t i = 0; i < tasks.size(); i++) {
+    if (tasks[i] == task) {
+      tasks.erase(tasks.begin() + i);
+      return;
+    }
+  }
+}
+
+/**
+ * @brief Check whether a task is in the loop and not finished
+ * @param task Task to look for
+ * @return true if it is still running
+ */
+bool TaskLoop::running(const ManoeuvreTask *task) const
+{
+  for (size_t i = 0; i < tasks.size(); i++) {
+    if (tasks[i] == task)
+      return true;
+  }
+  return false;
+}
+
+/**
+ * A task must not spawn or cancel tasks while it is resumed, it
+ * leaves that to whoever runs the loop
+ * @brief Resume every task once
+ * @param ctx State the tasks act on
+ * @return Tasks still running
+ */
+int TaskLoop::run(const TaskContext &ctx)
+{
+  size_t kept = 0;
+  for (size_t i = 0; i < tasks.size(); i++) {
+    if (tasks[i]->resume(ctx) != TASK_DONE)
+      tasks[kept++] = tasks[i];
+  }
+  tasks.resize(kept);
+  return (int)kept;
+}
@@ -0,0 +1,100 @@
+// ==============================================================
+//                  ORBITER MODULE: Rcontrol
+//
+// telemetry.cpp
+//
+// Latest-value cache for the vessel state streamed by the
+// client.
+// ==============================================================
+
+#include "telemetry.h"
+#include <chrono>
+#include <string.h>
+
+/**
+ * @brief Current time on the steady clock
+ * @return Microseconds since an arbitrary fixed point
+ */
+int64_t monotonic_us()
+{
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/**
+ * @brief Constructor for an empty cache
+ */
+TelemetryCache::TelemetryCache()
+  : version(0), receivedUs(-1), accepted(0), rejected(0), lastFrame(0)
+{
+  memset(&latest, 0, sizeof(latest));
+}
+
+/**
+ * Store a sample if it is newer than the cached one. Frames
+ * that arrive after a later frame are dropped so the newest
+ * sample always wins. Must only be called from one thread
+ * @brief Publish a telemetry sample
+ * @param sample Sample with receivedUs filled in
+ * @return false if the sample was older than the cached one
+ */
+bool TelemetryCache::publish(const TelemetrySample &sample)
+{
+  // Compare frame counters allowing for wrap-around
+  if (receivedUs.load(std::memory_order_relaxed) >= 0 &&
+      (int32_t)(sample.frame - lastFrame) <= 0) {
+    rejected.fetch_add(1, std::memory_order_relaxed);
+    return false;
+  }
+  lastFrame = sample.frame;
+  uint32_t v = version.load(std::memory_order_relaxed);
+  version.store(v + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  latest = sample;
+  version.store(v + 2, std::memory_order_release);
+  receivedUs.store(sample.receivedUs, std::memory_order_release);
+  accepted.fetch_add(1, std::memory_order_relaxed);
+  return true;
+}
+
+/**
+ * @brief Read the newest sample
+ * @param sample Copy of the cached sample
+ * @return false if nothing has been received yet
+ */
+bool TelemetryCache::read(TelemetrySample *sample) const
+{
+  if (receivedUs.load(std::memory_order_acquire) < 0)
+    return false;
+  uint32_t before, after;
+  do {
+    before = version.load(std::memory_order_acquire);
+    *sample = latest;
+    std::atomic_thread_fence(std::memory_order_acquire);
+    after = version.load(std::memory_order_relaxed);
+  } while ((before & 1) || before != after);
+  return true;
+}
+
+/**
+ * @brief Age of the cached sample
+ * @return Microseconds since the sample was received, -1 if none
+ */
+int64_t TelemetryCache::age_us() const
+{
+  int64_t received = receivedUs.load(std::memory_order_acquire);
+  if (received < 0)
+    return -1;
+  return monotonic_us() - received;
+}
+
+/**
+ * @brief Check the cached sample is recent enough to act on
+ * @param max_age_us Oldest acceptable sample, microseconds
+ * @return true if a sample younger than max_age_us is cached
+ */
+bool TelemetryCache::fresh(int64_t max_age_us) const
+{
+  int64_t age = age_us();
+  return age >= 0 && age <= max_age_us;
+}
@@ -8,12 +8,123 @@
 // ==============================================================
 
 #include "udpserver.h"
+#include "shard.h"
 #include <iostream>
 #include <cstdio>
+#include <cerrno>
+
 
 // Set up server connection, the server address
 // will be passed to the program as an argument
-UDPserver::UDPserver(std::string server_addr, int debug_tmp)
+UDPserver::UDPserver(std::string server_addr, int debug_tmp, const ServerOptions &options)
+{
+  //serv_addr = server_addr.c_str();
+  //printf("The address is %s\n", server_addr);
+  std::cout << "The address is " << server_addr << std::endl;
+  init(debug_tmp, options);
+  if (options.transport != TRANSPORT_SHM) {
+    open_socket(options);
+    return;
+  }
+  // The client on this host maps the same segment, frames go
+  // through its rings instead of the socket
+  shm = new ShmChannel();
+  if (!shm->create(options.shmName)) {
+      error("ERROR: Could not create shared memory segment");
+  }
+  std::cout << "Shared memory segment " << options.shmName << std::endl;
+}
+
+// Serve one client of a SessionTable. The socket is bound to
+// PORT and connected to the client, so the kernel delivers
+// that client's datagrams to it and no other.
+UDPserver::UDPserver(int fd, const struct sockaddr_in &client, int debug_tmp, const ServerOptions &options)
+{
+  init(debug_tmp, options);
+  sockfd = fd;
+#ifdef _WIN32
+  socketS = fd;
+#endif
+  cli_addr = client;
+  cli_len = sizeof(cli_addr);
+  watch_socket(options);
+}
+
+// Serve one client of a socket that other sessions also use.
+// The SocketShare reads the socket and hands every datagram to
+// the session of the client that sent it, so replies are read
+// in place of recvmmsg/io_uring and never one at a time.
+UDPserver::UDPserver(SocketShare *socket_share, const struct sockaddr_in &client, int debug_tmp,
+                     const ServerOptions &options)
+{
+  init(debug_tmp, options);
+  replies = REPLY_PACKED;
+  share = socket_share;
+  sockfd = share->fd;
+  cli_addr = client;
+  cli_len = sizeof(cli_addr);
+  ServerOptions shared = options;
+  shared.uring = false;
+  watch_socket(shared);
+}
+
+// State shared by every transport
+void UDPserver::init(int debug_tmp, const ServerOptions &options)
+{
+  debug = debug_tmp;
+  wire = options.wire;
+  // Split replies only exist in the JSON encoding and are
+  // read from a socket one datagram at a time
+  replies = (wire == WIRE_JSON && options.transport == TRANSPORT_UDP) ? options.replies : REPLY_PACKED;
+  seq = 0;
+  criticalSeq = 0;
+  lanes = options.criticalLane;
+  dropped = 0;
+  sceneId = 0;
+  sceneDst = NULL;
+  sceneFragments = sceneReceived = 0;
+  deltaScenes = options.sceneDelta && wire == WIRE_BINARY;
+  sceneFrame = sceneNextFrame = 0;
+  stateRequests = wire == WIRE_BINARY;
+  stateAnswered = false;
+  for (int i = 0; i < MAX_IN_FLIGHT + CRITICAL_DEPTH; i++) {
+    slots[i].id = 0;
+    slots[i].state = SLOT_FREE;
+  }
+  queued = 0;
+  callDepth = 0;
+  memset(&stats, 0, sizeof(stats));
+  memset(laneStats, 0, sizeof(laneStats));
+  memset(roundTrips, 0, sizeof(roundTrips));
+  rxTimestamps = options.rxTimestamps;
+  rxReadUs = rxKernelUs = 0;
+  timeoutMs = options.timeoutMs;
+  maxRetries = options.retries;
+  sockfd = newsocket = epfd = critfd = -1;
+  shm = NULL;
+  uring = NULL;
+  share = NULL;
+  batching = false;
+  cli_len = sizeof(struct sockaddr);
+}
+
+UDPserver::~UDPserver()
+{
+  delete shm;
+  delete uring;
+#ifdef _WIN32
+  closesocket(socketS);
+#else
+  if (epfd >= 0) close(epfd);
+  // A shared socket belongs to its SocketShare
+  if (sockfd >= 0 && share == NULL) close(sockfd);
+  if (critfd >= 0) close(critfd);
+  if (newsocket >= 0) close(newsocket);
+#endif
+}
+
+// Bind the socket the client sends its datagrams to
+void UDPserver::open_socket(const ServerOptions &options)
 {
 #ifdef _WIN32
     WSADATA wsaData;
@@ -32,9 +143,6 @@ UDPserver::UDPserver(std::string server_addr, int debug_tmp)
         error("ERROR: Could not create SOCKET connection");
     }
 #endif
-  //serv_addr = server_addr.c_str();
-  //printf("The address is %s\n", server_addr);
-  std::cout << "The address is " << server_addr << std::endl;
   memset(&server, 0, serverlen);
   server.sin_family = AF_INET;
   server.sin_port = htons(port);
@@ -55,207 +163,1408 @@ UDPserver::UDPserver(std::string server_addr, int debug_tmp)
       error("ERROR: Could not bind");
   }
 #endif
-  debug = debug_tmp;
-  cli_len = sizeof(struct sockaddr);
+  watch_socket(options);
+}
+
+// Make the socket non-blocking and set up whichever way of
+// driving it the options select
+void UDPserver::watch_socket(const ServerOptions &options)
+{
+  // The socket never blocks, waiting is done on the epoll
+  // instance so it can be bounded by request deadlines
+#ifdef _WIN32
+  u_long nonBlocking = 1;
+  ioctlsocket(socketS, FIONBIO, &nonBlocking);
+  batching = false;
+#else
+  if (fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL, 0) | O_NONBLOCK) < 0) {
+      error("ERROR: Could not make socket non-blocking");
+  }
+  // A shared socket is waited on through its SocketShare
+  if (share == NULL) {
+    epfd = epoll_create1(0);
+    if (epfd < 0) {
+        error("ERROR: Could not create epoll instance");
+    }
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = sockfd;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, sockfd, &ev) < 0) {
+        error("ERROR: Could not watch socket");
+    }
+  }
+  // Point every message header at its buffer once, only the
+  // lengths change per call
+  for (int i = 0; i < BATCH_SIZE; i++) {
+    memset(&outMsgs[i], 0, sizeof(outMsgs[i]));
+    outIov[i].iov_base = outBufs[i];
+    outMsgs[i].msg_hdr.msg_iov = &outIov[i];
+    outMsgs[i].msg_hdr.msg_iovlen = 1;
+    memset(&inMsgs[i], 0, sizeof(inMsgs[i]));
+    inIov[i].iov_base = inBufs[i];
+    inIov[i].iov_len = BUFLEN - 1;
+    inMsgs[i].msg_hdr.msg_iov = &inIov[i];
+    inMsgs[i].msg_hdr.msg_iovlen = 1;
+    inMsgs[i].msg_hdr.msg_name = &inAddrs[i];
+    attach_rx_control(&inMsgs[i].msg_hdr, inControl[i]);
+  }
+  // A shared socket is stamped by its SocketShare, io_uring
+  // reads no ancillary data
+  if (rxTimestamps && share == NULL && !enable_rx_timestamps(sockfd)) {
+    perror("WARNING: Could not enable receive timestamps");
+    rxTimestamps = false;
+  }
+  // Split replies are read as soon as each request is sent
+  batching = options.batch && replies == REPLY_PACKED;
+  // io_uring takes over batching when the kernel supports it,
+  // otherwise the socket calls above are used as they are
+  if (options.uring && replies == REPLY_PACKED) {
+    uring = new UringSocket();
+    if (uring->open(sockfd)) {
+      batching = false;
+    }
+    else {
+      std::cerr << "WARNING: io_uring unavailable, using socket calls" << std::endl;
+      delete uring;
+      uring = NULL;
+    }
+  }
+  // Split replies are read from the bulk socket as soon as
+  // each request is sent, and the other backends have a single
+  // way in of their own
+  if (lanes && share == NULL && uring == NULL && replies == REPLY_PACKED)
+    open_critical_lane();
+#endif
+}
+
+// Open the critical lane's socket alongside the bulk one. A
+// session's socket is connected to its client, so this one is
+// connected too and every session can bind CRITICAL_PORT. If it
+// cannot be opened critical requests use the bulk socket.
+void UDPserver::open_critical_lane()
+{
+#ifndef _WIN32
+  int fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+  if (fd < 0) {
+    perror("WARNING: Could not create critical lane socket");
+    return;
+  }
+  int on = 1;
+  struct sockaddr_in local;
+  memset(&local, 0, sizeof(local));
+  local.sin_family = AF_INET;
+  local.sin_port = htons(CRITICAL_PORT);
+  local.sin_addr.s_addr = htonl(INADDR_ANY);
+  struct sockaddr_in peer;
+  socklen_t peerLen = sizeof(peer);
+  bool connected = getpeername(sockfd, (struct sockaddr *)&peer, &peerLen) == 0;
+  struct epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;
+  ev.data.fd = fd;
+  if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) < 0 ||
+      bind(fd, (struct sockaddr *)&local, sizeof(local)) < 0 ||
+      (connected && connect(fd, (struct sockaddr *)&peer, peerLen) < 0) ||
+      fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK) < 0 ||
+      epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+    perror("WARNING: Could not open critical lane, sharing the bulk socket");
+    close(fd);
+    return;
+  }
+  // Marking only helps where the network honours it, the lane
+  // already keeps critical requests out of the bulk queues
+  int tos = CRITICAL_TOS;
+  int priority = 6;	// highest allowed without CAP_NET_ADMIN
+  if (setsockopt(fd, IPPROTO_IP, IP_TOS, &tos, sizeof(tos)) < 0 ||
+      setsockopt(fd, SOL_SOCKET, SO_PRIORITY, &priority, sizeof(priority)) < 0)
+    perror("WARNING: Could not mark critical lane");
+  if (rxTimestamps)
+    enable_rx_timestamps(fd);
+  critfd = fd;
+#endif
 }
 
 bool UDPserver::check_ping()
 {
   int ping;
+  // Wait as long as it takes for a client to appear
+  while (!wait_readable(-1))
+    ;
+  if (uring) {
+    size_t len;
+    char *frame;
+    while ((frame = uring->next_datagram(&len, &cli_addr)) == NULL)
+      wait_readable(-1);
+    memcpy(buffer, frame, len + 1);
+    uring->release();
+    cli_len = sizeof(cli_addr);
+    std::cout << "Received " << buffer << ", now returning ping..." << std::endl;
+    ping = sendto(sockfd, &buffer, len, 0, (struct sockaddr *)&cli_addr, cli_len);
+    if (ping < 0) error("ERROR writing to client");
+    return true;
+  }
+  if (shm) {
+    size_t len;
+    char *frame = shm->peek(&len);
+    std::cout << "Received " << frame << ", now returning ping..." << std::endl;
+    char *reply = shm->reserve();
+    if (reply == NULL) error("ERROR writing to client");
+    memcpy(reply, frame, len);
+    shm->commit(len);
+    shm->release();
+    return true;
+  }
 #ifdef _WIN32
   ping = recvfrom(socketS, buffer, BUFLEN - 1, 0, (sockaddr*)&cli_addr, &cli_len);
 #else
   ping = recvfrom(sockfd, buffer, BUFLEN - 1, 0, (struct sockaddr *)&cli_addr, &cli_len);
 #endif
   if (ping < 0) error("ERROR reading from client");
+  int pingLen = ping;
   std::cout << "Received " << buffer << ", now returning ping..." << std::endl;
   if (debug) {
     std::cout << "The address of the client is " << inet_ntoa(cli_addr.sin_addr) << std::endl;
     std::cout << "The length of the client " << cli_len << std::endl;
   }
 #ifdef _WIN32
-  ping = sendto(socketS, buffer, sizeof(buffer), 0, (struct sockaddr *)&cli_addr, cli_len);
+  ping = sendto(socketS, buffer, pingLen, 0, (struct sockaddr *)&cli_addr, cli_len);
 #else
-  ping = sendto(sockfd, &buffer, sizeof(buffer), 0, (struct sockaddr *)&cli_addr, cli_len);
+  ping = sendto(sockfd, &buffer, pingLen, 0, (struct sockaddr *)&cli_addr, cli_len);
 #endif
   if (ping < 0) error("ERROR writing to client");
   return true;
 }
 
-// for every connection made. It handles the communication
-// once a connection has been established.
-void UDPserver::transfer_data(std::string operation, std::string detail)
+// Encode the request held in a slot in the selected wire format
+// and send it to the client. Only the encoded bytes go out, not
+// the whole buffer. With batching the request is queued until
+// the next flush. A failed send is left to the retransmission.
+void UDPserver::send_request(Slot &slot)
 {
   int n;
+  int opcode = slot.opcode;
+  double arg = slot.arg;
   cli_len = sizeof(cli_addr);
+  slot.sentUs = monotonic_us();
 
-  memset(&buffer, 0, sizeof(buffer));
-
-  // If the size of the data is greater than zero,
-  // copy into the buffer
-  // Build up the JSON string
-  std::string jsonbuffer = "{\"operation\":\"" + operation + "\",\"detail\":" + detail + "}";
-  strcpy(buffer,jsonbuffer.c_str());
+  char *out = batching ? outBufs[queued] : buffer;
+  size_t outLen = batching ? REQUEST_LEN : sizeof(buffer);
+  // A critical request skips the bulk queue on its own socket
+  bool dedicated = slot.lane == LANE_CRITICAL && critfd >= 0;
+  if (dedicated) {
+    out = critOut;
+    outLen = sizeof(critOut);
+  }
+  // Through shared memory the request is encoded straight
+  // into the ring, a full ring is treated like a lost datagram
+  else if (shm) {
+    out = shm->reserve();
+    outLen = SHM_FRAME_LEN;
+    if (out == NULL) {
+      std::cerr << "WARNING: shared memory ring full" << std::endl;
+      stats.errors++;
+      return;
+    }
+  }
+  else if (uring) {
+    out = uring->send_buffer();
+    outLen = URING_SEND_LEN;
+    if (out == NULL) {
+      std::cerr << "WARNING: io_uring sends all in flight" << std::endl;
+      stats.errors++;
+      return;
+    }
+  }
+  int len;
+  if (opcode == SET_ACTUATORS)
+    len = encode_actuator_frame(slot.actuators, slot.id, out, outLen);
+  else if (opcode == GET_SCENE_NEAR)
+    len = encode_scene_query(slot.query, slot.id, out, outLen);
+  else if (slot.codec != NULL)
+    len = slot.codec->encode(arg, slot.id, out, outLen);
+  else
+    len = encode_request(wire, opcode, arg, slot.id, out, outLen);
+  if (len < 0) error("ERROR encoding request");
   // Request the data transaction from the client
   if (debug) {
     printf("Requesting data from client....\n");
     printf("Socket = %d\n", sockfd);
     printf("Attempting to write to socket...\n");
-    std::cout << "Writing data value : " << buffer << " to client" << std::endl;
+    if (wire == WIRE_JSON)
+      std::cout << "Writing data value : " << out << " to client" << std::endl;
+    else
+      std::cout << "Writing " << opcode_name(opcode) << " : " << arg << " to client" << std::endl;
+  }
+#ifndef _WIN32
+  if (dedicated) {
+    n = sendto(critfd, out, len, 0, (struct sockaddr *)&cli_addr, cli_len);
+    stats.sendCalls++;
+    if (n < 0) {
+      report("ERROR writing to critical lane");
+      return;
+    }
+    stats.sent++;
+    return;
+  }
+#endif
+  if (shm) {
+    if (shm->commit(len))
+      stats.sendCalls++;
+    stats.sent++;
+    return;
+  }
+  // Queued until the next flush or wait, whichever comes first,
+  // unless the request is critical
+  if (uring) {
+    if (!uring->queue_send(len, &cli_addr, cli_len)) {
+      report("ERROR queueing request");
+      return;
+    }
+    stats.sent++;
+    if (slot.lane == LANE_CRITICAL)
+      flush();
+    return;
   }
+#ifndef _WIN32
+  if (batching) {
+    outIov[queued].iov_len = len;
+    queued++;
+    if (queued == BATCH_SIZE || slot.lane == LANE_CRITICAL)
+      flush();
+    return;
+  }
+#endif
 #ifdef _WIN32
-  n = sendto(socketS, buffer, sizeof(buffer), 0, (struct sockaddr *)&cli_addr, cli_len);
+  n = sendto(socketS, buffer, len, 0, (struct sockaddr *)&cli_addr, cli_len);
 #else
-  n = sendto(sockfd, &buffer, sizeof(buffer), 0, (struct sockaddr *)&cli_addr, cli_len);
+  n = sendto(sockfd, &buffer, len, 0, (struct sockaddr *)&cli_addr, cli_len);
 #endif
-  if (n < 0) error("ERROR writing to socket");
+  stats.sendCalls++;
+  if (n < 0) {
+    report("ERROR writing to socket");
+    return;
+  }
+  stats.sent++;
+}
 
-  // zero the buffer again
+// Read a single reply datagram into the buffer, returns
+// the number of bytes received or -1 if nothing is waiting
+int UDPserver::receive_reply()
+{
+  int n;
+  // zero the buffer so a text reply is always terminated
   memset(buffer, 0, BUFLEN);
   // Read the contents of the message into the buffer
 #ifdef _WIN32
   n = recvfrom(socketS, buffer, BUFLEN - 1, 0, (sockaddr*)&cli_addr, &cli_len);
 #else
-  n = recvfrom(sockfd, buffer, BUFLEN - 1, 0, (struct sockaddr *)&cli_addr, &cli_len);
+  // recvmsg rather than recvfrom, the kernel's receive
+  // timestamp comes with the datagram as ancillary data
+  struct iovec iov;
+  iov.iov_base = buffer;
+  iov.iov_len = BUFLEN - 1;
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_name = &cli_addr;
+  msg.msg_namelen = sizeof(cli_addr);
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  attach_rx_control(&msg, rxControl);
+  n = recvmsg(sockfd, &msg, 0);
+  cli_len = msg.msg_namelen;
+#endif
+  stats.recvCalls++;
+  if (n < 0) {
+#ifndef _WIN32
+    if (errno != EAGAIN && errno != EWOULDBLOCK)
+      report("ERROR reading from socket");
 #endif
+    return -1;
+  }
+#ifdef _WIN32
+  rxReadUs = monotonic_us();
+  rxKernelUs = 0;
+#else
+  RxClock clock = rx_clock();
+  rxReadUs = clock.steadyUs;
+  rxKernelUs = kernel_receive_us(&msg, clock);
+#endif
+  stats.received++;
+  if (debug) {
+    if (wire == WIRE_JSON)
+      printf("Received packet from %s:%d\nData: %s\n\n", inet_ntoa(cli_addr.sin_addr), ntohs(cli_addr.sin_port), buffer);
+    else
+      printf("Received %d bytes from %s:%d\n\n", n, inet_ntoa(cli_addr.sin_addr), ntohs(cli_addr.sin_port));
+  }
+  return n;
 }
 
-
-
-
-// There is a seperate instance of this function
-// for every connection made. It handles the communication
-// once a connection has been established.
-void UDPserver::transfer_data(std::string operation, std::string detail, int *result)
+// Read up to BATCH_SIZE waiting datagrams with one recvmmsg
+// call and pass each to its request. Returns the number read.
+// Handlers run while the ring is being walked, so they may
+// submit requests but must not wait on them.
+int UDPserver::receive_batch()
 {
-  int n;
-  cli_len = sizeof(cli_addr);
-
-  memset(&buffer, 0, sizeof(buffer));
-
-  // If the size of the data is greater than zero,
-  // copy into the buffer
-  // Build up the JSON string
-  std::string jsonbuffer = "{\"operation\":\"" + operation + "\",\"detail\":" + detail + "}";
-  strcpy(buffer,jsonbuffer.c_str());
-  // Request the data transaction from the client
-  if (debug) {
-    printf("Requesting data from client....\n");
-    printf("Attempting to write to socket...\n");
-    std::cout << "Writing data value : " << buffer << " to client" << std::endl;
-  }
 #ifdef _WIN32
-  n = sendto(socketS, buffer, sizeof(buffer), 0, (struct sockaddr *)&cli_addr, cli_len);
+  return 0;
 #else
-  n = sendto(sockfd, &buffer, sizeof(buffer), 0, (struct sockaddr *)&cli_addr, cli_len);
+  // The kernel shrinks both lengths to what it wrote
+  for (int i = 0; i < BATCH_SIZE; i++) {
+    inMsgs[i].msg_hdr.msg_namelen = sizeof(inAddrs[i]);
+    inMsgs[i].msg_hdr.msg_controllen = RX_CONTROL_LEN;
+  }
+  int n = recvmmsg(sockfd, inMsgs, BATCH_SIZE, 0, NULL);
+  stats.recvCalls++;
+  if (n < 0) {
+    if (errno != EAGAIN && errno != EWOULDBLOCK)
+      report("ERROR reading from socket");
+    return 0;
+  }
+  stats.received += n;
+  // The whole batch was read at once
+  RxClock clock = rx_clock();
+  for (int i = 0; i < n; i++) {
+    int len = inMsgs[i].msg_len;
+    // terminate so a text reply can be parsed in place
+    inBufs[i][len] = 0;
+    cli_addr = inAddrs[i];
+    if (debug)
+      printf("Received %d bytes from %s:%d\n\n", len, inet_ntoa(cli_addr.sin_addr), ntohs(cli_addr.sin_port));
+    dispatch(inBufs[i], len, clock.steadyUs, kernel_receive_us(&inMsgs[i].msg_hdr, clock));
+  }
+  return n;
 #endif
-  if (n < 0) error("ERROR writing to socket");
+}
 
-  // zero the buffer again
-  memset(buffer, 0, BUFLEN);
-  // Read the contents of the message into the buffer
+// Send every queued request with as few sendmmsg calls
+// as the kernel allows
+void UDPserver::flush()
+{
+  CallTally tally(*this);
+  if (uring) {
+    int n = uring->submit();
+    if (n < 0)
+      report("ERROR submitting to io_uring");
+    else
+      stats.sendCalls += n;
+    return;
+  }
+#ifndef _WIN32
+  int sent = 0;
+  while (sent < queued) {
+    for (int i = sent; i < queued; i++) {
+      outMsgs[i].msg_hdr.msg_name = &cli_addr;
+      outMsgs[i].msg_hdr.msg_namelen = cli_len;
+    }
+    int n = sendmmsg(sockfd, outMsgs + sent, queued - sent, 0);
+    stats.sendCalls++;
+    if (n < 0) {
+      // Leave the rest to the retransmission
+      report("ERROR writing to socket");
+      break;
+    }
+    stats.sent += n;
+    sent += n;
+  }
+#endif
+  queued = 0;
+}
+
+// Block until the socket is readable or the timeout in
+// milliseconds passes, a negative timeout waits forever
+bool UDPserver::wait_readable(int timeout_ms)
+{
+  if (shm)
+    return shm->wait(timeout_ms);
+  stats.waits++;
+  if (uring)
+    return uring->wait(timeout_ms);
+  if (share)
+    return share->wait(timeout_ms);
 #ifdef _WIN32
-  n = recvfrom(socketS, buffer, BUFLEN - 1, 0, (sockaddr*)&cli_addr, &cli_len);
+  fd_set readable;
+  FD_ZERO(&readable);
+  FD_SET(socketS, &readable);
+  struct timeval tv;
+  tv.tv_sec = timeout_ms / 1000;
+  tv.tv_usec = (timeout_ms % 1000) * 1000;
+  return select(0, &readable, NULL, NULL, timeout_ms < 0 ? NULL : &tv) > 0;
 #else
-  n = recvfrom(sockfd, buffer, BUFLEN - 1, 0, (struct sockaddr *)&cli_addr, &cli_len);
+  struct epoll_event ev;
+  int n = epoll_wait(epfd, &ev, 1, timeout_ms);
+  if (n < 0 && errno != EINTR)
+    report("ERROR waiting on socket");
+  return n > 0;
 #endif
-  if (n < 0) error("ERROR reading from socket");
-  if (debug)
-    printf("Received packet from %s:%d\nData: %s\n\n", inet_ntoa(cli_addr.sin_addr), ntohs(cli_addr.sin_port), buffer);
-  // Store the data into the result vector using the array data interface
-  *result = atof(buffer);
 }
 
-// There is a seperate instance of this function
-// for every connection made. It handles the communication
-// once a connection has been established.
-void UDPserver::transfer_data(std::string operation, std::string detail, double *result)
+// Read every datagram already waiting on the socket
+void UDPserver::drain()
 {
+  if (critfd >= 0)
+    drain_critical();
+  // Frames in the ring are decoded where they lie and only
+  // handed back once dispatched
+  if (shm) {
+    size_t len;
+    char *frame;
+    while ((frame = shm->peek(&len)) != NULL) {
+      stats.received++;
+      if (debug)
+        printf("Received %d bytes from shared memory\n\n", (int)len);
+      dispatch(frame, (int)len, monotonic_us(), 0);
+      shm->release();
+    }
+    return;
+  }
+  if (uring) {
+    size_t len;
+    char *data;
+    while ((data = uring->next_datagram(&len, &cli_addr)) != NULL) {
+      stats.received++;
+      if (debug)
+        printf("Received %d bytes from %s:%d\n\n", (int)len, inet_ntoa(cli_addr.sin_addr), ntohs(cli_addr.sin_port));
+      dispatch(data, (int)len, monotonic_us(), 0);
+      uring->release();
+    }
+    // Sends fail asynchronously, their completions are read here
+    stats.errors += uring->take_send_errors();
+    return;
+  }
+  if (share) {
+    share->drain(&stats);
+    return;
+  }
+  if (batching) {
+    while (receive_batch() == BATCH_SIZE)
+      ;
+    return;
+  }
   int n;
-  cli_len = sizeof(cli_addr);
-
-  memset(&buffer, 0, sizeof(buffer));
+  while ((n = receive_reply()) >= 0)
+    dispatch(buffer, n, rxReadUs, rxKernelUs);
+}
 
-  // If the size of the data is greater than zero,
-  // copy into the buffer
-  // Build up the JSON string
-  std::string jsonbuffer = "{\"operation\":\"" + operation + "\",\"detail\":" + detail + "}";
-  strcpy(buffer,jsonbuffer.c_str());
-  // Request the data transaction from the client
-  if (debug) {
-    printf("Requesting data from client....\n");
-    printf("Attempting to write to socket...\n");
-    std::cout << "Writing data value : " << buffer << " to client" << std::endl;
+// Read every reply waiting on the critical lane, this is done
+// before the bulk socket is read so they never queue behind it
+void UDPserver::drain_critical()
+{
+#ifndef _WIN32
+  int n;
+  struct iovec iov;
+  iov.iov_base = critIn;
+  iov.iov_len = BUFLEN - 1;
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  for (;;) {
+    attach_rx_control(&msg, rxControl);
+    n = recvmsg(critfd, &msg, 0);
+    stats.recvCalls++;
+    if (n < 0)
+      break;
+    stats.received++;
+    RxClock clock = rx_clock();
+    // terminate so a text reply can be parsed in place
+    critIn[n] = 0;
+    if (debug)
+      printf("Received %d bytes on the critical lane\n\n", n);
+    dispatch(critIn, n, clock.steadyUs, kernel_receive_us(&msg, clock));
   }
-#ifdef _WIN32
-  n = sendto(socketS, buffer, sizeof(buffer), 0, (struct sockaddr *)&cli_addr, cli_len);
-#else
-  n = sendto(sockfd, &buffer, sizeof(buffer), 0, (struct sockaddr *)&cli_addr, cli_len);
+  if (errno != EAGAIN && errno != EWOULDBLOCK)
+    report("ERROR reading from critical lane");
 #endif
-  if (n < 0) error("ERROR writing to socket");
+}
 
-  // zero the buffer again
-  memset(buffer, 0, BUFLEN);
-  // Read the contents of the message into the buffer
+// Milliseconds until the earliest request deadline, or -1
+// if nothing is waiting on a reply
+int UDPserver::next_timeout()
+{
+  int64_t earliest = -1;
+  for (int i = 0; i < MAX_IN_FLIGHT + CRITICAL_DEPTH; i++) {
+    if (slots[i].state == SLOT_PENDING && (earliest < 0 || slots[i].deadline < earliest))
+      earliest = slots[i].deadline;
+  }
+  if (earliest < 0)
+    return -1;
+  int64_t remaining = earliest - monotonic_us();
+  if (remaining <= 0)
+    return 0;
+  // round up so the deadline has passed when we wake
+  return (int)((remaining + 999) / 1000);
+}
+
+// Retransmit every request whose deadline has passed, doubling
+// its timeout each time, and give up on those that have used
+// all their retries
+void UDPserver::expire()
+{
+  int64_t now = monotonic_us();
+  for (int i = 0; i < MAX_IN_FLIGHT + CRITICAL_DEPTH; i++) {
+    Slot &slot = slots[i];
+    if (slot.state != SLOT_PENDING || slot.deadline > now)
+      continue;
+    if (slot.attempts < maxRetries) {
+      slot.attempts++;
+      slot.deadline = now + (int64_t)timeoutMs * 1000 * (1 << slot.attempts);
+      stats.retries++;
+      if (debug)
+        printf("Retransmitting request %u, attempt %d\n", (unsigned)slot.id, slot.attempts);
+      send_request(slot);
+      continue;
+    }
+    stats.timeouts++;
+    std::cerr << "WARNING: " << opcode_name(slot.opcode) << " request " << slot.id
+              << " timed out" << std::endl;
+    v3 zero;
+    zero.x = zero.y = zero.z = 0;
+    complete(slot, REQUEST_TIMEOUT, zero);
+  }
+  flush();
+}
+
+// Send anything queued and read, without blocking, every
+// reply already waiting on the socket. Meant to be called
+// once per control loop iteration.
+void UDPserver::poll()
+{
+  CallTally tally(*this);
+  flush();
+  drain();
+  expire();
+}
+
+// Batching is only available where sendmmsg/recvmmsg are,
+// and not for split replies which are read request by request,
+// the shared-memory rings which need no system calls or
+// io_uring which batches on its own
+void UDPserver::set_batching(bool enable)
+{
+  flush();
 #ifdef _WIN32
-  n = recvfrom(socketS, buffer, BUFLEN - 1, 0, (sockaddr*)&cli_addr, &cli_len);
+  (void)enable;
 #else
-  n = recvfrom(sockfd, buffer, BUFLEN - 1, 0, (struct sockaddr *)&cli_addr, &cli_len);
+  batching = enable && replies == REPLY_PACKED && shm == NULL && uring == NULL;
 #endif
-  if (n < 0) error("ERROR reading from socket");
-  if (debug)
-    printf("Received packet from %s:%d\nData: %s\n\n", inet_ntoa(cli_addr.sin_addr), ntohs(cli_addr.sin_port), buffer);
-  // Store the data into the result vector using the array data interface
-  *result = atof(buffer);
 }
 
+// Set the reply timeout and how many times a request is
+// retransmitted before it is reported as timed out
+void UDPserver::set_timeouts(int timeout_ms, int retries)
+{
+  timeoutMs = timeout_ms;
+  maxRetries = retries;
+}
 
+// Legacy JSON clients reply with a bare number per datagram
+// and no sequence number, so nothing can be retransmitted.
+// Every datagram of the reply is read even if one is bad, so
+// the rest are not taken as the answer to the next request.
+int UDPserver::receive_split(int count, v3 *result)
+{
+  int status = REQUEST_OK;
+  int64_t deadline = monotonic_us() + (int64_t)timeoutMs * 1000 * (1 << maxRetries);
+  for (int i = 0; i < count; i++) {
+    while (receive_reply() < 0) {
+      int64_t remaining = deadline - monotonic_us();
+      if (remaining <= 0 || !wait_readable((int)((remaining + 999) / 1000))) {
+        stats.timeouts++;
+        std::cerr << "WARNING: reply timed out" << std::endl;
+        return REQUEST_TIMEOUT;
+      }
+    }
+    // Store the data into the result vector using the array data interface
+    int error = decode_json_number(buffer, strlen(buffer), &result->data[i]);
+    if (error != DECODE_OK) {
+      std::cerr << "WARNING: malformed reply: " << decode_status_name(error) << std::endl;
+      stats.errors++;
+      result->data[i] = 0;
+      status = REQUEST_MALFORMED;
+    }
+  }
+  return status;
+}
 
+// Slot of a request id, critical ids have CRITICAL_ID_BIT set
+UDPserver::Slot &UDPserver::slot_for(uint32_t id)
+{
+  if (id & CRITICAL_ID_BIT)
+    return slots[MAX_IN_FLIGHT + id % CRITICAL_DEPTH];
+  return slots[id % MAX_IN_FLIGHT];
+}
 
-// There is a seperate instance of this function
-// for every connection made. It handles the communication
-// once a connection has been established.
-void UDPserver::transfer_data(std::string operation, std::string detail, v3 *result)
+// Take the slot for the next request id of a lane. A slot
+// still waiting on a reply from MAX_IN_FLIGHT requests ago, or
+// CRITICAL_DEPTH on the critical lane, is drained first so its
+// reply is not lost.
+UDPserver::Slot &UDPserver::acquire_slot(int opcode, double arg, ReplyHandler handler, int lane)
 {
-  int n;
-  cli_len = sizeof(cli_addr);
+  if (!lanes)
+    lane = LANE_BULK;
+  uint32_t id;
+  if (lane == LANE_CRITICAL) {
+    id = ((criticalSeq + 1) & ~CRITICAL_ID_BIT) | CRITICAL_ID_BIT;
+  }
+  else {
+    id = (seq + 1) & ~CRITICAL_ID_BIT;
+    // id zero is never used so a zeroed slot never matches
+    if (id == 0)
+      id = 1;
+  }
+  Slot &slot = slot_for(id);
+  while (slot.state == SLOT_PENDING)
+    pump();
+  if (lane == LANE_CRITICAL)
+    criticalSeq = id & ~CRITICAL_ID_BIT;
+  else
+    seq = id;
+  int64_t now = monotonic_us();
+  slot.id = id;
+  slot.opcode = opcode;
+  slot.arg = arg;
+  slot.codec = NULL;
+  slot.lane = lane;
+  slot.state = SLOT_PENDING;
+  slot.status = REQUEST_OK;
+  slot.attempts = 0;
+  slot.submittedUs = now;
+  slot.deadline = now + (int64_t)timeoutMs * 1000;
+  slot.handler = std::move(handler);
+  slot.stamped = false;
+  slot.simTime = 0;
+  slot.stateDst = NULL;
+  slot.kernelUs = 0;
+  slot.repliedUs = 0;
+  for (int i = 0; i < 3; i++)
+    slot.value.data[i] = 0;
+  return slot;
+}
 
-  // zero the buffer
-  memset(&buffer, 0, sizeof(buffer));
+// Store the outcome of a request and hand it to the handler
+// registered with the request, if any
+void UDPserver::complete(Slot &slot, int status, const v3 &value)
+{
+  LatencyStats &latency = laneStats[slot.lane];
+  LatencyStats *parts = roundTrips[slot.opcode];
+  // The handler may reuse the slot, what is timed after it
+  // returns is kept aside
+  int64_t repliedUs = slot.repliedUs;
+  if (status == REQUEST_OK) {
+    latency.record(monotonic_us() - slot.submittedUs);
+    // Karn's rule again, see dispatch
+    if (slot.attempts == 0)
+      parts[RTT_NETWORK].record(arrival_us(slot) - slot.sentUs);
+    if (slot.kernelUs != 0)
+      parts[RTT_QUEUE].record(slot.repliedUs - slot.kernelUs);
+  }
+  else if (status == REQUEST_TIMEOUT)
+    latency.timeouts++;
+  slot.value = value;
+  slot.status = status;
+  slot.state = SLOT_DONE;
+  if (slot.handler)
+    slot.handler(slot.id, status, slot.value);
+  if (status == REQUEST_OK && repliedUs != 0)
+    parts[RTT_PROCESS].record(monotonic_us() - repliedUs);
+}
 
-  // If the size of the data is greater than zero,
-  // copy into the buffer
-  // Build up the JSON string
-  std::string jsonbuffer = "{\"operation\":\"" + operation + "\",\"detail\":" + detail + "}";
-  strcpy(buffer,jsonbuffer.c_str());
-  // Request the data transaction from the client
-  //printf("Requesting data from client....\n");
-  if (debug) {
-    printf("Requesting data from client....\n");
-    printf("Attempting to write to socket...\n");
-    std::cout << "Writing data value : " << buffer << " to client" << std::endl;
+// Send anything queued, then wait until a datagram arrives
+// or the earliest deadline passes, whichever comes first
+void UDPserver::pump()
+{
+  // io_uring submits the queued requests with the same call
+  // that waits for the replies
+  if (!uring)
+    flush();
+  if (wait_readable(next_timeout()))
+    drain();
+  expire();
+}
+
+// Match the reply in the buffer to its request by sequence
+// number. Replies to requests that are no longer waiting,
+// because they were already answered or never sent, are
+// dropped rather than taken as the answer to a later request.
+void UDPserver::dispatch(char *data, int n, int64_t readUs, int64_t kernelUs)
+{
+  // Scene fragments complete their request from here
+  rxReadUs = readUs;
+  rxKernelUs = kernelUs;
+  WireReply reply;
+  int error;
+  int refused = DECODE_OK;	// why the decoder of a typed request refused the reply's value
+  if (wire == WIRE_BINARY) {
+    SceneFragment frag;
+    if (decode_scene_fragment(data, n, &frag)) {
+      dispatch_fragment(frag);
+      return;
+    }
+    SceneDeltaFragment delta;
+    if (decode_scene_delta(data, n, &delta)) {
+      dispatch_delta(delta);
+      return;
+    }
+    // Pushed telemetry answers no request, it goes straight
+    // to the cache
+    TelemetrySample sample;
+    if (decode_telemetry_frame(data, n, &sample)) {
+      sample.receivedUs = readUs;
+      if (!cache.publish(sample) && debug)
+        printf("Dropping stale telemetry frame %u\n", (unsigned)sample.frame);
+      return;
+    }
+    uint32_t stateSeq;
+    if (decode_vessel_state(data, n, &stateSeq, &sample)) {
+      dispatch_state(stateSeq, sample);
+      return;
+    }
+    // A typed request brings the decoder generated for its
+    // opcode, which refuses a reply of the wrong type outright
+    const WireCodec *codec = NULL;
+    if (n >= WIRE_HEADER_LEN) {
+      Slot &slot = slot_for(get32(data + 8));
+      if (slot.id == get32(data + 8) && slot.state == SLOT_PENDING)
+        codec = slot.codec;
+    }
+    error = codec != NULL ? codec->decode(data, n, &reply) : decode_binary_reply(data, n, &reply);
+    if (codec != NULL && (error == DECODE_BAD_TYPE || error == DECODE_BAD_NUMBER)) {
+      refused = error;
+      error = DECODE_OK;
+    }
+  }
+  else
+    error = decode_json_reply(data, n, &reply);
+  // Without a trustworthy sequence number the reply cannot be
+  // matched, the request is retransmitted when it times out
+  if (error != DECODE_OK) {
+    std::cerr << "WARNING: malformed reply dropped: " << decode_status_name(error) << std::endl;
+    dropped++;
+    return;
   }
-#ifdef _WIN32
-  n = sendto(socketS, buffer, sizeof(buffer), 0, (struct sockaddr *)&cli_addr, cli_len);
-#else
-  n = sendto(sockfd, &buffer, sizeof(buffer), 0, (struct sockaddr *)&cli_addr, cli_len);
-#endif
-  if (n < 0) error("ERROR writing to socket");
 
-  // Expect three responses from the client
-  for (int i = 0; i < 3; i++) {
-    // zero the buffer again
-    memset(buffer, 0, BUFLEN);
-    // Read the contents of the message into the buffer
-#ifdef _WIN32
-    n = recvfrom(socketS, buffer, BUFLEN - 1, 0, (sockaddr*)&cli_addr, &cli_len);
-#else
-    n = recvfrom(sockfd, buffer, BUFLEN - 1, 0, (struct sockaddr *)&cli_addr, &cli_len);
-#endif
-    if (n < 0) error("ERROR reading from socket");
+  Slot &slot = slot_for(reply.seq);
+  if (slot.id != reply.seq || slot.state != SLOT_PENDING ||
+      (wire == WIRE_BINARY && reply.opcode != slot.opcode)) {
     if (debug)
-      printf("Received packet from %s:%d\nData: %s\n\n", inet_ntoa(cli_addr.sin_addr), ntohs(cli_addr.sin_port), buffer);
-    // Store the data into the result vector using the array data interface
-    result->data[i] = atof(buffer);
+      printf("Dropping late or duplicate reply %u\n", (unsigned)reply.seq);
+    dropped++;
+    return;
+  }
+  // A well formed reply holding the wrong kind of value, or a
+  // number its type cannot hold, fails the request instead of
+  // reading as zero. Requests answered with a payload of their
+  // own never take a number.
+  int expected = opcode_reply_type(slot.opcode);
+  bool wrongType = expected == PAYLOAD_V3 ? reply.type != PAYLOAD_V3 :
+                   expected == PAYLOAD_DOUBLE ? reply.type != PAYLOAD_INT && reply.type != PAYLOAD_DOUBLE :
+                   true;
+  if (refused != DECODE_OK || wrongType) {
+    std::cerr << "WARNING: reply to " << opcode_name(slot.opcode) << " refused: "
+              << decode_status_name(wrongType ? DECODE_BAD_TYPE : refused) << std::endl;
+    v3 zero;
+    for (int i = 0; i < 3; i++)
+      zero.data[i] = 0;
+    complete(slot, REQUEST_MALFORMED, zero);
+    return;
+  }
+  slot.repliedUs = readUs;
+  slot.kernelUs = kernelUs;
+  slot.stamped = reply.stamped;
+  slot.simTime = reply.simTime;
+  // Karn's rule, a reply to a retransmitted request may answer
+  // any of its copies so it says nothing about the round trip
+  if (slot.opcode == SYNC_CLOCK && slot.attempts == 0)
+    clockSync.add(slot.sentUs, arrival_us(slot), reply.vvalue.x, reply.vvalue.y, reply.vvalue.z);
+  complete(slot, REQUEST_OK, reply.vvalue);
+}
+
+// Decode a GET_SCENE or GET_SCENE_NEAR fragment straight into its place in
+// the scene array, whatever order the fragments arrive in
+void UDPserver::dispatch_fragment(const SceneFragment &frag)
+{
+  Slot &slot = slot_for(frag.seq);
+  if (frag.seq != sceneId || slot.id != sceneId || slot.state != SLOT_PENDING) {
+    if (debug)
+      printf("Dropping stale fragment %u\n", (unsigned)frag.seq);
+    dropped++;
+    return;
+  }
+  // The first fragment to arrive sizes the scene, a total no
+  // real scene reaches is a corrupt or stray reply
+  if (sceneFragments == 0) {
+    if (frag.total > SCENE_MAX_OBJECTS) {
+      std::cerr << "WARNING: scene of " << frag.total << " objects refused" << std::endl;
+      v3 count;
+      count.x = count.y = count.z = 0;
+      complete(slot, REQUEST_MALFORMED, count);
+      return;
+    }
+    sceneFragments = frag.count;
+    sceneDst->resize(frag.total);
+    fragmentSeen.assign(sceneFragments, 0);
+  }
+  if (frag.count != sceneFragments || frag.total != (int)sceneDst->size()) {
+    std::cerr << "WARNING: inconsistent scene fragment" << std::endl;
+    dropped++;
+    return;
+  }
+  if (fragmentSeen[frag.index]) {
+    dropped++;
+    return;
+  }
+  for (int i = 0; i < frag.objects; i++)
+    decode_scene_object(frag.records + i * SCENE_RECORD_LEN, &(*sceneDst)[frag.first + i]);
+  fragmentSeen[frag.index] = 1;
+  sceneReceived++;
+  if (sceneReceived == sceneFragments) {
+    if (debug)
+      printf("Scene of %d objects in %d fragments\n", (int)sceneDst->size(), sceneFragments);
+    v3 count;
+    count.x = (double)sceneDst->size();
+    count.y = count.z = 0;
+    slot.repliedUs = rxReadUs;
+    slot.kernelUs = rxKernelUs;
+    complete(slot, REQUEST_OK, count);
   }
 }
+
+// Apply a GET_SCENE_DELTA fragment in place to the scene the
+// server keeps for them, and copy that to the caller's array
+// once whole. The caller may hand a different array each time.
+// The kept scene stops holding a whole frame as soon as the
+// first fragment is applied, so if any fragment is lost the
+// next request asks for a keyframe rather than a delta against
+// a half-updated scene.
+void UDPserver::dispatch_delta(const SceneDeltaFragment &frag)
+{
+  Slot &slot = slot_for(frag.seq);
+  if (frag.seq != sceneId || slot.id != sceneId || slot.state != SLOT_PENDING) {
+    if (debug)
+      printf("Dropping stale fragment %u\n", (unsigned)frag.seq);
+    dropped++;
+    return;
+  }
+  v3 count;
+  count.x = count.y = count.z = 0;
+  // The first fragment to arrive checks the frame against the
+  // one held, a keyframe sizes the scene
+  if (sceneFragments == 0) {
+    if (frag.base != 0 && (frag.base != sceneFrame || frag.total != (int)deltaBase.size())) {
+      std::cerr << "WARNING: scene delta against frame " << frag.base << " not held, resynchronising" << std::endl;
+      sceneFrame = 0;
+      complete(slot, REQUEST_MALFORMED, count);
+      return;
+    }
+    if (frag.base == 0 && frag.total > SCENE_MAX_OBJECTS) {
+      std::cerr << "WARNING: scene of " << frag.total << " objects refused" << std::endl;
+      sceneFrame = 0;
+      complete(slot, REQUEST_MALFORMED, count);
+      return;
+    }
+    if (frag.base == 0)
+      deltaBase.resize(frag.total);
+    sceneFragments = frag.count;
+    sceneNextFrame = frag.frame;
+    sceneFrame = 0;
+    fragmentSeen.assign(sceneFragments, 0);
+  }
+  // A retransmitted request may be answered with a later frame,
+  // its fragments cannot be mixed with this one's
+  if (frag.count != sceneFragments || frag.total != (int)deltaBase.size() || frag.frame != sceneNextFrame) {
+    std::cerr << "WARNING: inconsistent scene fragment" << std::endl;
+    dropped++;
+    return;
+  }
+  if (fragmentSeen[frag.index]) {
+    dropped++;
+    return;
+  }
+  if (!apply_scene_delta(frag, deltaBase.data(), (int)deltaBase.size())) {
+    std::cerr << "WARNING: malformed scene delta, resynchronising" << std::endl;
+    complete(slot, REQUEST_MALFORMED, count);
+    return;
+  }
+  fragmentSeen[frag.index] = 1;
+  sceneReceived++;
+  if (sceneReceived == sceneFragments) {
+    if (debug)
+      printf("Scene frame %u of %d objects in %d fragments, %s\n", (unsigned)frag.frame,
+             (int)deltaBase.size(), sceneFragments, frag.base == 0 ? "keyframe" : "delta");
+    sceneFrame = frag.frame;
+    *sceneDst = deltaBase;
+    count.x = (double)sceneDst->size();
+    slot.repliedUs = rxReadUs;
+    slot.kernelUs = rxKernelUs;
+    complete(slot, REQUEST_OK, count);
+  }
+}
+
+// Copy a GET_VESSEL_STATE reply to where its request asked.
+// The client took the whole state at one simulation time, which
+// stamps the reply.
+void UDPserver::dispatch_state(uint32_t seq, const TelemetrySample &state)
+{
+  Slot &slot = slot_for(seq);
+  if (slot.id != seq || slot.state != SLOT_PENDING || slot.opcode != GET_VESSEL_STATE) {
+    if (debug)
+      printf("Dropping late or duplicate reply %u\n", (unsigned)seq);
+    dropped++;
+    return;
+  }
+  if (slot.stateDst != NULL) {
+    *slot.stateDst = state;
+    slot.stateDst->frame = seq;
+    slot.stateDst->receivedUs = rxReadUs;
+  }
+  slot.repliedUs = rxReadUs;
+  slot.kernelUs = rxKernelUs;
+  slot.stamped = true;
+  slot.simTime = state.simTime;
+  complete(slot, REQUEST_OK, state.position);
+}
+
+// Send a request without waiting for its reply. The reply is
+// collected with wait() using the returned id, or passed to
+// the handler as soon as it is read.
+uint32_t UDPserver::submit(int opcode, double arg, ReplyHandler handler, int lane)
+{
+  return submit_request(opcode, arg, NULL, std::move(handler), lane);
+}
+
+// Shared by the untyped and typed submits, the codec of a typed
+// request is kept with it for retransmissions and the reply
+uint32_t UDPserver::submit_request(int opcode, double arg, const WireCodec *codec, ReplyHandler handler, int lane)
+{
+  CallTally tally(*this);
+  Slot &slot = acquire_slot(opcode, arg, std::move(handler), lane);
+  slot.codec = wire == WIRE_BINARY ? codec : NULL;
+  send_request(slot);
+  // Split replies carry no sequence number so they cannot
+  // be matched later, read them straight away
+  if (replies == REPLY_SPLIT) {
+    v3 value;
+    for (int i = 0; i < 3; i++)
+      value.data[i] = 0;
+    int status = receive_split(opcode_reply_type(opcode) == PAYLOAD_V3 ? 3 : 1, &value);
+    slot.repliedUs = monotonic_us();
+    complete(slot, status, value);
+  }
+  return slot.id;
+}
+
+// Request a snapshot of every object in the simulation with
+// one GET_SCENE request, decoded into the scene array as the
+// fragments arrive. Only one scene is reassembled at a time.
+// With a query the client sends only the objects inside it,
+// in a GET_SCENE_NEAR reply. Otherwise, if the client sends
+// delta frames, only the changes since the last whole frame
+// are requested, whichever array that was copied to.
+uint32_t UDPserver::submit_scene(std::vector<SceneObject> *scene, const SceneQuery *query)
+{
+  CallTally tally(*this);
+  if (sceneDst != NULL)
+    wait(sceneId);
+  int opcode = query != NULL ? GET_SCENE_NEAR : GET_SCENE;
+  if (wire != WIRE_BINARY) {
+    // Poll before taking the slot, the per-object requests
+    // need slots of their own
+    int status = poll_scene(scene, query);
+    Slot &slot = acquire_slot(opcode, 0, ReplyHandler());
+    v3 count;
+    count.x = (double)scene->size();
+    count.y = count.z = 0;
+    complete(slot, status, count);
+    return slot.id;
+  }
+  double base = 0;
+  if (query == NULL && deltaScenes) {
+    opcode = GET_SCENE_DELTA;
+    base = sceneFrame;
+  }
+  Slot &slot = acquire_slot(opcode, base, ReplyHandler());
+  if (query != NULL)
+    slot.query = *query;
+  sceneId = slot.id;
+  sceneDst = scene;
+  sceneFragments = sceneReceived = 0;
+  send_request(slot);
+  return slot.id;
+}
+
+// Check without blocking if a request has been answered
+bool UDPserver::ready(uint32_t id)
+{
+  Slot &slot = slot_for(id);
+  return slot.id != id || slot.state != SLOT_PENDING;
+}
+
+// Block until the reply to a request arrives or it times
+// out, replies to other requests read in the meantime are
+// kept for them. Returns a RequestStatus.
+int UDPserver::wait(uint32_t id, v3 *result)
+{
+  CallTally tally(*this);
+  Slot &slot = slot_for(id);
+  while (slot.id == id && slot.state == SLOT_PENDING)
+    pump();
+  if (id == sceneId)
+    sceneDst = NULL;
+  if (slot.id != id) {
+    std::cerr << "WARNING: reply to request " << id << " was overwritten" << std::endl;
+    for (int i = 0; i < 3; i++)
+      result->data[i] = 0;
+    return REQUEST_FAILED;
+  }
+  *result = slot.value;
+  slot.state = SLOT_FREE;
+  return slot.status;
+}
+
+int UDPserver::wait(uint32_t id)
+{
+  v3 value;
+  return wait(id, &value);
+}
+
+// A value that does not fit an int, which only a JSON or
+// untyped reply can carry this far, fails the request
+int UDPserver::wait(uint32_t id, int *result)
+{
+  v3 value;
+  int status = wait(id, &value);
+  if (!int_from_double(value.x, result) && status == REQUEST_OK)
+    status = REQUEST_MALFORMED;
+  return status;
+}
+
+int UDPserver::wait(uint32_t id, double *result)
+{
+  v3 value;
+  int status = wait(id, &value);
+  *result = value.x;
+  return status;
+}
+
+// Also return when the value was taken, in simulation time if
+// the client stamped it or the clock is synced, otherwise in
+// seconds of the local steady clock. Only differences between
+// times from the same source are meaningful.
+int UDPserver::wait(uint32_t id, v3 *result, double *simTime)
+{
+  int status = wait(id, result);
+  *simTime = status == REQUEST_OK ? reply_time(slot_for(id)) : 0;
+  return status;
+}
+
+// Time a reply's value was taken. An unstamped value is placed
+// halfway through its round trip.
+double UDPserver::reply_time(const Slot &slot) const
+{
+  if (slot.stamped)
+    return slot.simTime;
+  int64_t midpoint = slot.sentUs + (arrival_us(slot) - slot.sentUs) / 2;
+  if (clockSync.synced())
+    return clockSync.sim_time(midpoint);
+  return midpoint / 1e6;
+}
+
+// Block until every request sent so far has been answered
+// or has timed out
+void UDPserver::wait_all()
+{
+  CallTally tally(*this);
+  for (int i = 0; i < MAX_IN_FLIGHT + CRITICAL_DEPTH; i++) {
+    while (slots[i].state == SLOT_PENDING)
+      pump();
+  }
+  sceneDst = NULL;
+}
+
+// Fetch a snapshot of every object in the simulation, or
+// of those inside the query region if one is given
+int UDPserver::get_scene(std::vector<SceneObject> *scene, const SceneQuery *query)
+{
+  return wait(submit_scene(scene, query));
+}
+
+// JSON clients do not know GET_SCENE, build the same
+// snapshot by asking for every object in turn. They do not
+// know GET_SCENE_NEAR either, so a query is applied here,
+// which saves the collision checks but not the requests.
+int UDPserver::poll_scene(std::vector<SceneObject> *scene, const SceneQuery *query)
+{
+  int num_obj = 0;
+  int status = request<GET_OBJ_COUNT>(0, &num_obj);
+  if (status != REQUEST_OK) {
+    scene->clear();
+    return status;
+  }
+  // The same bound as a binary scene, a count no real scene
+  // reaches is a corrupt reply
+  if (num_obj < 0 || num_obj > SCENE_MAX_OBJECTS) {
+    std::cerr << "WARNING: scene of " << num_obj << " objects refused" << std::endl;
+    scene->clear();
+    return REQUEST_MALFORMED;
+  }
+  scene->resize(num_obj);
+  for (int i = 0; i < num_obj; i++) {
+    SceneObject &object = (*scene)[i];
+    object.id = i;
+    int results[3];
+    results[0] = request<IS_VESSEL>(i, &object.isVessel);
+    results[1] = request<GET_POS>(i, &object.position);
+    results[2] = request<GET_SIZE>(i, &object.radius);
+    for (int r = 0; r < 3; r++) {
+      if (results[r] != REQUEST_OK)
+        status = results[r];
+    }
+  }
+  if (query == NULL || status != REQUEST_OK)
+    return status;
+  v3 origin;
+  status = request<GET_POS>(0, &origin);
+  if (status != REQUEST_OK)
+    return status;
+  size_t kept = 0;
+  for (size_t i = 0; i < scene->size(); i++) {
+    if (scene_query_match(*query, origin, (*scene)[i]))
+      (*scene)[kept++] = (*scene)[i];
+  }
+  scene->resize(kept);
+  return status;
+}
+
+// Ask the client to stream the vessel state at the given rate,
+// zero stops the stream. Frames land in the telemetry cache
+// whenever the socket is drained. Only the binary encoding
+// carries telemetry frames.
+int UDPserver::subscribe(double rate_hz)
+{
+  if (wire != WIRE_BINARY)
+    return REQUEST_FAILED;
+  double rate;
+  return request<SUBSCRIBE>(rate_hz, &rate);
+}
+
+// Exchange timestamps with the client to refine the mapping of
+// the local clock onto simulation time and the round trip
+// estimate, see ClockSync. The request is sent straight away
+// rather than batched so its send time is exact. Legacy split
+// replies cannot carry the exchange.
+int UDPserver::sync_clock()
+{
+  if (replies == REPLY_SPLIT)
+    return REQUEST_FAILED;
+  Ticket<SYNC_CLOCK> ticket = submit<SYNC_CLOCK>(0);
+  flush();
+  return wait(ticket);
+}
+
+// Send every actuator command of a control tick as one frame,
+// applied by the client as a unit and acknowledged with one
+// reply holding the bank, pitch and yaw RCS levels
+uint32_t UDPserver::submit_actuators(const ActuatorFrame &frame, ReplyHandler handler, int lane)
+{
+  CallTally tally(*this);
+  Slot &slot = acquire_slot(SET_ACTUATORS, 0, std::move(handler), lane);
+  slot.actuators = frame;
+  send_request(slot);
+  return slot.id;
+}
+
+// Ask for the whole state of the vessel in one request. The
+// reply is copied to the state as soon as it is read, which
+// must stay valid until then, and the value passed to the
+// handler is the position. Binary encoding only.
+uint32_t UDPserver::submit_vessel_state(TelemetrySample *state, ReplyHandler handler, int lane)
+{
+  CallTally tally(*this);
+  Slot &slot = acquire_slot(GET_VESSEL_STATE, 0, std::move(handler), lane);
+  slot.stateDst = state;
+  send_request(slot);
+  return slot.id;
+}
+
+// Fetch the position, attitude, angular velocity and airspeed
+// of the vessel as they were at one simulation time, in one
+// round trip. A client that turns GET_VESSEL_STATE down, or
+// has never answered it and lets it time out, is asked for
+// each part instead from then on.
+int UDPserver::get_vessel_state(TelemetrySample *state)
+{
+  if (stateRequests) {
+    int status = wait(submit_vessel_state(state));
+    if (status == REQUEST_OK)
+      stateAnswered = true;
+    if (status != REQUEST_MALFORMED && (status != REQUEST_TIMEOUT || stateAnswered))
+      return status;
+    std::cerr << "WARNING: client does not answer GET_VESSEL_STATE, fetching the state in parts" << std::endl;
+    stateRequests = false;
+  }
+  return poll_vessel_state(state);
+}
+
+// JSON clients have no GET_VESSEL_STATE, every part of the
+// state is asked for at once so they still cost one round
+// trip. The parts are taken at slightly different times, the
+// state carries the time of the position.
+int UDPserver::poll_vessel_state(TelemetrySample *state)
+{
+  Ticket<GET_POS> position = submit<GET_POS>(0);
+  Ticket<GET_ANG_VEL> angularVelocity = submit<GET_ANG_VEL>(0);
+  Ticket<GET_AIRSPEED> airspeed = submit<GET_AIRSPEED>(0);
+  Ticket<GET_PITCH> pitch = submit<GET_PITCH>(0);
+  Ticket<GET_BANK> bank = submit<GET_BANK>(0);
+  Ticket<GET_YAW> yaw = submit<GET_YAW>(0);
+  int results[6];
+  results[0] = wait(position, &state->position, &state->simTime);
+  results[1] = wait(angularVelocity, &state->angularVelocity);
+  results[2] = wait(airspeed, &state->airspeed);
+  results[3] = wait(pitch, &state->pitch);
+  results[4] = wait(bank, &state->bank);
+  results[5] = wait(yaw, &state->yaw);
+  state->frame = position.id;
+  state->receivedUs = monotonic_us();
+  int status = REQUEST_OK;
+  for (int i = 0; i < 6; i++) {
+    if (results[i] != REQUEST_OK)
+      status = results[i];
+  }
+  return status;
+}
+
+// Apply an actuator frame and wait for its acknowledgement.
+// JSON clients have no SET_ACTUATORS, so they are sent the
+// individual commands in the order the client would apply them.
+// They all go out before the first acknowledgement is waited on,
+// so the frame still costs one round trip.
+int UDPserver::apply_actuators(const ActuatorFrame &frame, v3 *rcs, int lane)
+{
+  if (wire == WIRE_BINARY)
+    return wait(submit_actuators(frame, ReplyHandler(), lane), rcs);
+
+  Ticket<STOP_THRUST> stop;
+  Ticket<SET_BANK> bank;
+  Ticket<SET_PITCH> pitch;
+  Ticket<SET_YAW> yaw;
+  Ticket<SET_THRUST> thrust;
+  if (frame.flags & ACT_STOP_THRUST)
+    stop = submit<STOP_THRUST>(0, ReplyHandler(), lane);
+  if (frame.flags & ACT_BANK)
+    bank = submit<SET_BANK>(frame.bank, ReplyHandler(), lane);
+  if (frame.flags & ACT_PITCH)
+    pitch = submit<SET_PITCH>(frame.pitch, ReplyHandler(), lane);
+  if (frame.flags & ACT_YAW)
+    yaw = submit<SET_YAW>(frame.yaw, ReplyHandler(), lane);
+  if (frame.flags & ACT_THRUST)
+    thrust = submit<SET_THRUST>(frame.thrust, ReplyHandler(), lane);
+
+  int status = REQUEST_OK;
+  int result;
+  if (frame.flags & ACT_STOP_THRUST) {
+    result = wait(stop);
+    if (result != REQUEST_OK) status = result;
+  }
+  if (frame.flags & ACT_BANK) {
+    result = wait(bank, &rcs->x);
+    if (result != REQUEST_OK) status = result;
+  }
+  if (frame.flags & ACT_PITCH) {
+    result = wait(pitch, &rcs->y);
+    if (result != REQUEST_OK) status = result;
+  }
+  if (frame.flags & ACT_YAW) {
+    result = wait(yaw, &rcs->z);
+    if (result != REQUEST_OK) status = result;
+  }
+  if (frame.flags & ACT_THRUST) {
+    result = wait(thrust);
+    if (result != REQUEST_OK) status = result;
+  }
+  return status;
+}
+
+// Add one answered request
+void LatencyStats::record(int64_t us)
+{
+  if (us < 0)
+    us = 0;
+  completed++;
+  totalUs += us;
+  if (us > maxUs)
+    maxUs = us;
+  int bucket = 0;
+  while (bucket < LATENCY_BUCKETS - 1 && (us >> (bucket + 1)) != 0)
+    bucket++;
+  buckets[bucket]++;
+}
+
+// Latency below which the given fraction of the answered
+// requests fell, rounded up to the end of its bucket
+int64_t LatencyStats::percentile_us(double fraction) const
+{
+  if (completed == 0)
+    return 0;
+  unsigned long rank = (unsigned long)(fraction * completed);
+  unsigned long seen = 0;
+  for (int i = 0; i < LATENCY_BUCKETS; i++) {
+    seen += buckets[i];
+    if (seen > rank || seen == completed) {
+      int64_t bound = (int64_t)1 << (i + 1);
+      return bound < maxUs ? bound : maxUs;
+    }
+  }
+  return maxUs;
+}
+
+#ifndef _WIN32
+// Read the steady clock and the clock of the kernel's receive
+// timestamps back to back
+RxClock rx_clock()
+{
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  RxClock clock;
+  clock.steadyUs = monotonic_us();
+  clock.realNs = (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+  return clock;
+}
+
+// Have the kernel stamp every datagram the socket receives.
+// The stamp is read back with the datagram, see kernel_receive_us
+bool enable_rx_timestamps(int fd)
+{
+  int on = 1;
+  return setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on)) == 0;
+}
+
+// Give a message header room for the ancillary data of the
+// datagram. The kernel shrinks the length on every read, so
+// it is reset before each one.
+void attach_rx_control(struct msghdr *msg, char *control)
+{
+  msg->msg_control = control;
+  msg->msg_controllen = RX_CONTROL_LEN;
+}
+
+// Steady clock time the kernel received a datagram, from its
+// timestamp and a reading of both clocks taken after it was
+// read. Zero if the datagram carries no timestamp.
+int64_t kernel_receive_us(struct msghdr *msg, const RxClock &clock)
+{
+  for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+    if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_TIMESTAMPNS)
+      continue;
+    struct timespec stamp;
+    memcpy(&stamp, CMSG_DATA(cmsg), sizeof(stamp));
+    int64_t waitedNs = clock.realNs - ((int64_t)stamp.tv_sec * 1000000000 + stamp.tv_nsec);
+    // A step of the wall clock in between makes the stamp useless
+    if (waitedNs < 0)
+      return 0;
+    return clock.steadyUs - waitedNs / 1000;
+  }
+  return 0;
+}
+#endif
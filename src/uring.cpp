@@ -0,0 +1,398 @@
+// ==============================================================
+//                  ORBITER MODULE: Rcontrol
+//
+// uring.cpp
+//
+// io_uring backend for the UDP socket, driven through raw
+// system calls.
+// ==============================================================
+
+#include "uring.h"
+#include <string.h>
+#include <errno.h>
+#if !defined(_WIN32) && defined(__has_include)
+# if __has_include(<linux/io_uring.h>)
+#  include <linux/io_uring.h>
+# endif
+#endif
+// Multishot receives and provided buffer rings need Linux 6.0
+#ifdef IORING_RECV_MULTISHOT
+# define HAVE_URING 1
+# include <unistd.h>
+# include <signal.h>
+# include <sys/mman.h>
+# include <sys/syscall.h>
+# include <linux/time_types.h>
+#endif
+
+#define URING_RECV_TAG 0xffffffffffffffffULL	// user_data of the multishot receive
+#define URING_BUF_GROUP 0
+// Each provided buffer holds the recvmsg header, the source
+// address and the payload, plus a byte to terminate text
+#ifdef HAVE_URING
+# define URING_BUF_LEN (sizeof(struct io_uring_recvmsg_out) + sizeof(struct sockaddr_in) + URING_RECV_LEN + 1)
+#endif
+
+/**
+ * @brief Constructor for a closed backend
+ */
+UringSocket::UringSocket()
+  : ringfd(-1), rings(NULL), ringsLen(0), sqes(NULL), sqesLen(0),
+    bufRing(NULL), bufRingLen(0), recvBufs(NULL), bufTail(0), heldBuffer(-1),
+    nextSend(0), sendErrors(0)
+{
+  memset(sendBusy, 0, sizeof(sendBusy));
+}
+
+/**
+ * @brief Destructor, tears down the ring and its buffers
+ */
+UringSocket::~UringSocket()
+{
+#ifdef HAVE_URING
+  if (ringfd >= 0) {
+    // Ring teardown is asynchronous, so cancel the receive and
+    // drop the registered socket now, otherwise the port stays
+    // bound for a while after the socket is closed
+    struct io_uring_sync_cancel_reg cancel;
+    memset(&cancel, 0, sizeof(cancel));
+    cancel.addr = URING_RECV_TAG;
+    cancel.timeout.tv_sec = -1;
+    cancel.timeout.tv_nsec = -1;
+    syscall(__NR_io_uring_register, ringfd, IORING_REGISTER_SYNC_CANCEL, &cancel, 1);
+    syscall(__NR_io_uring_register, ringfd, IORING_UNREGISTER_FILES, NULL, 0);
+    close(ringfd);
+  }
+  if (rings != NULL)
+    munmap(rings, ringsLen);
+  if (sqes != NULL)
+    munmap(sqes, sqesLen);
+  if (bufRing != NULL)
+    munmap(bufRing, bufRingLen);
+  delete[] recvBufs;
+#endif
+}
+
+/**
+ * Set up the ring, register the socket and the receive buffers
+ * and start the multishot receive. Fails on kernels without
+ * io_uring, without multishot receives or where io_uring is
+ * disabled, in which case the socket is left untouched.
+ * @brief Drive a socket through io_uring
+ * @param sockfd Bound, non-blocking UDP socket
+ * @return false if io_uring cannot be used
+ */
+bool UringSocket::open(int sockfd)
+{
+#ifndef HAVE_URING
+  (void)sockfd;
+  return false;
+#else
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  ringfd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+  if (ringfd < 0)
+    return false;
+  // One mapping for both rings and timeouts on enter, Linux 5.11
+  if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_EXT_ARG))
+    return false;
+
+  size_t sqLen = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  size_t cqLen = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  ringsLen = sqLen > cqLen ? sqLen : cqLen;
+  rings = mmap(NULL, ringsLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringfd, IORING_OFF_SQ_RING);
+  if (rings == MAP_FAILED) {
+    rings = NULL;
+    return false;
+  }
+  sqesLen = params.sq_entries * sizeof(struct io_uring_sqe);
+  sqes = (struct io_uring_sqe *)mmap(NULL, sqesLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringfd, IORING_OFF_SQES);
+  if (sqes == MAP_FAILED) {
+    sqes = NULL;
+    return false;
+  }
+  char *base = (char *)rings;
+  sqHead = (unsigned *)(base + params.sq_off.head);
+  sqTail = (unsigned *)(base + params.sq_off.tail);
+  sqMask = (unsigned *)(base + params.sq_off.ring_mask);
+  sqArray = (unsigned *)(base + params.sq_off.array);
+  sqLocalTail = *sqTail;
+  cqHead = (unsigned *)(base + params.cq_off.head);
+  cqTail = (unsigned *)(base + params.cq_off.tail);
+  cqMask = (unsigned *)(base + params.cq_off.ring_mask);
+  cqes = (struct io_uring_cqe *)(base + params.cq_off.cqes);
+
+  // The socket is registered so each request skips the file
+  // table lookup
+  int fd = sockfd;
+  if (syscall(__NR_io_uring_register, ringfd, IORING_REGISTER_FILES, &fd, 1) < 0)
+    return false;
+
+  // Register the ring of buffers the kernel picks from for
+  // every datagram the multishot receive completes
+  bufRingLen = URING_RECV_BUFS * sizeof(struct io_uring_buf);
+  void *ring = mmap(NULL, bufRingLen, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (ring == MAP_FAILED)
+    return false;
+  bufRing = (struct io_uring_buf_ring *)ring;
+  struct io_uring_buf_reg reg;
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = (uint64_t)(uintptr_t)bufRing;
+  reg.ring_entries = URING_RECV_BUFS;
+  reg.bgid = URING_BUF_GROUP;
+  if (syscall(__NR_io_uring_register, ringfd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+    return false;
+  recvBufs = new char[URING_RECV_BUFS * URING_BUF_LEN];
+  for (int i = 0; i < URING_RECV_BUFS; i++) {
+    heldBuffer = i;
+    release();
+  }
+
+  memset(&recvHdr, 0, sizeof(recvHdr));
+  recvHdr.msg_namelen = sizeof(struct sockaddr_in);
+  for (int i = 0; i < URING_SEND_SLOTS; i++) {
+    memset(&sendHdrs[i], 0, sizeof(sendHdrs[i]));
+    sendIov[i].iov_base = sendBufs[i];
+    sendHdrs[i].msg_iov = &sendIov[i];
+    sendHdrs[i].msg_iovlen = 1;
+    sendHdrs[i].msg_name = &sendAddrs[i];
+  }
+  if (!arm_receive() || submit() < 0)
+    return false;
+  return true;
+#endif
+}
+
+#ifdef HAVE_URING
+/**
+ * @brief Call io_uring_enter
+ * @return Number of SQEs consumed, or -1 with errno set
+ */
+int UringSocket::enter(unsigned to_submit, unsigned min_complete, unsigned flags, const void *arg, size_t argsz)
+{
+  return (int)syscall(__NR_io_uring_enter, ringfd, to_submit, min_complete, flags, arg, argsz);
+}
+
+/**
+ * @brief Take the next free submission queue entry, zeroed
+ * @return Entry to fill in, NULL if the queue is full
+ */
+struct io_uring_sqe *UringSocket::get_sqe()
+{
+  unsigned head = __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+  if (sqLocalTail - head >= URING_ENTRIES) {
+    // Make room by handing the queued entries to the kernel
+    if (submit() < 0)
+      return NULL;
+    head = __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+    if (sqLocalTail - head >= URING_ENTRIES)
+      return NULL;
+  }
+  unsigned index = sqLocalTail & *sqMask;
+  struct io_uring_sqe *sqe = &sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+  sqArray[index] = index;
+  sqLocalTail++;
+  return sqe;
+}
+
+/**
+ * A multishot receive stays active across datagrams and only
+ * ends when the provided buffers run out, it is then re-armed.
+ * @brief Queue the multishot receive
+ * @return false if the submission queue is full
+ */
+bool UringSocket::arm_receive()
+{
+  struct io_uring_sqe *sqe = get_sqe();
+  if (sqe == NULL)
+    return false;
+  sqe->opcode = IORING_OP_RECVMSG;
+  sqe->fd = 0;	// index of the registered socket
+  sqe->flags = IOSQE_FIXED_FILE | IOSQE_BUFFER_SELECT;
+  sqe->addr = (uint64_t)(uintptr_t)&recvHdr;
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->buf_group = URING_BUF_GROUP;
+  sqe->user_data = URING_RECV_TAG;
+  return true;
+}
+#endif
+
+/**
+ * The slot is taken round robin and is free again once the
+ * kernel reports its send complete
+ * @brief Get the buffer to encode the next request into
+ * @return Buffer of URING_SEND_LEN bytes, NULL if every slot is in flight
+ */
+char *UringSocket::send_buffer()
+{
+  if (sendBusy[nextSend])
+    return NULL;
+  return sendBufs[nextSend];
+}
+
+/**
+ * @brief Queue the request in the last send_buffer() for the next submit()
+ * @param len Bytes to send
+ * @param addr Destination address
+ * @param addrlen Length of the address
+ * @return false if the submission queue is full
+ */
+bool UringSocket::queue_send(size_t len, const struct sockaddr_in *addr, socklen_t addrlen)
+{
+#ifndef HAVE_URING
+  (void)len;
+  (void)addr;
+  (void)addrlen;
+  return false;
+#else
+  struct io_uring_sqe *sqe = get_sqe();
+  if (sqe == NULL)
+    return false;
+  int slot = nextSend;
+  sendIov[slot].iov_len = len;
+  sendAddrs[slot] = *addr;
+  sendHdrs[slot].msg_namelen = addrlen;
+  sqe->opcode = IORING_OP_SENDMSG;
+  sqe->fd = 0;
+  sqe->flags = IOSQE_FIXED_FILE;
+  sqe->addr = (uint64_t)(uintptr_t)&sendHdrs[slot];
+  sqe->len = 1;
+  sqe->user_data = slot;
+  sendBusy[slot] = true;
+  nextSend = (nextSend + 1) % URING_SEND_SLOTS;
+  return true;
+#endif
+}
+
+/**
+ * @brief Hand every queued entry to the kernel in one call
+ * @return Number of io_uring_enter calls made, -1 on failure
+ */
+int UringSocket::submit()
+{
+#ifndef HAVE_URING
+  return -1;
+#else
+  unsigned pending = sqLocalTail - *sqTail;
+  if (pending == 0)
+    return 0;
+  __atomic_store_n(sqTail, sqLocalTail, __ATOMIC_RELEASE);
+  if (enter(pending, 0, 0, NULL, 0) < 0)
+    return -1;
+  return 1;
+#endif
+}
+
+/**
+ * Submits anything queued with the same call, so sending a
+ * tick's requests and waiting for the first reply is one
+ * system call
+ * @brief Wait for a completion
+ * @param timeout_ms Longest wait in milliseconds, negative to wait forever
+ * @return true if a completion is waiting
+ */
+bool UringSocket::wait(int timeout_ms)
+{
+#ifndef HAVE_URING
+  (void)timeout_ms;
+  return false;
+#else
+  if (__atomic_load_n(cqTail, __ATOMIC_ACQUIRE) != *cqHead)
+    return true;
+  unsigned pending = sqLocalTail - *sqTail;
+  __atomic_store_n(sqTail, sqLocalTail, __ATOMIC_RELEASE);
+  struct __kernel_timespec ts;
+  ts.tv_sec = timeout_ms / 1000;
+  ts.tv_nsec = (long long)(timeout_ms % 1000) * 1000000;
+  struct io_uring_getevents_arg arg;
+  memset(&arg, 0, sizeof(arg));
+  arg.sigmask_sz = _NSIG / 8;
+  if (timeout_ms >= 0)
+    arg.ts = (uint64_t)(uintptr_t)&ts;
+  enter(pending, timeout_ms == 0 ? 0 : 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+  return __atomic_load_n(cqTail, __ATOMIC_ACQUIRE) != *cqHead;
+#endif
+}
+
+/**
+ * Walks the completion queue, freeing the slots of finished
+ * sends and re-arming the receive if it stopped, until a
+ * datagram is found. The datagram stays in its buffer until
+ * release() is called.
+ * @brief Get the next received datagram
+ * @param *len Pointer to store the payload length to
+ * @param *from Pointer to store the source address to
+ * @return Payload, terminated one byte past its length, NULL if none
+ */
+char *UringSocket::next_datagram(size_t *len, struct sockaddr_in *from)
+{
+#ifndef HAVE_URING
+  (void)len;
+  (void)from;
+  return NULL;
+#else
+  unsigned head = *cqHead;
+  while (head != __atomic_load_n(cqTail, __ATOMIC_ACQUIRE)) {
+    struct io_uring_cqe cqe = cqes[head & *cqMask];
+    head++;
+    __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+    if (cqe.user_data != URING_RECV_TAG) {
+      sendBusy[cqe.user_data] = false;
+      if (cqe.res < 0)
+        sendErrors++;
+      continue;
+    }
+    // Out of buffers or failed, start it again, it is
+    // submitted with the next enter
+    if (!(cqe.flags & IORING_CQE_F_MORE))
+      arm_receive();
+    if (cqe.res < 0 || !(cqe.flags & IORING_CQE_F_BUFFER))
+      continue;
+    heldBuffer = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+    char *buf = recvBufs + (size_t)heldBuffer * URING_BUF_LEN;
+    struct io_uring_recvmsg_out *out = (struct io_uring_recvmsg_out *)buf;
+    char *payload = buf + sizeof(*out) + recvHdr.msg_namelen;
+    if (out->flags & MSG_TRUNC) {
+      release();
+      continue;
+    }
+    memcpy(from, buf + sizeof(*out), sizeof(*from));
+    *len = out->payloadlen;
+    payload[*len] = 0;
+    return payload;
+  }
+  return NULL;
+#endif
+}
+
+/**
+ * @brief Count of failed sends since the last call
+ * @return Sends the kernel reported failed
+ */
+unsigned long UringSocket::take_send_errors()
+{
+  unsigned long n = sendErrors;
+  sendErrors = 0;
+  return n;
+}
+
+/**
+ * @brief Give the buffer of the last datagram back to the kernel
+ */
+void UringSocket::release()
+{
+#ifdef HAVE_URING
+  if (heldBuffer < 0)
+    return;
+  // Indexed by hand, in C++ the flexible array in the kernel
+  // header is laid out after a padded empty struct
+  struct io_uring_buf *buf = (struct io_uring_buf *)bufRing + (bufTail & (URING_RECV_BUFS - 1));
+  buf->addr = (uint64_t)(uintptr_t)(recvBufs + (size_t)heldBuffer * URING_BUF_LEN);
+  buf->len = URING_BUF_LEN - 1;
+  buf->bid = (uint16_t)heldBuffer;
+  bufTail++;
+  __atomic_store_n(&bufRing->tail, bufTail, __ATOMIC_RELEASE);
+  heldBuffer = -1;
+#endif
+}
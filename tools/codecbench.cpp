@@ -0,0 +1,103 @@
+// ==============================================================
+//                  ORBITER MODULE: Rcontrol
+//
+// codecbench.cpp
+//
+// Benchmark of the binary request codecs. Every iteration
+// encodes a request and decodes a reply to it into the type the
+// caller wants, once through the generic encode_request and
+// decode_binary_reply path with the runtime checks the server
+// makes, and once through the RequestCodec of the opcode.
+// ==============================================================
+
+#include "requests.h"
+#include "telemetry.h"
+#include <iostream>
+
+#define ITERATIONS 10000000
+
+static volatile double sink;	// keeps the decoded values alive
+
+/**
+ * @brief Build an unstamped reply of the given payload type
+ * @return Length of the reply
+ */
+static int make_reply(int opcode, int type, char *buf)
+{
+  int length = type == PAYLOAD_V3 ? 24 : type == PAYLOAD_DOUBLE ? 8 : 4;
+  put16(buf, WIRE_MAGIC);
+  buf[2] = (char)WIRE_VERSION;
+  buf[3] = (char)opcode;
+  buf[4] = (char)type;
+  buf[5] = 0;
+  put16(buf + 6, (uint16_t)length);
+  put32(buf + 8, 1);
+  for (int i = 0; i < length / 8; i++)
+    putDouble(buf + WIRE_HEADER_LEN + 8 * i, 1.5 + i);
+  if (length == 4)
+    put32(buf + WIRE_HEADER_LEN, 1);
+  return WIRE_HEADER_LEN + length;
+}
+
+// Destination conversions made by the untyped wait() overloads
+static void store(const WireReply &reply, v3 *result) { *result = reply.vvalue; }
+static void store(const WireReply &reply, double *result) { *result = reply.vvalue.x; }
+static void store(const WireReply &reply, int *result) { *result = (int)reply.vvalue.x; }
+static double value_of(const v3 &v) { return v.x + v.y + v.z; }
+static double value_of(double d) { return d; }
+
+/**
+ * @brief Time the generic and generated codecs on one opcode
+ */
+template <int Opcode>
+static void run(const char *name)
+{
+  typedef typename RequestTraits<Opcode>::Arg Arg;
+  typedef typename RequestTraits<Opcode>::Reply Reply;
+  char request[64], reply[64];
+  int replyLen = make_reply(Opcode, PayloadOf<Reply>::type, reply);
+  double total = 0;
+
+  int64_t start = monotonic_us();
+  for (int i = 0; i < ITERATIONS; i++) {
+    total += encode_request(WIRE_BINARY, Opcode, (Arg)i, i, request, sizeof(request));
+    WireReply decoded;
+    Reply value;
+    if (decode_binary_reply(reply, replyLen, &decoded) == DECODE_OK && decoded.opcode == Opcode) {
+      bool vector = opcode_reply_type(decoded.opcode) == PAYLOAD_V3;
+      if (vector ? decoded.type == PAYLOAD_V3 : decoded.type == PAYLOAD_INT || decoded.type == PAYLOAD_DOUBLE) {
+        store(decoded, &value);
+        total += value_of(value);
+      }
+    }
+  }
+  int64_t generic = monotonic_us() - start;
+  sink = total;
+
+  total = 0;
+  start = monotonic_us();
+  for (int i = 0; i < ITERATIONS; i++) {
+    total += RequestCodec<Opcode>::encode((Arg)i, i, request, sizeof(request));
+    uint32_t seq;
+    Reply value;
+    bool stamped;
+    double simTime;
+    if (RequestCodec<Opcode>::decode(reply, replyLen, &seq, &value, &stamped, &simTime) == DECODE_OK)
+      total += value_of(value);
+  }
+  int64_t typed = monotonic_us() - start;
+  sink = total;
+
+  printf("%-14s generic %6.1f ns  typed %6.1f ns per request and reply\n", name,
+         generic * 1000.0 / ITERATIONS, typed * 1000.0 / ITERATIONS);
+}
+
+int main()
+{
+  printf("%d requests encoded and replies decoded per opcode\n", ITERATIONS);
+  run<GET_POS>("GET_POS");
+  run<GET_BANK>("GET_BANK");
+  run<IS_VESSEL>("IS_VESSEL");
+  run<SET_PITCH>("SET_PITCH");
+  return 0;
+}
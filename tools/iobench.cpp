@@ -0,0 +1,145 @@
+// ==============================================================
+//                  ORBITER MODULE: Rcontrol
+//
+// iobench.cpp
+//
+// Loopback benchmark of the UDPserver socket backends. A child
+// process stands in for the client and answers every request,
+// the server sends a tick of requests and waits for all their
+// replies, and the wall time, the server's CPU time and system
+// calls per tick are reported for each backend and number of
+// outstanding requests. The sendto rows are the unbatched path
+// and the sendmmsg rows the batched one.
+// ==============================================================
+
+#include "udpserver.h"
+#include <iostream>
+#include <signal.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#define TICKS 2000
+
+/**
+ * @brief Answer every binary request with a zeroed reply of its type
+ */
+static void run_client()
+{
+  int fd = socket(AF_INET, SOCK_DGRAM, 0);
+  struct sockaddr_in server;
+  memset(&server, 0, sizeof(server));
+  server.sin_family = AF_INET;
+  server.sin_port = htons(PORT);
+  server.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  char buf[BUFLEN];
+  // Ping until the server is up
+  struct timeval tv;
+  tv.tv_sec = 0;
+  tv.tv_usec = 10000;
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  do {
+    sendto(fd, "ping", 5, 0, (struct sockaddr *)&server, sizeof(server));
+  } while (recv(fd, buf, sizeof(buf), 0) < 0);
+  tv.tv_usec = 0;
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  for (;;) {
+    int n = recv(fd, buf, sizeof(buf), 0);
+    if (n < WIRE_HEADER_LEN)
+      continue;
+    int len = opcode_reply_type((unsigned char)buf[3]) == PAYLOAD_V3 ? 24 : 8;
+    buf[4] = len == 24 ? PAYLOAD_V3 : PAYLOAD_DOUBLE;
+    buf[6] = len;
+    buf[7] = 0;
+    memset(buf + WIRE_HEADER_LEN, 0, len);
+    sendto(fd, buf, WIRE_HEADER_LEN + len, 0, (struct sockaddr *)&server, sizeof(server));
+  }
+}
+
+/**
+ * @brief CPU time of this process so far, microseconds
+ */
+static int64_t cpu_us()
+{
+  struct rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+  return (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000LL + ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+}
+
+/**
+ * @brief Time TICKS ticks of a given number of outstanding requests
+ * @param name Backend shown in the report
+ * @param options Server options selecting the backend
+ * @param outstanding Requests sent before the first reply is waited on
+ */
+static void run(const char *name, const ServerOptions &options, int outstanding)
+{
+  // The client is forked first so it holds none of the
+  // server's descriptors
+  pid_t client = fork();
+  if (client == 0) {
+    run_client();
+    _exit(0);
+  }
+  UDPserver *server = new UDPserver("127.0.0.1", 0, options);
+  server->check_ping();
+  // Replies are counted by a handler, ticks larger than the
+  // request ring are sent as the earlier replies come in
+  unsigned long answered = 0;
+  UDPserver::ReplyHandler count = [&answered](uint32_t, int status, const v3 &) {
+    if (status == REQUEST_OK)
+      answered++;
+  };
+  for (int i = 0; i < outstanding; i++)
+    server->submit(GET_POS, 0, count);
+  server->wait_all();
+  answered = 0;
+  IOStats before = server->io_stats();
+  int64_t start = monotonic_us();
+  int64_t cpuStart = cpu_us();
+  for (int tick = 0; tick < TICKS; tick++) {
+    for (int i = 0; i < outstanding; i++)
+      server->submit(GET_POS, 0, count);
+    server->wait_all();
+  }
+  int64_t elapsed = monotonic_us() - start;
+  int64_t cpu = cpu_us() - cpuStart;
+  if (answered != (unsigned long)TICKS * outstanding)
+    printf("%-10s %4d outstanding: %lu of %lu replies\n", name, outstanding,
+           answered, (unsigned long)TICKS * outstanding);
+  const IOStats &after = server->io_stats();
+  unsigned long calls = (after.sendCalls - before.sendCalls) + (after.recvCalls - before.recvCalls) +
+                        (after.waits - before.waits);
+  printf("%-10s %4d outstanding: %8.1f us/tick %8.1f us CPU/tick %7.2f syscalls/tick\n", name, outstanding,
+         (double)elapsed / TICKS, (double)cpu / TICKS, (double)calls / TICKS);
+  // Backends that read kernel timestamps split the round trips up
+  const LatencyStats &queue = server->round_trip_stats(GET_POS, RTT_QUEUE);
+  if (queue.completed != 0)
+    printf("%-10s %4s              network p50 %lld us, queue p50 %lld us, process p50 %lld us\n", "", "",
+           (long long)server->round_trip_stats(GET_POS, RTT_NETWORK).percentile_us(0.5),
+           (long long)queue.percentile_us(0.5),
+           (long long)server->round_trip_stats(GET_POS, RTT_PROCESS).percentile_us(0.5));
+  kill(client, SIGKILL);
+  waitpid(client, NULL, 0);
+  delete server;
+}
+
+int main()
+{
+  int outstanding[] = { 1, 16, 256 };
+  for (int i = 0; i < 3; i++) {
+    ServerOptions plain;
+    plain.batch = false;
+    run("sendto", plain, outstanding[i]);
+    ServerOptions batched;
+    run("sendmmsg", batched, outstanding[i]);
+    // What the kernel receive timestamps cost
+    ServerOptions unstamped;
+    unstamped.rxTimestamps = false;
+    run("unstamped", unstamped, outstanding[i]);
+    ServerOptions uring;
+    uring.uring = true;
+    run("io_uring", uring, outstanding[i]);
+  }
+  printf("At most %d requests are in flight, larger ticks are sent in windows\n", MAX_IN_FLIGHT);
+  return 0;
+}
@@ -0,0 +1,148 @@
+// ==============================================================
+//                  ORBITER MODULE: Rcontrol
+//
+// lanebench.cpp
+//
+// Loopback benchmark of the critical lane. Every tick the server
+// polls the telemetry with a burst of bulk requests, then applies
+// an actuator frame as a critical command and waits for it, and
+// the latency of both is reported with the lane and without it.
+// The forked client reads its socket in batches and answers
+// critical requests first, as a client should.
+// ==============================================================
+
+#include "udpserver.h"
+#include <iostream>
+#include <signal.h>
+#include <sys/wait.h>
+
+#define TICKS 1000
+
+/**
+ * @brief Answer a binary request in place with a zeroed reply of its type
+ * @return Length of the reply
+ */
+static int make_reply(char *buf)
+{
+  int len = opcode_reply_type((unsigned char)buf[3]) == PAYLOAD_V3 ? 24 : 8;
+  buf[4] = len == 24 ? PAYLOAD_V3 : PAYLOAD_DOUBLE;
+  buf[6] = len;
+  buf[7] = 0;
+  memset(buf + WIRE_HEADER_LEN, 0, len);
+  return WIRE_HEADER_LEN + len;
+}
+
+/**
+ * @brief Answer every request to the address it came from, critical ones first
+ */
+static void run_client()
+{
+  int fd = socket(AF_INET, SOCK_DGRAM, 0);
+  struct sockaddr_in server;
+  memset(&server, 0, sizeof(server));
+  server.sin_family = AF_INET;
+  server.sin_port = htons(PORT);
+  server.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  static char bufs[BATCH_SIZE][BUFLEN];
+  struct mmsghdr msgs[BATCH_SIZE];
+  struct iovec iov[BATCH_SIZE];
+  struct sockaddr_in from[BATCH_SIZE];
+  // Ping until the server is up
+  struct timeval tv;
+  tv.tv_sec = 0;
+  tv.tv_usec = 10000;
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  do {
+    sendto(fd, "ping", 5, 0, (struct sockaddr *)&server, sizeof(server));
+  } while (recv(fd, bufs[0], BUFLEN, 0) < 0);
+  tv.tv_usec = 0;
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  for (;;) {
+    for (int i = 0; i < BATCH_SIZE; i++) {
+      memset(&msgs[i], 0, sizeof(msgs[i]));
+      iov[i].iov_base = bufs[i];
+      iov[i].iov_len = BUFLEN;
+      msgs[i].msg_hdr.msg_iov = &iov[i];
+      msgs[i].msg_hdr.msg_iovlen = 1;
+      msgs[i].msg_hdr.msg_name = &from[i];
+      msgs[i].msg_hdr.msg_namelen = sizeof(from[i]);
+    }
+    int n = recvmmsg(fd, msgs, BATCH_SIZE, MSG_WAITFORONE, NULL);
+    for (int pass = 0; pass < 2; pass++) {
+      for (int i = 0; i < n; i++) {
+        if ((int)msgs[i].msg_len < WIRE_HEADER_LEN)
+          continue;
+        uint32_t seq;
+        memcpy(&seq, bufs[i] + 8, 4);
+        if (((seq & CRITICAL_ID_BIT) != 0) != (pass == 0))
+          continue;
+        int len = make_reply(bufs[i]);
+        sendto(fd, bufs[i], len, 0, (struct sockaddr *)&from[i], msgs[i].msg_hdr.msg_namelen);
+      }
+    }
+  }
+}
+
+/**
+ * @brief Print one line of latency figures
+ */
+static void report(const char *name, const LatencyStats &latency)
+{
+  printf("  %-18s %7lu requests  mean %6lld us  p50 %6lld us  p99 %6lld us  max %6lld us\n", name,
+         latency.completed, (long long)latency.mean_us(), (long long)latency.percentile_us(0.5),
+         (long long)latency.percentile_us(0.99), (long long)latency.maxUs);
+}
+
+/**
+ * @brief Measure command latency under telemetry load
+ * @param lanes Whether critical commands get their own lane
+ * @param bulk Telemetry polls sent ahead of each command
+ */
+static void run(bool lanes, int bulk)
+{
+  pid_t client = fork();
+  if (client == 0) {
+    run_client();
+    _exit(0);
+  }
+  ServerOptions options;
+  options.criticalLane = lanes;
+  UDPserver *server = new UDPserver("127.0.0.1", 0, options);
+  server->check_ping();
+
+  LatencyStats commands;
+  memset(&commands, 0, sizeof(commands));
+  ActuatorFrame frame = ActuatorFrame();
+  frame.flags = ACT_PITCH;
+  frame.pitch = 0.08;
+  for (int tick = 0; tick < TICKS; tick++) {
+    for (int i = 0; i < bulk; i++)
+      server->submit(GET_POS, 0);
+    int64_t sent = monotonic_us();
+    v3 rcs;
+    if (server->apply_actuators(frame, &rcs, LANE_CRITICAL) == REQUEST_OK)
+      commands.record(monotonic_us() - sent);
+    else
+      commands.timeouts++;
+    server->wait_all();
+  }
+  printf("%d polls per tick, %s:\n", bulk, lanes ? (server->critical_socket() ? "Critical lane, own socket" : "Critical lane, shared socket")
+                        : "One lane");
+  report("actuator commands", commands);
+  report("bulk polls", server->lane_stats(LANE_BULK));
+  kill(client, SIGKILL);
+  waitpid(client, NULL, 0);
+  delete server;
+}
+
+int main()
+{
+  printf("%d ticks of telemetry polls followed by an actuator command, %d requests in flight at most\n",
+         TICKS, MAX_IN_FLIGHT);
+  int bulk[] = { 48, 160 };
+  for (int i = 0; i < 2; i++) {
+    run(false, bulk[i]);
+    run(true, bulk[i]);
+  }
+  return 0;
+}
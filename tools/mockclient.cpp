@@ -0,0 +1,406 @@
+// ==============================================================
+//                  ORBITER MODULE: Rcontrol
+//
+// mockclient.cpp
+//
+// Reference client for testing without Orbiter. It pings the
+// server like the Orbiter module does and answers binary
+// requests from a synthetic scene: the active vessel cruises
+// along x through objects scattered at random, which drift
+// slowly. GET_SCENE_NEAR is answered as the real client should,
+// with only the objects inside the query region, GET_SCENE_DELTA
+// with the changes since the frame the server holds, and the
+// bytes sent per scene are reported for every scene request.
+// ==============================================================
+
+#include "udpserver.h"
+#include <algorithm>
+#include <iostream>
+#include <signal.h>
+#include <vector>
+
+#define SCENE_EXTENT 1e6	// objects lie within this distance of the origin on every axis
+#define VESSEL_SPEED 100.0	// metres per second along x
+#define REPORT_EVERY 100	// scene requests between reports
+#define OBJECT_SPEED 5.0	// greatest drift of the other objects, metres per second
+#define DELTA_HISTORY 8	// delta frames kept to encode against
+#define SCENE_FRAG_OBJECTS ((BUFLEN - WIRE_HEADER_LEN - SCENE_FRAG_HEADER_LEN) / SCENE_RECORD_LEN)
+#define SCENE_DELTA_BYTES (BUFLEN - WIRE_HEADER_LEN - SCENE_DELTA_HEADER_LEN)
+
+/**
+ * @brief Bytes sent in reply to one kind of scene request
+ */
+struct SceneTally {
+  unsigned long requests;
+  unsigned long objects;
+  unsigned long datagrams;
+  unsigned long bytes;
+};
+
+static volatile sig_atomic_t stopping = 0;
+/**
+ * @brief Scene frame as the server decoded it
+ */
+struct DeltaFrame {
+  uint32_t frame;
+  std::vector<SceneObject> objects;
+};
+
+static std::vector<SceneObject> scene;	// object 0 is the active vessel
+static std::vector<v3> origins, drifts;	// position at time zero and velocity of each object
+static DeltaFrame history[DELTA_HISTORY];	// frame n is kept at n % DELTA_HISTORY
+static uint32_t lastFrame, lastKeyframe;
+static SceneTally tallies[3];	// GET_SCENE, GET_SCENE_NEAR, GET_SCENE_DELTA
+static int64_t startUs;
+
+static void on_signal(int)
+{
+  stopping = 1;
+}
+
+// The wire is little-endian, as is every host this runs on
+static void put_double(char *p, double d)
+{
+  memcpy(p, &d, sizeof(d));
+}
+
+static double get_double(const char *p)
+{
+  double d;
+  memcpy(&d, p, sizeof(d));
+  return d;
+}
+
+/**
+ * @brief Seconds since the client started, its simulation time
+ */
+static double sim_time()
+{
+  return (monotonic_us() - startUs) / 1e6;
+}
+
+/**
+ * @brief Scatter the objects, the same scene for the same count
+ * @param count Objects including the vessel
+ */
+static void make_scene(int count)
+{
+  srand(1);
+  scene.resize(count);
+  origins.resize(count);
+  drifts.resize(count);
+  for (int i = 0; i < count; i++) {
+    SceneObject &object = scene[i];
+    object.id = i;
+    object.isVessel = i == 0;
+    for (int k = 0; k < 3; k++) {
+      origins[i].data[k] = i == 0 ? 0 : SCENE_EXTENT * (2.0 * rand() / RAND_MAX - 1);
+      drifts[i].data[k] = i == 0 ? 0 : OBJECT_SPEED * (2.0 * rand() / RAND_MAX - 1);
+    }
+    drifts[0].x = VESSEL_SPEED;
+    object.position = origins[i];
+    object.radius = i == 0 ? 10 : 1 + 999.0 * rand() / RAND_MAX;
+  }
+}
+
+/**
+ * @brief Move every object to where it is now
+ */
+static void update_scene()
+{
+  double t = sim_time();
+  for (size_t i = 0; i < scene.size(); i++) {
+    for (int k = 0; k < 3; k++)
+      scene[i].position.data[k] = origins[i].data[k] + drifts[i].data[k] * t;
+  }
+}
+
+/**
+ * @brief Fill in a reply header, the request's header is reused
+ */
+static int finish_reply(char *buf, int type, int length)
+{
+  buf[4] = (char)type;
+  buf[5] = 0;
+  buf[6] = (char)(length & 0xff);
+  buf[7] = (char)(length >> 8);
+  return WIRE_HEADER_LEN + length;
+}
+
+/**
+ * Send the given objects as scene fragments, the way the
+ * Orbiter client answers GET_SCENE
+ * @brief Send a scene reply
+ * @param fd Socket connected to the server
+ * @param request Request being answered
+ * @param objects Indices into scene of the objects to send
+ * @param tally Counters of the request kind
+ */
+static void send_scene(int fd, const char *request, const std::vector<int> &objects, SceneTally &tally)
+{
+  int total = (int)objects.size();
+  int count = total == 0 ? 1 : (total + SCENE_FRAG_OBJECTS - 1) / SCENE_FRAG_OBJECTS;
+  char out[BUFLEN];
+  for (int f = 0; f < count; f++) {
+    int first = f * SCENE_FRAG_OBJECTS;
+    int n = std::min(SCENE_FRAG_OBJECTS, total - first);
+    memcpy(out, request, WIRE_HEADER_LEN);
+    char *p = out + WIRE_HEADER_LEN;
+    uint16_t header16[2] = { (uint16_t)f, (uint16_t)count };
+    uint32_t header32[2] = { (uint32_t)total, (uint32_t)first };
+    uint16_t objects16[2] = { (uint16_t)n, 0 };
+    memcpy(p, header16, 4);
+    memcpy(p + 4, header32, 8);
+    memcpy(p + 12, objects16, 4);
+    for (int i = 0; i < n; i++) {
+      const SceneObject &object = scene[objects[first + i]];
+      char *record = p + SCENE_FRAG_HEADER_LEN + i * SCENE_RECORD_LEN;
+      int32_t id = object.id;
+      uint32_t flags = object.isVessel ? SCENE_FLAG_VESSEL : 0;
+      memcpy(record, &id, 4);
+      memcpy(record + 4, &flags, 4);
+      for (int k = 0; k < 3; k++)
+        put_double(record + 8 + 8 * k, object.position.data[k]);
+      put_double(record + 32, object.radius);
+    }
+    int len = finish_reply(out, PAYLOAD_SCENE, SCENE_FRAG_HEADER_LEN + n * SCENE_RECORD_LEN);
+    send(fd, out, len, 0);
+    tally.datagrams++;
+    tally.bytes += len;
+  }
+  tally.requests++;
+  tally.objects += total;
+}
+
+/**
+ * Encode the next frame against the base the server names, or as
+ * a keyframe if that frame is gone or the last keyframe is too
+ * old, and send it in as many fragments as it takes
+ * @brief Send a delta scene reply
+ * @param fd Socket connected to the server
+ * @param request Request being answered
+ * @param base Frame the server holds, zero for none
+ */
+static void send_scene_delta(int fd, const char *request, uint32_t base)
+{
+  uint32_t frame = lastFrame + 1;
+  if (frame == 0)
+    frame = 1;
+  const DeltaFrame &held = history[base % DELTA_HISTORY];
+  bool keyframe = base == 0 || held.frame != base || held.objects.size() != scene.size() ||
+                  frame - lastKeyframe >= SCENE_KEYFRAME_INTERVAL;
+  DeltaFrame &next = history[frame % DELTA_HISTORY];
+  next.frame = frame;
+  if (keyframe) {
+    next.objects.resize(scene.size());
+    base = 0;
+    lastKeyframe = frame;
+  }
+  else if (&next != &held)
+    next.objects = held.objects;
+  lastFrame = frame;
+
+  // Records are encoded back to back, then cut into fragments
+  std::vector<char> records(scene.size() * (4 + SCENE_RECORD_LEN));
+  std::vector<int> ends;	// end of each record in records
+  int used = 0;
+  for (int i = 0; i < (int)scene.size(); i++) {
+    int n = encode_scene_delta_record(scene[i], i, keyframe, &next.objects[i], &records[used],
+                                      records.size() - used);
+    if (n > 0) {
+      used += n;
+      ends.push_back(used);
+    }
+  }
+  std::vector<int> cuts(1, 0);	// first record of each fragment
+  int start = 0;
+  for (int r = 0; r < (int)ends.size(); r++) {
+    if (ends[r] - start > SCENE_DELTA_BYTES) {
+      cuts.push_back(r);
+      start = ends[r - 1];
+    }
+  }
+  int count = (int)cuts.size();
+  SceneTally &tally = tallies[2];
+  char out[BUFLEN];
+  for (int f = 0; f < count; f++) {
+    int first = cuts[f];
+    int last = f + 1 < count ? cuts[f + 1] : (int)ends.size();
+    int from = first == 0 ? 0 : ends[first - 1];
+    int to = last == 0 ? 0 : ends[last - 1];
+    memcpy(out, request, WIRE_HEADER_LEN);
+    char *p = out + WIRE_HEADER_LEN;
+    uint16_t header16[2] = { (uint16_t)f, (uint16_t)count };
+    uint32_t header32[3] = { (uint32_t)scene.size(), frame, base };
+    uint16_t records16[2] = { (uint16_t)(last - first), 0 };
+    memcpy(p, header16, 4);
+    memcpy(p + 4, header32, 12);
+    memcpy(p + 16, records16, 4);
+    memcpy(p + SCENE_DELTA_HEADER_LEN, &records[from], to - from);
+    int len = finish_reply(out, PAYLOAD_SCENE_DELTA, SCENE_DELTA_HEADER_LEN + to - from);
+    send(fd, out, len, 0);
+    tally.datagrams++;
+    tally.bytes += len;
+  }
+  tally.requests++;
+  tally.objects += ends.size();
+}
+
+/**
+ * @brief Print the average reply to each kind of scene request
+ */
+static void report()
+{
+  const char *names[3] = { "GET_SCENE", "GET_SCENE_NEAR", "GET_SCENE_DELTA" };
+  for (int i = 0; i < 3; i++) {
+    const SceneTally &t = tallies[i];
+    if (t.requests == 0)
+      continue;
+    printf("%-15s %6lu requests, %8.1f objects %7.1f datagrams %9.0f bytes per reply\n", names[i],
+           t.requests, (double)t.objects / t.requests, (double)t.datagrams / t.requests,
+           (double)t.bytes / t.requests);
+  }
+}
+
+/**
+ * @brief Answer one request
+ * @param fd Socket connected to the server
+ * @param buf Request, overwritten with the reply
+ * @param n Length of the request
+ */
+static void answer(int fd, char *buf, int n)
+{
+  double received = sim_time();
+  int opcode = (unsigned char)buf[3];
+  double arg = 0;
+  if ((unsigned char)buf[4] == PAYLOAD_DOUBLE)
+    arg = get_double(buf + WIRE_HEADER_LEN);
+  else if ((unsigned char)buf[4] == PAYLOAD_INT) {
+    int32_t i;
+    memcpy(&i, buf + WIRE_HEADER_LEN, 4);
+    arg = i;
+  }
+  int index = (int)arg;
+  bool known = index >= 0 && index < (int)scene.size();
+  update_scene();
+
+  char *p = buf + WIRE_HEADER_LEN;
+  int len;
+  switch (opcode) {
+    case GET_SCENE:
+    case GET_SCENE_NEAR: {
+      std::vector<int> objects;
+      SceneQuery query;
+      bool near = opcode == GET_SCENE_NEAR;
+      if (near && !decode_scene_query(buf, n, &query))
+        return;
+      for (int i = 0; i < (int)scene.size(); i++) {
+        if (!near || scene_query_match(query, scene[0].position, scene[i]))
+          objects.push_back(i);
+      }
+      send_scene(fd, buf, objects, tallies[near ? 1 : 0]);
+      if ((tallies[0].requests + tallies[1].requests + tallies[2].requests) % REPORT_EVERY == 0)
+        report();
+      return;
+    }
+    case GET_SCENE_DELTA:
+      send_scene_delta(fd, buf, (uint32_t)index);
+      if ((tallies[0].requests + tallies[1].requests + tallies[2].requests) % REPORT_EVERY == 0)
+        report();
+      return;
+    case GET_POS:
+      for (int k = 0; k < 3; k++)
+        put_double(p + 8 * k, known ? scene[index].position.data[k] : 0);
+      len = finish_reply(buf, PAYLOAD_V3, 24);
+      break;
+    case GET_AIRSPEED:
+      put_double(p, VESSEL_SPEED);
+      put_double(p + 8, 0);
+      put_double(p + 16, 0);
+      len = finish_reply(buf, PAYLOAD_V3, 24);
+      break;
+    case GET_VESSEL_STATE:
+      // Level and not turning, cruising along x
+      memset(p, 0, TELEMETRY_LEN);
+      put_double(p, received);
+      for (int k = 0; k < 3; k++)
+        put_double(p + 8 + 8 * k, scene[0].position.data[k]);
+      put_double(p + 80, VESSEL_SPEED);
+      len = finish_reply(buf, PAYLOAD_TELEMETRY, TELEMETRY_LEN);
+      break;
+    case GET_ANG_VEL:
+    case SET_ACTUATORS:
+      memset(p, 0, 24);
+      len = finish_reply(buf, PAYLOAD_V3, 24);
+      break;
+    case SYNC_CLOCK:
+      put_double(p, received);
+      put_double(p + 8, sim_time());
+      put_double(p + 16, 1);
+      len = finish_reply(buf, PAYLOAD_V3, 24);
+      break;
+    case GET_OBJ_COUNT:
+    case IS_VESSEL: {
+      int32_t value = opcode == GET_OBJ_COUNT ? (int32_t)scene.size() : known && scene[index].isVessel;
+      memcpy(p, &value, 4);
+      len = finish_reply(buf, PAYLOAD_INT, 4);
+      break;
+    }
+    case GET_SIZE:
+      put_double(p, known ? scene[index].radius : 0);
+      len = finish_reply(buf, PAYLOAD_DOUBLE, 8);
+      break;
+    default:
+      // Attitude reads as level, setters and SUBSCRIBE are
+      // acknowledged with their argument and otherwise ignored
+      put_double(p, opcode_arg_type(opcode) == PAYLOAD_DOUBLE ? arg : 0);
+      len = finish_reply(buf, PAYLOAD_DOUBLE, 8);
+      break;
+  }
+  send(fd, buf, len, 0);
+}
+
+int main(int argc, char **argv)
+{
+  const char *ip = argc > 1 ? argv[1] : "127.0.0.1";
+  int count = argc > 2 ? atoi(argv[2]) : 1000;
+  if (count < 1) {
+    std::cerr << "Usage: " << argv[0] << " [server-ip] [objects]" << std::endl;
+    return 1;
+  }
+  make_scene(count);
+  startUs = monotonic_us();
+  signal(SIGINT, on_signal);
+  signal(SIGTERM, on_signal);
+
+  int fd = socket(AF_INET, SOCK_DGRAM, 0);
+  struct sockaddr_in server;
+  memset(&server, 0, sizeof(server));
+  server.sin_family = AF_INET;
+  server.sin_port = htons(PORT);
+  if (fd < 0 || inet_pton(AF_INET, ip, &server.sin_addr) != 1 ||
+      connect(fd, (struct sockaddr *)&server, sizeof(server)) < 0) {
+    perror("ERROR opening socket");
+    return 1;
+  }
+  char buf[BUFLEN];
+  // Ping until the server is up, with a timeout so a signal
+  // also ends the wait for requests
+  struct timeval tv;
+  tv.tv_sec = 0;
+  tv.tv_usec = 100000;
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  do {
+    send(fd, "ping", 5, 0);
+  } while (recv(fd, buf, sizeof(buf), 0) < 0 && !stopping);
+  std::cout << "Serving " << count << " objects" << std::endl;
+  while (!stopping) {
+    int n = recv(fd, buf, sizeof(buf), 0);
+    if (n < WIRE_HEADER_LEN || (unsigned char)buf[0] != (WIRE_MAGIC & 0xff))
+      continue;
+    answer(fd, buf, n);
+  }
+  report();
+  close(fd);
+  return 0;
+}
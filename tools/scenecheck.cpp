@@ -0,0 +1,310 @@
+// ==============================================================
+//                  ORBITER MODULE: Rcontrol
+//
+// scenecheck.cpp
+//
+// Loopback check of scene reassembly. A child process stands in
+// for the client and the server fetches scenes from it the way
+// the autopilot does, and each check prints ok or FAILED. The
+// exit status is the number of checks that failed.
+// ==============================================================
+
+#include "udpserver.h"
+#include <cmath>
+#include <iostream>
+#include <signal.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+
+#define SCENE_ARRAYS 9	// scene arrays the pipelined autopilot turns over, PIPELINE_DEPTH + 1
+#define DELTA_OBJECTS 20	// objects of the delta scene, a keyframe fits one datagram
+#define DELTA_FRAMES 50	// frames fetched, fewer than SCENE_KEYFRAME_INTERVAL
+#define DRIFT 0.5	// metres object i moves along x per frame, times i % 3
+#define HUGE_TOTAL 80000000	// objects a corrupt fragment announces, its fragments could carry them
+
+/**
+ * @brief Scene the delta client sends as frame number frame
+ */
+static void delta_scene(uint32_t frame, std::vector<SceneObject> *objects)
+{
+  objects->resize(DELTA_OBJECTS);
+  for (int i = 0; i < DELTA_OBJECTS; i++) {
+    SceneObject &object = (*objects)[i];
+    object.id = i;
+    object.isVessel = i == 0;
+    object.position.x = 100.0 * i + DRIFT * (i % 3) * frame;
+    object.position.y = i;
+    object.position.z = 0;
+    object.radius = 10;
+  }
+}
+
+/**
+ * @brief Fill in a reply header, the request's header is reused
+ */
+static int finish_reply(char *buf, int type, int length)
+{
+  buf[4] = (char)type;
+  buf[5] = 0;
+  put16(buf + 6, (uint16_t)length);
+  return WIRE_HEADER_LEN + length;
+}
+
+/**
+ * Answer GET_SCENE_DELTA with a delta against the frame the
+ * server names if it is the last one sent, otherwise with a
+ * keyframe, and GET_OBJ_COUNT with the number of keyframes sent
+ * @brief Client of the delta check
+ */
+static void run_delta_client(int fd, const struct sockaddr_in &server)
+{
+  std::vector<SceneObject> held, next;	// last frame sent, as the server decoded it
+  uint32_t frame = 0;
+  int keyframes = 0;
+  char buf[BUFLEN];
+  for (;;) {
+    int n = recv(fd, buf, sizeof(buf), 0);
+    if (n < WIRE_HEADER_LEN)
+      continue;
+    int len;
+    if ((unsigned char)buf[3] == GET_SCENE_DELTA) {
+      uint32_t base = (unsigned char)buf[4] == PAYLOAD_INT ? get32(buf + WIRE_HEADER_LEN)
+                                                          : (uint32_t)getDouble(buf + WIRE_HEADER_LEN);
+      bool keyframe = base == 0 || base != frame;
+      delta_scene(++frame, &next);
+      if (keyframe) {
+        held.resize(DELTA_OBJECTS);
+        base = 0;
+        keyframes++;
+      }
+      char *p = buf + WIRE_HEADER_LEN;
+      int used = SCENE_DELTA_HEADER_LEN, records = 0;
+      for (int i = 0; i < DELTA_OBJECTS; i++) {
+        int r = encode_scene_delta_record(next[i], i, keyframe, &held[i], p + used, BUFLEN - WIRE_HEADER_LEN - used);
+        if (r > 0) {
+          used += r;
+          records++;
+        }
+      }
+      put16(p, 0);
+      put16(p + 2, 1);
+      put32(p + 4, DELTA_OBJECTS);
+      put32(p + 8, frame);
+      put32(p + 12, base);
+      put16(p + 16, (uint16_t)records);
+      put16(p + 18, 0);
+      len = finish_reply(buf, PAYLOAD_SCENE_DELTA, used);
+    }
+    else {
+      put32(buf + WIRE_HEADER_LEN, (uint32_t)keyframes);
+      len = finish_reply(buf, PAYLOAD_INT, 4);
+    }
+    sendto(fd, buf, len, 0, (struct sockaddr *)&server, sizeof(server));
+  }
+}
+
+/**
+ * Answer GET_SCENE with corrupt fragments, in turn one whose
+ * total is larger than any scene and one whose first object
+ * overflows when its objects are added
+ * @brief Client of the fragment checks
+ */
+static void run_fragment_client(int fd, const struct sockaddr_in &server)
+{
+  // index, count, total, first, objects of each reply
+  static const uint32_t fragments[][5] = {
+    { 0, 0xffff, HUGE_TOTAL, 0, 0 },
+    { 0, 1, 100, 0x7fffffff, 1 },
+  };
+  int replies = 0;
+  char buf[BUFLEN];
+  for (;;) {
+    int n = recv(fd, buf, sizeof(buf), 0);
+    if (n < WIRE_HEADER_LEN || (unsigned char)buf[3] != GET_SCENE)
+      continue;
+    const uint32_t *f = fragments[replies++ % 2];
+    char *p = buf + WIRE_HEADER_LEN;
+    memset(p, 0, SCENE_FRAG_HEADER_LEN + SCENE_RECORD_LEN);
+    put16(p, (uint16_t)f[0]);
+    put16(p + 2, (uint16_t)f[1]);
+    put32(p + 4, f[2]);
+    put32(p + 8, f[3]);
+    put16(p + 12, (uint16_t)f[4]);
+    int len = finish_reply(buf, PAYLOAD_SCENE, SCENE_FRAG_HEADER_LEN + f[4] * SCENE_RECORD_LEN);
+    sendto(fd, buf, len, 0, (struct sockaddr *)&server, sizeof(server));
+  }
+}
+
+/**
+ * Answer JSON requests, GET_OBJ_COUNT in turn with a negative
+ * count, one larger than any scene, one no int holds and a count
+ * of 3, and every object query with zeros
+ * @brief Client of the JSON scene check
+ */
+static void run_json_client(int fd, const struct sockaddr_in &server)
+{
+  static const char *counts[] = { "-5", "70000", "1e12", "3" };
+  int countReplies = 0;
+  char buf[BUFLEN], out[BUFLEN];
+  for (;;) {
+    int n = recv(fd, buf, sizeof(buf) - 1, 0);
+    if (n <= 0)
+      continue;
+    buf[n] = 0;
+    const char *seq = strstr(buf, "\"seq\":");
+    if (seq == NULL)
+      continue;
+    unsigned long id = strtoul(seq + 6, NULL, 10);
+    const char *data = "0";
+    if (strstr(buf, opcode_name(GET_OBJ_COUNT)) != NULL)
+      data = counts[countReplies++ % 4];
+    else if (strstr(buf, opcode_name(GET_POS)) != NULL)
+      data = "[0,0,0]";
+    int len = snprintf(out, sizeof(out), "{\"seq\":%lu,\"data\":%s}", id, data);
+    sendto(fd, out, len, 0, (struct sockaddr *)&server, sizeof(server));
+  }
+}
+
+/**
+ * @brief Ping the server until it answers, then run a client
+ */
+static void run_client(void (*client)(int fd, const struct sockaddr_in &server))
+{
+  int fd = socket(AF_INET, SOCK_DGRAM, 0);
+  struct sockaddr_in server;
+  memset(&server, 0, sizeof(server));
+  server.sin_family = AF_INET;
+  server.sin_port = htons(PORT);
+  server.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  char buf[BUFLEN];
+  struct timeval tv;
+  tv.tv_sec = 0;
+  tv.tv_usec = 10000;
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  do {
+    sendto(fd, "ping", 5, 0, (struct sockaddr *)&server, sizeof(server));
+  } while (recv(fd, buf, sizeof(buf), 0) < 0);
+  tv.tv_usec = 0;
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  client(fd, server);
+}
+
+/**
+ * @brief Print the outcome of a check
+ * @return 1 if it failed, 0 otherwise
+ */
+static int report(const char *name, bool ok, const char *detail)
+{
+  printf("%-40s %s  %s\n", name, ok ? "ok    " : "FAILED", detail);
+  return ok ? 0 : 1;
+}
+
+/**
+ * Fetch delta scenes into a different array each time, as the
+ * pipelined autopilot does. Only the first frame may be a
+ * keyframe, and every array must hold the frame it was given.
+ * @brief Delta frames turned over several scene arrays
+ */
+static int check_delta_arrays(UDPserver *server)
+{
+  std::vector<SceneObject> scenes[SCENE_ARRAYS], expected;
+  int failed = 0;
+  for (uint32_t frame = 1; frame <= DELTA_FRAMES && failed == 0; frame++) {
+    std::vector<SceneObject> &scene = scenes[frame % SCENE_ARRAYS];
+    if (server->get_scene(&scene, NULL) != REQUEST_OK) {
+      failed++;
+      break;
+    }
+    delta_scene(frame, &expected);
+    if (scene.size() != expected.size())
+      failed++;
+    for (size_t i = 0; i < scene.size() && failed == 0; i++) {
+      if (fabs(scene[i].position.x - expected[i].position.x) > SCENE_DELTA_QUANTUM)
+        failed++;
+    }
+  }
+  int keyframes = -1;
+  server->request<GET_OBJ_COUNT>(0, &keyframes);
+  char detail[80];
+  snprintf(detail, sizeof(detail), "%d keyframes in %d frames", keyframes, DELTA_FRAMES);
+  return report("delta frames over rotating arrays", failed == 0 && keyframes == 1, detail);
+}
+
+/**
+ * Corrupt fragments must fail the request, not size the scene.
+ * A total no scene reaches is refused as soon as it arrives, a
+ * fragment that does not add up is dropped and the request
+ * times out.
+ * @brief Fragments announcing impossible scenes
+ */
+static int check_fragments(UDPserver *server)
+{
+  std::vector<SceneObject> scene;
+  server->set_timeouts(10, 0);
+  int huge = server->get_scene(&scene, NULL);
+  char detail[80];
+  snprintf(detail, sizeof(detail), "status %d, %d objects", huge, (int)scene.size());
+  int failed = report("fragment total beyond any scene", huge == REQUEST_MALFORMED && scene.empty(), detail);
+  int overflow = server->get_scene(&scene, NULL);
+  snprintf(detail, sizeof(detail), "status %d, %d objects", overflow, (int)scene.size());
+  failed += report("fragment first object overflowing", overflow == REQUEST_TIMEOUT && scene.empty(), detail);
+  return failed;
+}
+
+/**
+ * JSON clients are polled for their object count, which must be
+ * bounded like a binary scene's before the scene is sized
+ * @brief Object counts no scene has
+ */
+static int check_json_counts(UDPserver *server)
+{
+  std::vector<SceneObject> scene;
+  int negative = server->get_scene(&scene, NULL);
+  int huge = server->get_scene(&scene, NULL);
+  int wide = server->get_scene(&scene, NULL);
+  int fine = server->get_scene(&scene, NULL);
+  char detail[80];
+  snprintf(detail, sizeof(detail), "status %d, %d, %d, then %d with %d objects", negative, huge, wide, fine,
+           (int)scene.size());
+  return report("JSON object counts beyond any scene",
+                negative == REQUEST_MALFORMED && huge == REQUEST_MALFORMED && wide == REQUEST_MALFORMED &&
+                fine == REQUEST_OK && scene.size() == 3,
+                detail);
+}
+
+/**
+ * @brief Run one check against a fresh server and client
+ */
+static int run(int (*check)(UDPserver *server), void (*client)(int fd, const struct sockaddr_in &server),
+               const ServerOptions &options)
+{
+  // The client is forked first so it holds none of the
+  // server's descriptors
+  pid_t child = fork();
+  if (child == 0) {
+    // A check that crashes the server takes the client with it
+    prctl(PR_SET_PDEATHSIG, SIGKILL);
+    run_client(client);
+    _exit(0);
+  }
+  UDPserver *server = new UDPserver("127.0.0.1", 0, options);
+  server->check_ping();
+  int failed = check(server);
+  kill(child, SIGKILL);
+  waitpid(child, NULL, 0);
+  delete server;
+  return failed;
+}
+
+int main()
+{
+  int failed = 0;
+  ServerOptions delta;
+  delta.sceneDelta = true;
+  failed += run(check_delta_arrays, run_delta_client, delta);
+  failed += run(check_fragments, run_fragment_client, ServerOptions());
+  ServerOptions json;
+  json.wire = WIRE_JSON;
+  failed += run(check_json_counts, run_json_client, json);
+  return failed;
+}
@@ -0,0 +1,149 @@
+// ==============================================================
+//                  ORBITER MODULE: Rcontrol
+//
+// shardbench.cpp
+//
+// Loopback benchmark of the SO_REUSEPORT worker pool. Forked
+// processes stand in for many simulator clients and answer every
+// request, each session keeps a fixed number of requests in
+// flight, and the replies per second are reported for 1 to 8
+// workers.
+// ==============================================================
+
+#include "shard.h"
+#include <iostream>
+#include <mutex>
+#include <signal.h>
+#include <sys/wait.h>
+
+#define CLIENTS 32	// simulator clients
+#define OUTSTANDING 8	// requests each session keeps in flight
+#define WARMUP_MS 200
+#define MEASURE_MS 1000
+
+/**
+ * @brief Replies counted for one session, padded off the next one's cache line
+ */
+struct SessionCount {
+  std::atomic<unsigned long> replies;
+  UDPserver::ReplyHandler handler;
+  char pad[64];
+};
+
+/**
+ * @brief Answer every binary request with a zeroed reply of its type
+ */
+static void run_client()
+{
+  int fd = socket(AF_INET, SOCK_DGRAM, 0);
+  struct sockaddr_in server;
+  memset(&server, 0, sizeof(server));
+  server.sin_family = AF_INET;
+  server.sin_port = htons(PORT);
+  server.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  char buf[BUFLEN];
+  // Ping until the server is up
+  struct timeval tv;
+  tv.tv_sec = 0;
+  tv.tv_usec = 10000;
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  do {
+    sendto(fd, "ping", 5, 0, (struct sockaddr *)&server, sizeof(server));
+  } while (recv(fd, buf, sizeof(buf), 0) < 0);
+  tv.tv_usec = 0;
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  for (;;) {
+    int n = recv(fd, buf, sizeof(buf), 0);
+    if (n < WIRE_HEADER_LEN)
+      continue;
+    int len = opcode_reply_type((unsigned char)buf[3]) == PAYLOAD_V3 ? 24 : 8;
+    buf[4] = len == 24 ? PAYLOAD_V3 : PAYLOAD_DOUBLE;
+    buf[6] = len;
+    buf[7] = 0;
+    memset(buf + WIRE_HEADER_LEN, 0, len);
+    sendto(fd, buf, WIRE_HEADER_LEN + len, 0, (struct sockaddr *)&server, sizeof(server));
+  }
+}
+
+/**
+ * @brief Sum the replies of every session
+ */
+static unsigned long total(std::vector<SessionCount *> &counts, std::mutex &lock)
+{
+  std::lock_guard<std::mutex> guard(lock);
+  unsigned long sum = 0;
+  for (size_t i = 0; i < counts.size(); i++)
+    sum += counts[i]->replies.load(std::memory_order_relaxed);
+  return sum;
+}
+
+/**
+ * @brief Measure the reply rate of a pool of workers
+ * @param workers Worker threads in the pool
+ */
+static void run(int workers)
+{
+  // The clients are forked first so they hold none of the
+  // pool's descriptors, they ping until a worker is listening
+  pid_t clients[CLIENTS];
+  for (int i = 0; i < CLIENTS; i++) {
+    clients[i] = fork();
+    if (clients[i] == 0) {
+      run_client();
+      _exit(0);
+    }
+  }
+  ServerOptions options;
+  options.workers = workers;
+  options.clients = CLIENTS;
+  ShardPool pool(0, options);
+  std::vector<SessionCount *> counts;
+  std::mutex lock;
+  // Every reply submits the next request from its handler, on
+  // the worker thread of the session
+  ShardPool::SessionHandler accepted = [&counts, &lock](UDPserver *session) {
+    SessionCount *count = new SessionCount();
+    count->replies = 0;
+    count->handler = [session, count](uint32_t, int status, const v3 &) {
+      if (status == REQUEST_OK)
+        count->replies.fetch_add(1, std::memory_order_relaxed);
+      session->submit(GET_POS, 0, count->handler);
+    };
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      counts.push_back(count);
+    }
+    for (int i = 0; i < OUTSTANDING; i++)
+      session->submit(GET_POS, 0, count->handler);
+  };
+  // Requests submitted by the handlers are queued until flushed
+  ShardPool::SessionHandler tick = [](UDPserver *session) { session->flush(); };
+  if (!pool.start(accepted, tick))
+    exit(EXIT_FAILURE);
+  while (pool.sessions() < CLIENTS)
+    usleep(1000);
+  usleep(WARMUP_MS * 1000);
+  unsigned long before = total(counts, lock);
+  int64_t start = monotonic_us();
+  usleep(MEASURE_MS * 1000);
+  unsigned long replies = total(counts, lock) - before;
+  int64_t elapsed = monotonic_us() - start;
+  pool.stop();
+  for (int i = 0; i < CLIENTS; i++) {
+    kill(clients[i], SIGKILL);
+    waitpid(clients[i], NULL, 0);
+  }
+  for (size_t i = 0; i < counts.size(); i++)
+    delete counts[i];
+  printf("%d workers: %9.0f replies/s\n", workers, replies * 1e6 / elapsed);
+}
+
+int main()
+{
+  printf("%d clients, %d requests in flight each, %u cores\n", CLIENTS, OUTSTANDING,
+         std::thread::hardware_concurrency());
+  int workers[] = { 1, 2, 4, 8 };
+  for (int i = 0; i < 4; i++)
+    run(workers[i]);
+  return 0;
+}
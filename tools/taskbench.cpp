@@ -0,0 +1,141 @@
+// ==============================================================
+//                  ORBITER MODULE: Rcontrol
+//
+// taskbench.cpp
+//
+// Benchmark of manoeuvre tasks sharing one thread. Every
+// manoeuvre waits for a run of deadlines, as a manoeuvre waits
+// for the next state or a reply, once as a ManoeuvreTask on one
+// TaskLoop paced by a TickScheduler and once as a thread of its
+// own sleeping to each deadline. The wall and CPU time, context
+// switches and lateness of the wake-ups are reported for both.
+// ==============================================================
+
+#include "scheduler.h"
+#include "tasks.h"
+#include <chrono>
+#include <iostream>
+#include <thread>
+#include <sys/resource.h>
+
+#define MANOEUVRES 1000
+#define STEPS 50 // deadlines each manoeuvre waits for
+#define STEP_US 2000 // time between them
+#define LOOP_HZ 1000 // rate the task loop is resumed at
+
+/**
+ * @brief Manoeuvre waiting for STEPS deadlines, starting at a random offset
+ */
+class StepTask : public ManoeuvreTask
+{
+public:
+  StepTask() : step(0), lateness(NULL) {}
+  void setup(int64_t startUs, LatencyStats *late) { firstUs = startUs; lateness = late; }
+  int resume(const TaskContext &ctx)
+  {
+    TASK_BEGIN();
+    TASK_AWAIT(ctx.nowUs >= firstUs);
+    for (step = 0; step < STEPS; step++) {
+      TASK_SLEEP_US(ctx, STEP_US);
+      lateness->record(ctx.nowUs - wakeUs);
+    }
+    TASK_END();
+  }
+private:
+  int step;
+  int64_t firstUs;
+  LatencyStats *lateness;
+};
+
+/**
+ * @brief CPU time and context switches of the process so far
+ */
+static void usage(int64_t *cpuUs, long *switches)
+{
+  struct rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+  *cpuUs = (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000LL + ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+  *switches = ru.ru_nvcsw + ru.ru_nivcsw;
+}
+
+/**
+ * @brief Print one line of figures
+ */
+static void report(const char *name, int64_t wallUs, int64_t cpuUs, long switches, const LatencyStats &late)
+{
+  printf("  %-16s wall %5lld ms  cpu %5lld ms  %7ld context switches  late p50 %5lld us  p99 %5lld us\n",
+         name, (long long)wallUs / 1000, (long long)cpuUs / 1000, switches, (long long)late.percentile_us(0.5),
+         (long long)late.percentile_us(0.99));
+}
+
+/**
+ * @brief One manoeuvre as a thread of its own
+ */
+static void step_thread(int64_t startUs, LatencyStats *late)
+{
+  int64_t deadline = startUs;
+  std::chrono::steady_clock::time_point base = std::chrono::steady_clock::now();
+  int64_t baseUs = monotonic_us();
+  for (int step = 0; step <= STEPS; step++) {
+    std::this_thread::sleep_until(base + std::chrono::microseconds(deadline - baseUs));
+    if (step > 0)
+      late->record(monotonic_us() - deadline);
+    deadline += STEP_US;
+  }
+}
+
+int main()
+{
+  printf("%d manoeuvres of %d deadlines %d us apart\n", MANOEUVRES, STEPS, STEP_US);
+  std::vector<StepTask> tasks(MANOEUVRES);
+  TaskLoop loop(MANOEUVRES);
+  LatencyStats late;
+  memset(&late, 0, sizeof(late));
+  int64_t cpu0, cpu1;
+  long sw0, sw1;
+
+  usage(&cpu0, &sw0);
+  int64_t start = monotonic_us();
+  for (int i = 0; i < MANOEUVRES; i++) {
+    tasks[i].setup(start + rand() % STEP_US, &late);
+    loop.spawn(&tasks[i]);
+  }
+  TickScheduler ticks(LOOP_HZ);
+  ticks.start();
+  TaskContext ctx = TaskContext();
+  for (;;) {
+    ctx.tick = (uint32_t)ticks.ticks();
+    ctx.nowUs = monotonic_us();
+    if (loop.run(ctx) == 0)
+      break;
+    ticks.wait_next();
+  }
+  int64_t wall = monotonic_us() - start;
+  usage(&cpu1, &sw1);
+  report("one task loop", wall, cpu1 - cpu0, sw1 - sw0, late);
+
+  std::vector<LatencyStats> threadLate(MANOEUVRES);
+  memset(&threadLate[0], 0, sizeof(LatencyStats) * MANOEUVRES);
+  std::vector<std::thread> threads;
+  threads.reserve(MANOEUVRES);
+  usage(&cpu0, &sw0);
+  start = monotonic_us();
+  for (int i = 0; i < MANOEUVRES; i++)
+    threads.push_back(std::thread(step_thread, start + rand() % STEP_US, &threadLate[i]));
+  for (int i = 0; i < MANOEUVRES; i++)
+    threads[i].join();
+  wall = monotonic_us() - start;
+  usage(&cpu1, &sw1);
+  // Merge the per-thread histograms, each was only touched by its own thread
+  memset(&late, 0, sizeof(late));
+  for (int i = 0; i < MANOEUVRES; i++) {
+    late.completed += threadLate[i].completed;
+    if (threadLate[i].maxUs > late.maxUs)
+      late.maxUs = threadLate[i].maxUs;
+    for (int b = 0; b < LATENCY_BUCKETS; b++)
+      late.buckets[b] += threadLate[i].buckets[b];
+  }
+  report("thread each", wall, cpu1 - cpu0, sw1 - sw0, late);
+  printf("  state per manoeuvre: %d bytes as a task, a stack of its own as a thread\n", (int)sizeof(StepTask));
+  return 0;
+}
@@ -0,0 +1,166 @@
+// ==============================================================
+//                  ORBITER MODULE: Rcontrol
+//
+// tickbench.cpp
+//
+// Benchmark of control loop pacing. Every tick waits a random
+// time in place of the requests a real tick makes, then the loop
+// is paced either by a fixed sleep after the work, as the
+// autopilot used to be, or by the TickScheduler's absolute
+// deadlines. The rate achieved and the spread of tick starts
+// around the ideal schedule are reported for both. Then ticks
+// that wait on I/O and compute their commands are run with the
+// computing on the same thread and on a planning thread fed
+// through SpscQueues, as NavAP does once on course.
+// ==============================================================
+
+#include "scheduler.h"
+#include "spscqueue.h"
+#include <atomic>
+#include <iostream>
+#include <thread>
+
+#define TICKS 500
+#define QUEUE_DEPTH 8
+
+/**
+ * @brief Record passed between the I/O and planning threads
+ */
+struct BenchRecord {
+  uint32_t tick;
+  int64_t sensedUs;
+};
+
+/**
+ * @brief Spend a random time between two bounds
+ */
+static void work(int64_t minUs, int64_t maxUs)
+{
+  usleep((useconds_t)(minUs + rand() % (maxUs - minUs + 1)));
+}
+
+/**
+ * @brief Print one line of pacing figures
+ */
+static void report(const char *name, double rate, double achieved, const LatencyStats &error, unsigned long overruns)
+{
+  printf("  %-10s %6.1f of %5.1f Hz  start error p50 %6lld us  p99 %6lld us  %4lu overruns\n", name, achieved,
+         rate, (long long)error.percentile_us(0.5), (long long)error.percentile_us(0.99), overruns);
+}
+
+/**
+ * @brief Pace TICKS ticks of random work both ways
+ * @param rate Ticks per second asked for
+ * @param minUs Shortest work per tick
+ * @param maxUs Longest work per tick
+ */
+static void run(double rate, int64_t minUs, int64_t maxUs)
+{
+  int64_t period = (int64_t)(1e6 / rate);
+  printf("%.0f Hz, %lld to %lld us of work per tick:\n", rate, (long long)minUs, (long long)maxUs);
+
+  // A sleep of one period after the work, the time the work
+  // took is added to every tick
+  LatencyStats error;
+  memset(&error, 0, sizeof(error));
+  int64_t start = monotonic_us();
+  for (int tick = 0; tick < TICKS; tick++) {
+    int64_t late = monotonic_us() - (start + tick * period);
+    error.record(late < 0 ? -late : late);
+    work(minUs, maxUs);
+    usleep((useconds_t)period);
+  }
+  report("sleep", rate, TICKS * 1e6 / (monotonic_us() - start), error, 0);
+
+  TickScheduler ticks(rate);
+  ticks.start();
+  for (int tick = 0; tick < TICKS; tick++) {
+    ticks.begin(PHASE_SENSE);
+    work(minUs, maxUs);
+    ticks.wait_next();
+  }
+  report("scheduler", rate, ticks.achieved_hz(), ticks.jitter(), ticks.overruns());
+}
+
+/**
+ * @brief Keep the core busy for a while, in place of the collision math
+ */
+static void compute(int64_t us)
+{
+  int64_t until = monotonic_us() + us;
+  while (monotonic_us() < until)
+    ;
+}
+
+static SpscQueue<BenchRecord, QUEUE_DEPTH> sensed, planned;
+static std::atomic<bool> planning;
+
+/**
+ * @brief Planning thread, answers each sensed record after computing
+ */
+static void plan_loop(int64_t planUs)
+{
+  BenchRecord record;
+  while (planning.load(std::memory_order_acquire)) {
+    if (!sensed.wait(10) || !sensed.pop(&record))
+      continue;
+    compute(planUs);
+    planned.push(record);
+  }
+}
+
+/**
+ * Each tick waits ioUs for its requests and spends planUs working
+ * out its commands, asked for at a rate neither way may reach
+ * @brief Pace TICKS ticks with and without a planning thread
+ */
+static void run_pipeline(double rate, int64_t ioUs, int64_t planUs)
+{
+  printf("%.0f Hz asked, %lld us of I/O and %lld us of planning per tick:\n", rate, (long long)ioUs,
+         (long long)planUs);
+
+  TickScheduler serial(rate);
+  serial.start();
+  for (int tick = 0; tick < TICKS; tick++) {
+    serial.begin(PHASE_SENSE);
+    usleep((useconds_t)ioUs);
+    serial.begin(PHASE_DECIDE);
+    compute(planUs);
+    serial.wait_next();
+  }
+  report("serial", rate, serial.achieved_hz(), serial.jitter(), serial.overruns());
+
+  planning.store(true);
+  std::thread planner(plan_loop, planUs);
+  TickScheduler ticks(rate);
+  LatencyStats age;
+  memset(&age, 0, sizeof(age));
+  ticks.start();
+  for (int tick = 0; tick < TICKS; tick++) {
+    ticks.begin(PHASE_SENSE);
+    usleep((useconds_t)ioUs);
+    BenchRecord record;
+    record.tick = tick;
+    record.sensedUs = monotonic_us();
+    sensed.push(record);
+    while (planned.pop(&record))
+      age.record(monotonic_us() - record.sensedUs);
+    ticks.wait_next();
+  }
+  planning.store(false);
+  planner.join();
+  report("pipelined", rate, ticks.achieved_hz(), ticks.jitter(), ticks.overruns());
+  printf("  %-10s sensed to sent p50 %6lld us  p99 %6lld us\n", "", (long long)age.percentile_us(0.5),
+         (long long)age.percentile_us(0.99));
+}
+
+int main()
+{
+  printf("%d ticks per run\n", TICKS);
+  run(50, 1000, 8000);
+  run(200, 500, 4000);
+  run(200, 2000, 6000);
+  run_pipeline(250, 3000, 3000);
+  run_pipeline(250, 3500, 1500);
+  return 0;
+}